@@ -0,0 +1,178 @@
+/**
+ * @file PlannerBenchmark.cpp
+ * @brief Runs a fixed set of planning queries on a fixed map, with RRTConnect and InformedRRT*:
+ * solve time, path length, collision checks per second and how the checks split between the
+ * hash table and the octrees, and the cost of the edge checks.
+ *
+ * Usage: planner_benchmark se_config.yaml session_dir [queries.csv] [seed] [threads]
+ *
+ * The map is a session saved by the node (save_session, in utils/session): submaps, poses and
+ * hash boxes. queries.csv has one "start_x,start_y,start_z,goal_x,goal_y,goal_z" query per line;
+ * without it, 20 queries between random pairs of submap origins are drawn (same seed, same queries).
+ * OMPL is seeded too, so two runs on the same input sample the same states (with threads = 1:
+ * parallel instances race each other).
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <ompl/util/RandomNumbers.h>
+
+#include <Planner.hpp>
+#include <SupereightInterface.hpp>
+
+namespace {
+
+struct Query {
+  Eigen::Vector3d start;
+  Eigen::Vector3d goal;
+};
+
+typedef std::vector<Query> QueryVector;
+
+bool loadQueries(const std::string &filename, QueryVector &queries)
+{
+  std::ifstream file(filename);
+  if (!file.good()) return false;
+
+  std::string line;
+  while (std::getline(file, line)) {
+    std::stringstream ss(line);
+    Query query;
+    char comma;
+    if (ss >> query.start(0) >> comma >> query.start(1) >> comma >> query.start(2) >> comma
+           >> query.goal(0) >> comma >> query.goal(1) >> comma >> query.goal(2))
+      queries.push_back(query);
+  }
+  return !queries.empty();
+}
+
+void randomQueries(const MapSnapshot &snapshot, const unsigned int seed, QueryVector &queries)
+{
+  // sorted: the unordered_map order is not part of the input
+  std::vector<uint64_t> ids;
+  for (const auto &pose : snapshot.submapPoseLookup) ids.push_back(pose.first);
+  std::sort(ids.begin(), ids.end());
+  if (ids.size() < 2) return;
+
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<size_t> pick(0, ids.size() - 1);
+  while (queries.size() < 20) {
+    const size_t a = pick(rng), b = pick(rng);
+    if (a == b) continue;
+    queries.push_back({snapshot.submapPoseLookup.at(ids[a]).r(), snapshot.submapPoseLookup.at(ids[b]).r()});
+  }
+}
+
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 3) {
+    std::cerr << "Usage: " << argv[0] << " se_config.yaml session_dir [queries.csv] [seed] [threads]\n";
+    return 1;
+  }
+  const std::string seConfig(argv[1]);
+  const std::string session(argv[2]);
+  const unsigned int seed = argc > 4 ? std::strtoul(argv[4], nullptr, 10) : 42;
+  const int threads = argc > 5 ? std::atoi(argv[5]) : 1;
+
+  // before any planner exists: all OMPL samplers derive from it
+  ompl::RNG::setSeed(seed);
+
+  // ============ MAP ============
+
+  const se::MapConfig mapConfig(seConfig);
+  const se::OccupancyDataConfig dataConfig(seConfig);
+  se::PinholeCameraConfig cameraConfig;
+  cameraConfig.readYaml(seConfig);
+  SubmapConfig submapConfig;
+  submapConfig.readYaml(seConfig);
+
+  // only the saved submaps: no integration, nothing started
+  SupereightInterface seInterface(cameraConfig, mapConfig, dataConfig, Eigen::Matrix4d::Identity(), "/tmp", submapConfig);
+  const auto loadStart = std::chrono::steady_clock::now();
+  if (!seInterface.loadSession(session)) {
+    std::cerr << "Could not load the session in " << session << "\n";
+    return 1;
+  }
+  const std::shared_ptr<const MapSnapshot> snapshot = seInterface.getMapSnapshot();
+  std::cout << "map: " << snapshot->submapLookup.size() << " submaps, " << snapshot->hashTable.size()
+            << " hash boxes, loaded in " << std::chrono::duration<double>(std::chrono::steady_clock::now() - loadStart).count()
+            << " s\n";
+
+  QueryVector queries;
+  if (argc > 3) {
+    if (!loadQueries(argv[3], queries)) {
+      std::cerr << "Could not read queries from " << argv[3] << "\n";
+      return 1;
+    }
+  } else {
+    randomQueries(*snapshot, seed, queries);
+  }
+  if (queries.empty()) {
+    std::cerr << "No queries\n";
+    return 1;
+  }
+  std::cout << "queries: " << queries.size() << ", " << std::max(1, threads) << " planner instances each\n\n";
+
+  // ============ PLAN ============
+
+  Planner planner(&seInterface, seConfig);
+  planner.setProfiling(true);
+  planner.setPlannerThreads(std::max(1, threads));
+
+  const std::vector<std::pair<PlannerType, std::string>> types = {
+    {PlannerType::RRTConnect, "RRTConnect"}, {PlannerType::InformedRRTStar, "InformedRRT*"}};
+
+  for (const auto &type : types) {
+    planner.setPlannerType(type.first);
+    planner.resetProfile();
+
+    size_t solved = 0;
+    double length = 0;
+    std::vector<double> times;
+    for (const auto &query : queries) {
+      planner.setStart(query.start);
+      const auto start = std::chrono::steady_clock::now();
+      const bool ok = planner.plan(query.goal);
+      times.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+      if (!ok) continue;
+      solved++;
+      length += planner.getPath().length();
+    }
+
+    std::sort(times.begin(), times.end());
+    double total = 0;
+    for (const double t : times) total += t;
+    const PlannerProfile &profile = planner.getProfile();
+    const double lookups = profile.hashTime + profile.octreeTime;
+
+    std::cout << type.second << ": solved " << solved << "/" << queries.size()
+              << "  solve time mean " << 1e3 * total / times.size() << " ms, median "
+              << 1e3 * times[times.size() / 2] << " ms, max " << 1e3 * times.back() << " ms\n";
+    std::cout << "  path length mean " << (solved ? length / solved : 0.0) << " m\n";
+    std::cout << "  collision checks: " << profile.checks << " ("
+              << (profile.checks ? 100.0 * profile.valid / profile.checks : 0.0) << "% valid), "
+              << (profile.checkTime > 0 ? profile.checks / profile.checkTime : 0.0) << " checks/s, "
+              << 100.0 * profile.checkTime / total << "% of the solve time\n";
+    std::cout << "  sphere lookups: " << (lookups > 0 ? 100.0 * profile.hashTime / lookups : 0.0)
+              << "% hash table, " << (lookups > 0 ? 100.0 * profile.octreeTime / lookups : 0.0) << "% octrees\n";
+    const size_t samples = profile.boxSamples + profile.voxelSamples;
+    std::cout << "  motion checks: " << profile.motions << ", "
+              << (profile.motions ? 1e6 * profile.motionTime / profile.motions : 0.0) << " us each, "
+              << 100.0 * profile.motionTime / total << "% of the solve time\n";
+    std::cout << "  edge samples: " << (samples ? 100.0 * profile.boxSamples / samples : 0.0)
+              << "% cleared by the hash box flags, " << profile.probes << " voxel probes ("
+              << (profile.probes ? 100.0 * profile.memoHits / profile.probes : 0.0) << "% memo hits)\n\n";
+  }
+
+  return 0;
+}
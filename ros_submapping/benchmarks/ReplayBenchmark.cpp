@@ -0,0 +1,257 @@
+/**
+ * @file ReplayBenchmark.cpp
+ * @brief Replays a dataset through okvis and the submapping pipeline as fast as possible (both
+ * blocking, no ROS), then reports integration throughput, submap finalization and hashing cost,
+ * the memory taken by the maps, and the collision checker throughput on them.
+ *
+ * Usage: replay_benchmark okvis_config.yaml se_config.yaml dataset_dir [dbow_dir] [num_checks]
+ *
+ * The dataset is in ASL format (imu0/, cam0/, cam1/, depth0/, each with a data.csv, depth as
+ * 16 bit png in mm), i.e. what utils/asl2rosbag.py turns into a bag. dbow_dir holds
+ * small_voc.yml.gz (default: utils). The pipeline statistics are also written to
+ * replay_stats.csv in the working directory.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glog/logging.h>
+#include <opencv2/opencv.hpp>
+
+#include <okvis/ThreadedSlam.hpp>
+#include <okvis/ViParametersReader.hpp>
+
+#include <PipelineStats.hpp>
+#include <Planner.hpp>
+#include <SupereightInterface.hpp>
+
+namespace {
+
+// one line of an ASL data.csv
+struct Record {
+  int64_t stamp; // ns
+  std::vector<std::string> fields;
+};
+
+bool readCsv(const std::string &filename, std::vector<Record> &records)
+{
+  std::ifstream file(filename);
+  if (!file.good()) return false;
+
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.empty() || line[0] == '#') continue;
+    if (line.back() == '\r') line.pop_back();
+    std::stringstream ss(line);
+    std::string field;
+    Record record;
+    if (!std::getline(ss, field, ',')) continue;
+    record.stamp = std::stoll(field);
+    while (std::getline(ss, field, ',')) record.fields.push_back(field);
+    records.push_back(record);
+  }
+  return !records.empty();
+}
+
+okvis::Time toTime(const int64_t stamp)
+{
+  return okvis::Time(stamp / 1000000000, stamp % 1000000000);
+}
+
+void printDuration(const char *name, const Histogram &histogram)
+{
+  const Histogram::Summary summary = histogram.summary();
+  std::cout << "  " << name << ": " << summary.count << " x  mean " << summary.mean * 1e-3
+            << " ms  p90 " << summary.p90 * 1e-3 << " ms  max " << summary.max * 1e-3 << " ms\n";
+}
+
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 4) {
+    std::cerr << "Usage: " << argv[0] << " okvis_config.yaml se_config.yaml dataset_dir [dbow_dir] [num_checks]\n";
+    return 1;
+  }
+  const std::string okvisConfig(argv[1]);
+  const std::string seConfig(argv[2]);
+  const std::string dataset(argv[3]);
+  const std::string dBowVocDir = argc > 4 ? argv[4] : "utils";
+  const size_t numChecks = argc > 5 ? std::strtoul(argv[5], nullptr, 10) : 1000000;
+
+  google::InitGoogleLogging(argv[0]);
+  FLAGS_stderrthreshold = 1; // warnings and up
+
+  // ============ DATASET ============
+
+  std::vector<Record> imu, cam0, cam1, depth;
+  if (!readCsv(dataset + "/imu0/data.csv", imu) || !readCsv(dataset + "/cam0/data.csv", cam0)
+      || !readCsv(dataset + "/cam1/data.csv", cam1) || !readCsv(dataset + "/depth0/data.csv", depth)) {
+    std::cerr << "Could not read the ASL dataset in " << dataset << "\n";
+    return 1;
+  }
+  std::cout << "dataset: " << imu.size() << " imu, " << cam0.size() << " stereo, " << depth.size() << " depth\n";
+
+  // ============ PIPELINE (as the node sets it up) ============
+
+  okvis::ViParameters parameters;
+  okvis::ViParametersReader viParametersReader(okvisConfig);
+  viParametersReader.getParameters(parameters);
+
+  okvis::ThreadedSlam estimator(parameters, dBowVocDir);
+  estimator.setBlocking(true);
+
+  const se::MapConfig mapConfig(seConfig);
+  const se::OccupancyDataConfig dataConfig(seConfig);
+  se::PinholeCameraConfig cameraConfig;
+  cameraConfig.readYaml(seConfig);
+  SubmapConfig submapConfig;
+  submapConfig.readYaml(seConfig);
+  // every frame integrated, whatever the wall clock: runs are comparable
+  submapConfig.scheduler.decimate = false;
+  std::cout << "frame decimation: " << (submapConfig.scheduler.decimate ? "on" : "off") << "\n";
+  const Eigen::Matrix4d T_SC = parameters.nCameraSystem.T_SC(0)->T();
+
+  SupereightInterface seInterface(cameraConfig, mapConfig, dataConfig, T_SC, "/tmp", submapConfig);
+  seInterface.setBlocking(true);
+  // meshes are extracted when someone listens: count them in the finalization cost
+  seInterface.setSubmapMeshesCallback([](uint64_t, const std::shared_ptr<const SubmapMesh> &,
+                                         const std::unordered_map<uint64_t, Transformation> &) {});
+
+  Planner planner(&seInterface, seConfig);
+
+  estimator.setOptimisedGraphCallback([&](const okvis::State &state, const okvis::TrackingState &trackingState,
+                                          std::shared_ptr<const okvis::AlignedVector<okvis::State>> keyframeStates,
+                                          std::shared_ptr<const okvis::MapPointVector>) {
+    planner.processState(state, trackingState);
+    seInterface.stateUpdateCallback(state, trackingState, keyframeStates);
+  });
+
+  seInterface.start();
+
+  // ============ REPLAY ============
+
+  // all sensors in time order, fed as fast as the (blocking) queues take them
+  std::atomic<bool> fed(false);
+  const auto replayStart = std::chrono::steady_clock::now();
+  std::thread feeder([&] {
+    size_t i = 0, c = 0, d = 0;
+    while (i < imu.size() || c < std::min(cam0.size(), cam1.size()) || d < depth.size()) {
+      const int64_t ti = i < imu.size() ? imu[i].stamp : INT64_MAX;
+      const int64_t tc = c < std::min(cam0.size(), cam1.size()) ? cam0[c].stamp : INT64_MAX;
+      const int64_t td = d < depth.size() ? depth[d].stamp : INT64_MAX;
+
+      if (ti <= tc && ti <= td) {
+        const auto &f = imu[i++].fields; // w_RS_S xyz, a_RS_S xyz
+        estimator.addImuMeasurement(toTime(ti), Eigen::Vector3d(std::stod(f[3]), std::stod(f[4]), std::stod(f[5])),
+                                    Eigen::Vector3d(std::stod(f[0]), std::stod(f[1]), std::stod(f[2])));
+      } else if (tc <= td) {
+        std::vector<cv::Mat> images;
+        images.push_back(cv::imread(dataset + "/cam0/data/" + cam0[c].fields[0], cv::IMREAD_GRAYSCALE));
+        images.push_back(cv::imread(dataset + "/cam1/data/" + cam1[c].fields[0], cv::IMREAD_GRAYSCALE));
+        c++;
+        estimator.addImages(toTime(tc) - okvis::Duration(parameters.camera.image_delay), images);
+      } else {
+        const cv::Mat raw = cv::imread(dataset + "/depth0/data/" + depth[d++].fields[0], cv::IMREAD_ANYDEPTH);
+        cv::Mat metres;
+        raw.convertTo(metres, CV_32FC1, 1.f / 1000.f);
+        seInterface.addDepthImage(toTime(td) - okvis::Duration(parameters.camera.image_delay), metres);
+      }
+    }
+    fed = true;
+  });
+
+  // okvis processes on this thread, like in the node
+  while (!fed) estimator.processFrame();
+  feeder.join();
+  while (estimator.processFrame()) {}
+
+  // let the mapping drain. frames newer than the last okvis update never get a pose
+  const std::shared_ptr<const PipelineStats> stats = seInterface.getPipelineStats();
+  uint64_t integrated = stats->duration(PipelineStats::Stage::Integration).summary().count;
+  auto lastProgress = std::chrono::steady_clock::now();
+  while (seInterface.pendingWork() && std::chrono::steady_clock::now() - lastProgress < std::chrono::seconds(3)) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    const uint64_t count = stats->duration(PipelineStats::Stage::Integration).summary().count;
+    if (count != integrated) {
+      integrated = count;
+      lastProgress = std::chrono::steady_clock::now();
+    }
+  }
+  // stalled: the replay ended with the last integrated frame
+  const auto replayEnd = seInterface.pendingWork() ? lastProgress : std::chrono::steady_clock::now();
+  const double replaySeconds = std::chrono::duration<double>(replayEnd - replayStart).count();
+
+  // ============ REPORT ============
+
+  const Histogram::Summary integration = stats->duration(PipelineStats::Stage::Integration).summary();
+  std::cout << "\nreplay: " << replaySeconds << " s, " << integration.count << " of " << depth.size()
+            << " depth frames integrated (" << stats->skipped() << " skipped by the scheduler)\n";
+  std::cout << "integration: " << integration.count / replaySeconds << " frames/s end to end, "
+            << (integration.mean > 0 ? 1e6 / integration.mean : 0.0) << " frames/s integration only\n";
+  std::cout << "stages:\n";
+  for (int s = 0; s < static_cast<int>(PipelineStats::Stage::Count); s++)
+    printDuration(PipelineStats::name(PipelineStats::Stage(s)), stats->duration(PipelineStats::Stage(s)));
+
+  const Histogram::Summary hashing = stats->duration(PipelineStats::Stage::Hashing).summary();
+  const Histogram::Summary meshing = stats->duration(PipelineStats::Stage::Meshing).summary();
+  std::cout << "submap finalization: " << hashing.count << " submaps, mean "
+            << (hashing.mean + meshing.mean) * 1e-3 << " ms (hashing " << hashing.mean * 1e-3
+            << " ms, meshing " << meshing.mean * 1e-3 << " ms)\n";
+
+  // the active submap is the one measured last (by the memory budget check, if any)
+  const MemoryStats memory = seInterface.getMemoryStats();
+  const double MB = 1.0 / (1024 * 1024);
+  std::cout << "memory: " << memory.totalBytes() * MB << " MB (octrees " << memory.resident.bytes * MB
+            << " MB in " << memory.resident.blocks << " blocks and " << memory.resident.nodes << " nodes, hash table "
+            << (memory.hashBytes + memory.hashInverseBytes) * MB << " MB at load factor " << memory.hashLoadFactor
+            << ", snapshot " << memory.snapshotBytes * MB << " MB, distance layers " << memory.esdfBytes * MB << " MB)\n";
+
+  if (!stats->writeCsv("replay_stats.csv")) std::cerr << "Could not write replay_stats.csv\n";
+
+  // ============ COLLISION CHECKS ============
+
+  if (!planner.updateMapSnapshot()) {
+    std::cout << "no hashed submaps: collision checks skipped\n";
+    return 0;
+  }
+
+  // states around the submaps, like the planner samples them
+  const std::shared_ptr<const MapSnapshot> snapshot = seInterface.getMapSnapshot();
+  std::vector<Eigen::Vector3d> centres;
+  for (const auto &pose : snapshot->submapPoseLookup) centres.push_back(pose.second.r());
+
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<size_t> pick(0, centres.size() - 1);
+  std::uniform_real_distribution<double> offset(-submapConfig.distThreshold, submapConfig.distThreshold);
+  ob::StateSpacePtr space(std::make_shared<ob::RealVectorStateSpace>(3));
+  std::vector<ob::ScopedState<ob::RealVectorStateSpace>> states;
+  states.reserve(1 << 14);
+  for (size_t i = 0; i < (1 << 14); i++) {
+    const Eigen::Vector3d r = centres[pick(rng)] + Eigen::Vector3d(offset(rng), offset(rng), 0.25 * offset(rng));
+    states.emplace_back(space);
+    for (int k = 0; k < 3; k++) (*states.back())[k] = r[k];
+  }
+
+  size_t valid = 0;
+  const auto checksStart = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < numChecks; i++) {
+    if (planner.detectCollision(states[i & (states.size() - 1)].get())) valid++;
+  }
+  const double checksSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - checksStart).count();
+
+  std::cout << "collision checks: " << numChecks / checksSeconds << " checks/s ("
+            << 1e9 * checksSeconds / numChecks << " ns each), " << 100.0 * valid / numChecks << "% valid\n";
+
+  return 0;
+}
@@ -0,0 +1,172 @@
+/**
+ * @file SpatialHashBenchmark.cpp
+ * @brief Compares the flat SpatialHash against the old unordered_map<Vector3i, unordered_set<int>> layout:
+ * probe latency and memory per cell.
+ *
+ * Usage: spatial_hash_benchmark [hash_cells.csv] [num_probes]
+ *
+ * The csv ("x,y,z,id" per line) is written by the node on shutdown with save_hash_table on (utils/hash_cells.csv), so running
+ * it on e.g. a uHumans bag gives the real cell layout. Without a file, a synthetic layout is used:
+ * 20m submaps along a corridor, rotated around z, hashed on a 1m grid.
+ */
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <SpatialHash.hpp>
+
+namespace {
+
+// counts the bytes allocated by the std containers
+size_t allocatedBytes = 0;
+
+template <typename T>
+struct CountingAllocator {
+  typedef T value_type;
+  CountingAllocator() = default;
+  template <typename U> CountingAllocator(const CountingAllocator<U> &) {}
+  T* allocate(const size_t n) {
+    allocatedBytes += n * sizeof(T);
+    return static_cast<T*>(::operator new(n * sizeof(T)));
+  }
+  void deallocate(T* p, const size_t n) {
+    allocatedBytes -= n * sizeof(T);
+    ::operator delete(p);
+  }
+  template <typename U> bool operator==(const CountingAllocator<U> &) const { return true; }
+  template <typename U> bool operator!=(const CountingAllocator<U> &) const { return false; }
+};
+
+// the hash we used before (teschner 2003)
+struct LegacySpatialHasher {
+  std::size_t operator()(const Eigen::Vector3i& a) const {
+    const int p1 = 73856093;
+    const int p2 = 19349663;
+    const int p3 = 83492791;
+    return a[0]*p1 ^ a[1]*p2 ^ a[2]*p3;
+  }
+};
+
+typedef std::unordered_set<int, std::hash<int>, std::equal_to<int>, CountingAllocator<int>> LegacyIdSet;
+typedef std::unordered_map<Eigen::Vector3i, LegacyIdSet, LegacySpatialHasher, std::equal_to<Eigen::Vector3i>,
+                           CountingAllocator<std::pair<const Eigen::Vector3i, LegacyIdSet>>> LegacyHashTable;
+
+struct Entry {
+  Eigen::Vector3i pos;
+  int id;
+};
+
+bool loadEntries(const std::string &filename, std::vector<Entry> &entries)
+{
+  std::ifstream file(filename);
+  if (!file.good()) return false;
+
+  std::string line;
+  while (std::getline(file, line)) {
+    std::stringstream ss(line);
+    Entry entry;
+    char comma;
+    if (ss >> entry.pos(0) >> comma >> entry.pos(1) >> comma >> entry.pos(2) >> comma >> entry.id)
+      entries.push_back(entry);
+  }
+  return !entries.empty();
+}
+
+void syntheticEntries(std::vector<Entry> &entries)
+{
+  // submaps every 3m along x, slowly turning; each covers a 20x20x8 m box
+  for (int id = 0; id < 200; id++) {
+    const float yaw = 0.05f * id;
+    const Eigen::Vector3f centre(3.f * id, 5.f * std::sin(0.1f * id), 0.f);
+    const float c = std::cos(yaw), s = std::sin(yaw);
+    std::unordered_set<Eigen::Vector3i, LegacySpatialHasher> cells;
+    for (float x = -10; x <= 10; x += 0.5f) {
+      for (float y = -10; y <= 10; y += 0.5f) {
+        for (float z = -4; z <= 4; z += 0.5f) {
+          const Eigen::Vector3f p = centre + Eigen::Vector3f(c * x - s * y, s * x + c * y, z);
+          cells.insert(Eigen::Vector3i(std::floor(p(0)), std::floor(p(1)), std::floor(p(2))));
+        }
+      }
+    }
+    for (const auto &pos : cells) entries.push_back({pos, id});
+  }
+}
+
+}
+
+int main(int argc, char** argv)
+{
+  std::vector<Entry> entries;
+  if (argc > 1) {
+    if (!loadEntries(argv[1], entries)) {
+      std::cerr << "Could not read cells from " << argv[1] << "\n";
+      return 1;
+    }
+  } else {
+    syntheticEntries(entries);
+  }
+  const size_t numProbes = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 10000000;
+
+  // ============ BUILD ============
+
+  const size_t bytesBefore = allocatedBytes;
+  LegacyHashTable legacy;
+  for (const auto &entry : entries) legacy[entry.pos].insert(entry.id);
+  const size_t legacyBytes = allocatedBytes - bytesBefore;
+
+  SpatialHash flat;
+  for (const auto &entry : entries) flat.insert(entry.pos, entry.id);
+
+  std::cout << "entries: " << entries.size() << "  cells: " << flat.size() << "\n\n";
+  std::cout << "memory per cell   legacy: " << static_cast<double>(legacyBytes) / legacy.size()
+            << " B   flat: " << static_cast<double>(flat.memoryUsage()) / flat.size()
+            << " B (load factor " << flat.loadFactor() << ")\n";
+
+  // ============ PROBE ============
+
+  // queries like the collision checker's: points around the mapped cells, a few misses
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<size_t> pick(0, entries.size() - 1);
+  std::uniform_int_distribution<int> jitter(-2, 2);
+  std::vector<Eigen::Vector3i> queries(1 << 16);
+  for (auto &query : queries)
+    query = entries[pick(rng)].pos + Eigen::Vector3i(jitter(rng), jitter(rng), jitter(rng));
+
+  size_t legacySum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < numProbes; i++) {
+    const auto it = legacy.find(queries[i & (queries.size() - 1)]);
+    if (it != legacy.end()) for (const int id : it->second) legacySum += id;
+  }
+  const double legacyNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / numProbes;
+
+  size_t flatSum = 0;
+  start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < numProbes; i++) {
+    const SpatialHash::Cell* cell = flat.find(queries[i & (queries.size() - 1)]);
+    if (cell) flat.forEachId(*cell, [&](const int id) { flatSum += id; });
+  }
+  const double flatNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / numProbes;
+
+  if (legacySum != flatSum) {
+    std::cerr << "Mismatch between the two tables!\n";
+    return 1;
+  }
+
+  std::cout << "probe latency     legacy: " << legacyNs << " ns   flat: " << flatNs << " ns\n";
+
+  // bucket collisions of the legacy hasher
+  size_t maxBucket = 0;
+  for (size_t b = 0; b < legacy.bucket_count(); b++) maxBucket = std::max(maxBucket, legacy.bucket_size(b));
+  std::cout << "legacy largest bucket: " << maxBucket << " cells\n";
+
+  return 0;
+}
@@ -0,0 +1,83 @@
+#ifndef INCLUDE_BUFFERPOOL_HPP_
+#define INCLUDE_BUFFERPOOL_HPP_
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/**
+ * @brief Bounded pool of recycled buffers for the integration pipeline (e.g. depth
+ * frames). acquire() hands out a buffer that nobody else holds anymore: a buffer goes
+ * back to the pool as soon as the last shared_ptr to it (e.g. the consumed
+ * SupereightFrame) is released, without any allocation. Once the pool is at capacity and
+ * every buffer is in use, acquire() falls back to a one-off allocation (counted as a miss).
+ *
+ */
+template <typename T>
+class BufferPool {
+public:
+
+  /**
+   * @brief      Constructs the pool.
+   *
+   * @param[in]  capacity  Max number of pooled buffers.
+   * @param[in]  allocate  Allocates a new buffer.
+   * @param[in]  initial   Buffers allocated right away.
+   */
+  BufferPool(const size_t capacity, std::function<std::shared_ptr<T>()> allocate, const size_t initial = 0)
+      : capacity_(capacity), allocate_(std::move(allocate)), next_(0), misses_(0) {
+    for (size_t i = 0; i < initial && i < capacity_; i++) slots_.push_back(allocate_());
+  }
+
+  /**
+   * @brief      Gets a buffer. Its content is whatever the last user left there.
+   */
+  std::shared_ptr<T> acquire() {
+    std::lock_guard<std::mutex> lk(mutex_);
+
+    // round robin over the slots, the oldest released buffers come first
+    for (size_t n = 0; n < slots_.size(); n++) {
+      const size_t i = (next_ + n) % slots_.size();
+      if (slots_[i].use_count() == 1) {
+        // only the pool holds it: the release by the last user happened before this point
+        std::atomic_thread_fence(std::memory_order_acquire);
+        next_ = (i + 1) % slots_.size();
+        return slots_[i];
+      }
+    }
+
+    if (slots_.size() < capacity_) {
+      slots_.push_back(allocate_());
+      return slots_.back();
+    }
+
+    misses_++;
+    return allocate_();
+  }
+
+  /**
+   * @brief      Number of acquire() calls that had to allocate an unpooled buffer.
+   */
+  size_t misses() const { return misses_; }
+
+  /**
+   * @brief      Number of pooled buffers.
+   */
+  size_t size() {
+    std::lock_guard<std::mutex> lk(mutex_);
+    return slots_.size();
+  }
+
+private:
+  const size_t capacity_;
+  std::function<std::shared_ptr<T>()> allocate_;
+
+  std::mutex mutex_;
+  std::vector<std::shared_ptr<T>> slots_;
+  size_t next_;
+  std::atomic<size_t> misses_;
+};
+
+#endif /* INCLUDE_BUFFERPOOL_HPP_ */
@@ -0,0 +1,64 @@
+#ifndef INCLUDE_DEPTHPREPROCESSOR_HPP_
+#define INCLUDE_DEPTHPREPROCESSOR_HPP_
+
+#include <cstddef>
+
+/**
+ * @brief Depth preprocessing options.
+ *
+ */
+struct DepthPreprocessorConfig {
+  enum class Pooling { Min, Median };
+
+  static constexpr int kMaxDownsampling = 4;
+
+  int downsampling = 1;            // integer downsampling factor: 1 (off), 2 or 4 (kMaxDownsampling)
+  Pooling pooling = Pooling::Min;  // how a block of pixels becomes one pixel
+  bool clipRange = false;          // mark pixels outside [nearPlane, farPlane] invalid
+  float nearPlane = 0.f;           // set from the camera config
+  float farPlane = 0.f;
+};
+
+/**
+ * @brief Preprocesses the depth frames before integration: integer downsampling (min
+ * or median of the valid pixels of each block) and range clipping. Invalid pixels (NaN,
+ * non positive, out of range) are written as 0, which supereight skips. The pixel
+ * loops are branch free so the compiler can vectorize them.
+ *
+ */
+class DepthPreprocessor {
+public:
+
+  /**
+   * @brief      Constructs the preprocessor.
+   *
+   * @param[in]  config  Preprocessing options.
+   */
+  explicit DepthPreprocessor(const DepthPreprocessorConfig &config);
+
+  /**
+   * @brief      False if the frames pass through unchanged.
+   */
+  bool enabled() const { return config_.downsampling > 1 || config_.clipRange; }
+
+  /**
+   * @brief      Size of the output frame for a given input size.
+   */
+  int outputSize(const int inputSize) const { return inputSize / config_.downsampling; }
+
+  /**
+   * @brief      Preprocesses a frame.
+   *
+   * @param[in]  input   Input depth (m), row major.
+   * @param[in]  width   Input width.
+   * @param[in]  height  Input height.
+   * @param[in]  stride  Floats between the starts of two input rows.
+   * @param[out] output  Output depth, outputSize(width) x outputSize(height).
+   */
+  void process(const float *input, const int width, const int height, const size_t stride, float *output) const;
+
+private:
+  const DepthPreprocessorConfig config_;
+};
+
+#endif /* INCLUDE_DEPTHPREPROCESSOR_HPP_ */
@@ -0,0 +1,96 @@
+#ifndef INCLUDE_FRAMESCHEDULER_HPP_
+#define INCLUDE_FRAMESCHEDULER_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <okvis/kinematics/Transformation.hpp>
+
+/**
+ * @brief Queue bounds and depth frame decimation policy.
+ *
+ */
+struct FrameSchedulerConfig {
+  int depthQueueSize = 100;       // depth frames waiting for a pose
+  int supereightQueueSize = 500;  // frames waiting for integration
+  int stateQueueSize = 100;       // okvis states in the pose cache (5 s at 20 Hz)
+  bool decimate = true;           // skip depth frames when integration falls behind (never in blocking mode)
+  float latencyBudget = 0.5f;     // target latency (s) from depth arrival to integrated frame
+  int keyframeFrames = 3;         // frames always kept after a keyframe switch
+  float minTranslation = 0.1f;    // frames that moved more than this (m) since the last kept one...
+  float minRotation = 0.1f;       // ... or rotated more than this (rad) are kept over budget anyway
+  int maxConsecutiveSkips = 10;   // never skip more frames than this in a row
+};
+
+/**
+ * @brief Decides which depth frames get integrated. Integration time and end to end
+ * latency are tracked with moving averages (reported by the integration thread). While
+ * the latency predicted for a new frame is within budget every frame is kept; beyond
+ * that only the frames next to a keyframe switch or with enough parallax wrt the last
+ * kept frame are. Thread safe.
+ *
+ */
+class FrameScheduler {
+public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  /**
+   * @brief      Constructs the scheduler.
+   *
+   * @param[in]  config  Decimation policy.
+   */
+  explicit FrameScheduler(const FrameSchedulerConfig &config);
+
+  /**
+   * @brief      Decides whether to integrate a frame.
+   *
+   * @param[in]  T_WC        Pose of the frame.
+   * @param[in]  keyframeId  Keyframe the frame would be integrated with.
+   * @param[in]  waited      Time (s) the frame already spent since its arrival.
+   * @param[in]  queued      Frames already waiting for integration.
+   * @param[in]  force       Keep it whatever the latency (e.g. loop closures). It counts as a
+   * kept frame for the parallax and the skip count.
+   *
+   * @return     True if the frame should be integrated.
+   */
+  bool accept(const okvis::kinematics::Transformation &T_WC, const uint64_t keyframeId,
+              const double waited, const size_t queued, const bool force = false);
+
+  /**
+   * @brief      Reports an integrated frame.
+   *
+   * @param[in]  integrationTime  Time (s) spent integrating it.
+   * @param[in]  latency          Time (s) from its arrival to the end of the integration.
+   */
+  void reportIntegration(const double integrationTime, const double latency);
+
+  /**
+   * @brief      Moving average of the integration time (s).
+   */
+  double integrationTime() const;
+
+  /**
+   * @brief      Moving average of the end to end latency (s).
+   */
+  double latency() const;
+
+  /**
+   * @brief      Number of frames skipped so far.
+   */
+  size_t skipped() const;
+
+private:
+  const FrameSchedulerConfig config_;
+
+  mutable std::mutex mutex_;
+  double integrationTime_; // moving averages, 0 until the first report
+  double latency_;
+  bool havePose_;
+  okvis::kinematics::Transformation T_WC_last_; // last kept frame
+  uint64_t keyframeId_;    // keyframe of the last frame
+  int sinceKeyframe_;      // frames since the keyframe switch
+  int consecutiveSkips_;
+  size_t skipped_;
+};
+
+#endif /* INCLUDE_FRAMESCHEDULER_HPP_ */
@@ -0,0 +1,99 @@
+#ifndef INCLUDE_KEYFRAMEPOSESTORE_HPP_
+#define INCLUDE_KEYFRAMEPOSESTORE_HPP_
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <Eigen/StdVector>
+#include <okvis/ViInterface.hpp>
+#include <okvis/kinematics/Transformation.hpp>
+
+/**
+ * @brief Contains essential data about a keyframe: its Id and transformation.
+ *
+ */
+struct KeyframeData {
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  uint64_t id;
+  okvis::kinematics::Transformation T_WM;
+  KeyframeData(const uint64_t &id = 0,
+               const okvis::kinematics::Transformation &T_WM = okvis::kinematics::Transformation::Identity())
+      : id(id), T_WM(T_WM){};
+};
+
+typedef std::vector<KeyframeData, Eigen::aligned_allocator<KeyframeData>>
+    KeyFrameDataVec;
+
+/**
+ * @brief Versioned store of the keyframe (i.e. submap) poses. Written by the okvis
+ * callback, read by the integration thread. Every pose that actually changes gets a
+ * new version number, so readers remembering the last version they applied can fetch
+ * only the poses that changed since, instead of the whole keyframe list.
+ *
+ * The changes are kept until read, so the reader can stop at an older version than the
+ * current one: the one a depth frame was predicted with, whose keyframe poses match its
+ * camera pose (later ones can hold a loop closure correction the frame does not have).
+ * There is a single reader.
+ *
+ */
+class KeyframePoseStore {
+public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  /**
+   * @brief      Constructs an empty store.
+   *
+   * @param[in]  T_SC  Transformation of the depth camera wrt the IMU: the stored
+   * poses are the camera ones (T_WS * T_SC).
+   */
+  explicit KeyframePoseStore(const okvis::kinematics::Transformation &T_SC) : T_SC_(T_SC), version_(0) {}
+
+  /**
+   * @brief      Sets the poses of the given (keyframe) states. Unchanged poses keep
+   * their version.
+   *
+   * @param[in]  states  Updated states from okvis.
+   *
+   * @return     The store version after the update.
+   */
+  uint64_t update(const okvis::AlignedVector<okvis::State> &states);
+
+  /**
+   * @brief      Current version (0: nothing stored yet).
+   */
+  uint64_t version() const;
+
+  /**
+   * @brief      Gets the poses that changed after a given version, as they were at a later
+   * one. The changes up to it are forgotten: the reader never goes back.
+   *
+   * @param[in]  since    Last version the caller applied.
+   * @param[in]  until    Version to bring the caller to.
+   * @param[out] changed  The changed poses (each id once, at its value at until).
+   *
+   * @return     The version the output is up to date with (pass it as since next time):
+   * until, capped to the current version, and never below since.
+   */
+  uint64_t getChangedSince(const uint64_t since, const uint64_t until, KeyFrameDataVec &changed);
+
+  /**
+   * @brief      Number of stored poses.
+   */
+  size_t size() const;
+
+private:
+
+  const okvis::kinematics::Transformation T_SC_;
+
+  mutable std::mutex mutex_;
+  std::unordered_map<uint64_t, okvis::kinematics::Transformation, std::hash<uint64_t>, std::equal_to<uint64_t>,
+                     Eigen::aligned_allocator<std::pair<const uint64_t, okvis::kinematics::Transformation>>> poses_;
+  std::map<uint64_t, KeyframeData, std::less<uint64_t>,
+           Eigen::aligned_allocator<std::pair<const uint64_t, KeyframeData>>> changes_; // (version, new pose), not read yet
+  std::unordered_map<uint64_t, size_t> changedScratch_; // id -> index in the output
+  uint64_t version_;
+};
+
+#endif /* INCLUDE_KEYFRAMEPOSESTORE_HPP_ */
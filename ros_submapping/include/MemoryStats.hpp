@@ -0,0 +1,90 @@
+#ifndef INCLUDE_MEMORYSTATS_HPP_
+#define INCLUDE_MEMORYSTATS_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Octants of a submap octree and the memory they take: the leaves are counted,
+ * their parents estimated (roughly one per 8 leaves).
+ *
+ */
+struct OctreeMemory {
+  size_t blocks = 0; // allocated voxel blocks
+  size_t nodes = 0;  // leaf nodes, data without voxels
+  size_t bytes = 0;
+};
+
+/**
+ * @brief Memory of one submap.
+ *
+ */
+struct SubmapMemory {
+  uint64_t id = 0;
+  float res = 0.f;       // voxel size (m)
+  bool active = false;   // being integrated: measured by the processing thread, can lag a few frames
+  bool resident = true;  // false once evicted, the counts are the ones it had in memory
+  OctreeMemory octree;
+};
+
+/**
+ * @brief Where the mapping memory goes, sampled by SupereightInterface::getMemoryStats().
+ * Bytes are payload estimates (container capacities times element sizes) without allocator
+ * overhead: good to follow trends and compare the parts, not to match the process RSS.
+ *
+ */
+struct MemoryStats {
+  double stamp = 0.0; // wall time of the sample (s)
+
+  // submaps, by id. the totals are over the resident ones
+  std::vector<SubmapMemory> submaps;
+  OctreeMemory resident;
+  size_t evicted = 0;     // submaps on disk
+  size_t bytesOnDisk = 0;
+
+  // spatial hash and its inverse (the boxes of each submap)
+  size_t hashCells = 0;
+  size_t hashCapacity = 0;
+  double hashLoadFactor = 0.0;
+  size_t hashBytes = 0;
+  size_t hashInverseBytes = 0;
+
+  // latest planner snapshot: its own copy of the hash table plus the lookups. the submaps
+  // and distance layers are shared, the latter are counted in esdfBytes
+  uint64_t snapshotVersion = 0;
+  size_t snapshotBytes = 0;
+  size_t esdfBytes = 0;
+
+  // depth frames waiting for a pose / for integration, all the same size
+  size_t depthQueueFrames = 0;
+  size_t supereightQueueFrames = 0;
+  size_t depthFrameBytes = 0; // one frame
+  size_t depthPoolFrames = 0; // allocated by the pool so far
+  size_t depthPoolMisses = 0; // frames allocated outside of it
+  size_t poseCacheBytes = 0;
+
+  /**
+   * @brief      Bytes of the queued depth frames (mostly pool buffers).
+   */
+  size_t queueBytes() const { return (depthQueueFrames + supereightQueueFrames) * depthFrameBytes; }
+
+  /**
+   * @brief      Sum of the parts: resident octrees, hash tables, snapshot, distance layers,
+   * depth frames (pooled or queued, whichever is more) and pose cache.
+   */
+  size_t totalBytes() const;
+
+  /**
+   * @brief      Writes the totals as one CSV row (no per submap columns).
+   *
+   * @param[in]  filename  The file.
+   * @param[in]  first     Truncates the file and writes the header first.
+   *
+   * @return     False if the file could not be written.
+   */
+  bool writeCsvRow(const std::string &filename, const bool first) const;
+};
+
+#endif /* INCLUDE_MEMORYSTATS_HPP_ */
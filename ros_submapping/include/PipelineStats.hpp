@@ -0,0 +1,159 @@
+#ifndef INCLUDE_PIPELINESTATS_HPP_
+#define INCLUDE_PIPELINESTATS_HPP_
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * @brief Lock free histogram with power of two buckets: bucket 0 counts the zeros,
+ * bucket b the values in [2^(b-1), 2^b). Any thread can add, any thread can read.
+ *
+ */
+class Histogram {
+public:
+  static constexpr int kBuckets = 40;
+
+  /**
+   * @brief Summary of the values added so far. Percentiles are the upper bound of the
+   * bucket they fall in (capped to the maximum).
+   *
+   */
+  struct Summary {
+    uint64_t count = 0;
+    double mean = 0.0;
+    uint64_t p50 = 0;
+    uint64_t p90 = 0;
+    uint64_t p99 = 0;
+    uint64_t max = 0;
+  };
+
+  Histogram();
+
+  /**
+   * @brief      Adds a value.
+   *
+   * @param[in]  value  The value.
+   */
+  void add(const uint64_t value);
+
+  /**
+   * @brief      Summary of the values added so far.
+   */
+  Summary summary() const;
+
+  /**
+   * @brief      Values added to a bucket so far.
+   *
+   * @param[in]  bucket  Bucket index, in [0, kBuckets).
+   */
+  uint64_t bucket(const int bucket) const { return buckets_[bucket].load(std::memory_order_relaxed); }
+
+private:
+  std::array<std::atomic<uint64_t>, kBuckets> buckets_;
+  std::atomic<uint64_t> count_;
+  std::atomic<uint64_t> sum_;
+  std::atomic<uint64_t> max_;
+};
+
+/**
+ * @brief Timing of the mapping pipeline: per stage durations, depths of the queues
+ * and dropped frames. Lock free, cheap enough to be fed for every frame by every thread.
+ *
+ */
+class PipelineStats {
+public:
+
+  /// \brief Timed stages, in pipeline order.
+  enum class Stage {
+    DepthQueue,       // depth arrival to the start of the pose prediction
+    Prediction,       // pose prediction
+    SupereightQueue,  // waiting for integration
+    Integration,      // depth integration
+    EndToEnd,         // depth arrival to the end of its integration
+    Hashing,          // spatial hashing of a finished submap
+    Meshing,          // mesh extraction of a finished submap
+    Publishing,       // submap visualization callbacks
+    Count
+  };
+
+  /// \brief Monitored queues.
+  enum class Queue {
+    Depth,
+    State,
+    Supereight,
+    Count
+  };
+
+  PipelineStats();
+
+  /**
+   * @brief      Records the duration of a stage.
+   *
+   * @param[in]  stage    The stage.
+   * @param[in]  seconds  Its duration (s).
+   */
+  void addDuration(const Stage stage, const double seconds);
+
+  /**
+   * @brief      Records the depth of a queue.
+   *
+   * @param[in]  queue  The queue.
+   * @param[in]  depth  Number of elements in it.
+   */
+  void addQueueDepth(const Queue queue, const size_t depth);
+
+  /**
+   * @brief      Records an element dropped from a full queue.
+   *
+   * @param[in]  queue  The queue.
+   */
+  void addDrop(const Queue queue);
+
+  /**
+   * @brief      Records a depth frame skipped by the frame scheduler.
+   */
+  void addSkip() { skipped_.fetch_add(1, std::memory_order_relaxed); }
+
+  /**
+   * @brief      Durations of a stage, in microseconds.
+   */
+  const Histogram &duration(const Stage stage) const { return durations_[static_cast<int>(stage)]; }
+
+  /**
+   * @brief      Depths of a queue.
+   */
+  const Histogram &queueDepth(const Queue queue) const { return queueDepths_[static_cast<int>(queue)]; }
+
+  /**
+   * @brief      Elements dropped from a queue so far.
+   */
+  uint64_t drops(const Queue queue) const { return drops_[static_cast<int>(queue)].load(std::memory_order_relaxed); }
+
+  /**
+   * @brief      Frames skipped by the scheduler so far.
+   */
+  uint64_t skipped() const { return skipped_.load(std::memory_order_relaxed); }
+
+  /**
+   * @brief      Writes all histograms and counters to a CSV file.
+   *
+   * @param[in]  filename  The file.
+   *
+   * @return     False if the file could not be written.
+   */
+  bool writeCsv(const std::string &filename) const;
+
+  static const char *name(const Stage stage);
+  static const char *name(const Queue queue);
+
+private:
+  std::array<Histogram, static_cast<int>(Stage::Count)> durations_;   // us
+  std::array<Histogram, static_cast<int>(Queue::Count)> queueDepths_;
+  std::array<std::atomic<uint64_t>, static_cast<int>(Queue::Count)> drops_;
+  std::atomic<uint64_t> skipped_;
+};
+
+#endif /* INCLUDE_PIPELINESTATS_HPP_ */
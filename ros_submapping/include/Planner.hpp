@@ -4,11 +4,14 @@
 #include <thread>
 #include <chrono>
 #include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include <fstream>
 #include <functional>
 #include <iostream>
 #include <vector>
 #include <memory>
+#include <algorithm>
 #include <stdlib.h>
 
 // if you want to use omplapp:
@@ -20,16 +23,17 @@
 #include <ompl/base/spaces/SE3StateSpace.h>
 #include <ompl/base/spaces/SE3StateSpace.h>
 #include <ompl/base/OptimizationObjective.h>
+#include <ompl/base/MotionValidator.h>
+#include <ompl/base/PlannerData.h>
 #include <ompl/base/objectives/PathLengthOptimizationObjective.h>
+#include <ompl/base/objectives/StateCostIntegralObjective.h>
 // #include <ompl/geometric/planners/rrt/RRTstar.h>
 #include <ompl/geometric/planners/rrt/InformedRRTstar.h>
 #include <ompl/geometric/planners/rrt/RRTConnect.h>
 #include <ompl/geometric/SimpleSetup.h>
+#include <ompl/tools/multiplan/ParallelPlan.h>
 
 #include <Eigen/Core>
-#include <ros/ros.h>
-#include <std_srvs/Empty.h>
-#include <trajectory_msgs/MultiDOFJointTrajectory.h>
 
 #include <okvis/ViInterface.hpp>
 #include <okvis/kinematics/Transformation.hpp>
@@ -45,20 +49,80 @@ namespace og = ompl::geometric;
 
 typedef std::function<void(const og::PathGeometric & path)> pathCallback;
 
+/**
+ * @brief Sampling planners we can plan with.
+ *
+ */
+enum class PlannerType {
+  RRTConnect,      // first solution, then simplified (default)
+  InformedRRTStar  // keeps improving the solution until planning_time
+};
+
+/**
+ * @brief Collision checker profile (see Planner::setProfiling). Times are in seconds.
+ *
+ */
+struct PlannerProfile {
+  size_t checks = 0;     // detectCollision calls
+  size_t valid = 0;      // ... that were free
+  double checkTime = 0;  // in detectCollision
+  double hashTime = 0;   // hash boxes of the samples and hash table lookups
+  double octreeTime = 0; // submap transforms and octree getData
+  size_t motions = 0;      // checkMotion calls
+  double motionTime = 0;   // in checkMotion (end state checks included)
+  size_t boxSamples = 0;   // edge samples cleared by the hash box flags alone
+  size_t voxelSamples = 0; // ... that needed voxel probes
+  size_t probes = 0;       // voxel lookups of those
+  size_t memoHits = 0;     // ... answered by the memo
+
+  void add(const PlannerProfile &other) {
+    checks += other.checks;
+    valid += other.valid;
+    checkTime += other.checkTime;
+    hashTime += other.hashTime;
+    octreeTime += other.octreeTime;
+    motions += other.motions;
+    motionTime += other.motionTime;
+    boxSamples += other.boxSamples;
+    voxelSamples += other.voxelSamples;
+    probes += other.probes;
+    memoHits += other.memoHits;
+  }
+};
+
+class SubmapMotionValidator;
+
 class Planner
 {
 private:
 
+  // the motion validator shares the snapshot, the map res and the profile
+  friend class SubmapMotionValidator;
+
   // Pointer to the object that we use to get maps.
   SupereightInterface* se_interface;
 
+  // Lookups used by the collision checker, taken once per planning query.
+  std::shared_ptr<const MapSnapshot> mapSnapshot;
+
   // The state space we are planning in
   ob::StateSpacePtr space; 
 
   og::SimpleSetupPtr ss;
 
-  //std::shared_ptr<og::InformedRRTstar> rrt;
-  std::shared_ptr<og::RRTConnect> rrt;
+  // Edge checks (set on the space information of ss).
+  std::shared_ptr<SubmapMotionValidator> motionValidator;
+
+  // RRTConnect or InformedRRTstar
+  ob::PlannerPtr rrt;
+  PlannerType planner_type;
+
+  // Parallel planning: planner_threads instances (rrt is the first) on the problem of ss,
+  // all checking against the same snapshot. RRTConnect: the first solution wins,
+  // InformedRRTstar: the best one (hybridized) within planning_time.
+  int planner_threads;
+  std::vector<ob::PlannerPtr> planners;
+  std::shared_ptr<ompl::tools::ParallelPlan> parallel;
 
   std::shared_ptr<og::PathGeometric> path;
 
@@ -74,11 +138,71 @@ private:
   // The closest we can get to obstacles.
   float mav_radius;
 
-  // Map resolution
+  // Map resolution: the finest one of the submaps in the snapshot (the map config one until
+  // there are any). The stencil, edge steps and voxel memos use it.
   float map_res;
 
+  // Offsets of the samples checked around each state (one column per sample, z-y-x order).
+  Eigen::Matrix3Xd sphereStencil;
+
+  // Scratch buffers of the collision checker.
+  struct SphereQuery {
+    struct CellGroup {
+      const SpatialHash::Cell* cell;
+      Eigen::Index begin; // range of samples (in order) falling in the cell
+      Eigen::Index end;
+    };
+    Eigen::Matrix3Xd points; // samples in world frame
+    std::vector<SpatialHash::Key> keys; // box of each sample
+    std::vector<Eigen::Index> order; // samples sorted by box
+    std::vector<CellGroup> cells;
+    Eigen::Matrix4Xd group; // samples of one box (homogenous)
+    Eigen::Matrix4Xd groupMap; // same, in map frame
+    Eigen::VectorXd occupancy;
+    Eigen::VectorXd weight;
+  };
+
+  // Distance layer of a submap overlapping a query, with its world -> kf transform.
+  struct EsdfQuery {
+    const SubmapEsdf* esdf;
+    const Eigen::Matrix4d* T_fw;
+  };
+
+  // Weight of the clearance cost wrt path length (0: path length only).
+  float clearance_weight;
+
+  // Clearance above this is not rewarded (the distance layers are truncated here anyway).
+  float max_clearance;
+
+  // Planning gives up (or, for the optimal planners, stops improving) after this (s).
+  float planning_time;
+
+  // Collision checker profiling. Checks profile locally, then merge (see addProfile).
+  bool profiling;
+  PlannerProfile profile;
+  std::mutex profileMutex;
+
   // Flag to preempt running planning thread.
-  bool preempt_plan;
+  std::atomic<bool> preempt_plan;
+
+  // Goal mailbox of the planning thread: latest goal, and how many were requested so far.
+  std::mutex goalMutex;
+  std::condition_variable cvGoal;
+  Eigen::Vector3d goalMailbox;
+  std::atomic<uint64_t> goalVersion;
+  std::atomic<uint64_t> activeGoalVersion; // the one being planned for
+  std::atomic<bool> shutdown; // also ends a running query (see terminatePlanner)
+  std::thread planningThread;
+
+  // Tree reuse: replans of the same goal from a start that moved less than
+  // replan_reuse_distance keep growing the previous tree (0: always start over), which
+  // stays rooted at tree_start. Only if the straight motion back to it is free, and if the
+  // snapshot changed since tree_snapshot_version, if all its motions are still free.
+  float replan_reuse_distance;
+  bool have_tree;
+  uint64_t tree_snapshot_version;
+  Eigen::Vector3d tree_start;
+  Eigen::Vector3d tree_goal;
 
   // Stores latest planning attempt start time.
   std::chrono::steady_clock::time_point start_time;
@@ -104,7 +228,22 @@ public:
    */
   Planner(SupereightInterface* se_interface_, const std::string& filename);
 
-  ~Planner() = default;
+  ~Planner();
+
+  /**
+   * @brief      Starts the planning thread, which then serves the goals of requestPlan().
+   *
+   */
+  void startPlanningThread();
+
+  /**
+   * @brief      Asks the planning thread for a path to a goal. Returns right away: a running
+   * query is cancelled at its next termination check, and only the latest goal is planned for.
+   *
+   * @param[in]  r The goal state.
+   *
+   */
+  void requestPlan(const Eigen::Vector3d & r);
 
   /**
    * @brief      Sets the start state.
@@ -136,6 +275,67 @@ public:
    */
   bool plan();
 
+  /**
+   * @brief      Takes the latest map snapshot for collision checks outside a planning
+   * query (e.g. benchmarks). plan() takes its own.
+   *
+   * @return     False if there are no maps yet.
+   */
+  bool updateMapSnapshot();
+
+  /**
+   * @brief      Same, with a given snapshot instead of the latest one (e.g. tests).
+   *
+   * @param[in]  snapshot  The snapshot.
+   *
+   * @return     False if there are no maps in it.
+   */
+  bool updateMapSnapshot(const std::shared_ptr<const MapSnapshot> &snapshot);
+
+  /**
+   * @brief      Switches the sampling planner (also set by planner_type in the config).
+   *
+   * @param[in]  type  The planner.
+   */
+  void setPlannerType(const PlannerType type);
+
+  /**
+   * @brief      Sets how many planner instances solve each query in parallel
+   * (also set by planner_threads in the config).
+   *
+   * @param[in]  threads  Number of instances (1: no parallel planning).
+   */
+  void setPlannerThreads(const int threads);
+
+  /**
+   * @brief      Space information the queries are solved in (validity checker and motion
+   * validator set), e.g. to check states and motions outside a query.
+   */
+  ob::SpaceInformationPtr getSpaceInformation() const { return ss->getSpaceInformation(); }
+
+  /**
+   * @brief      Path found by the last successful plan() (simplified and smoothed).
+   */
+  og::PathGeometric getPath() const { return *path; }
+
+  /**
+   * @brief      Turns the collision checker profiling on or off. It times every check
+   * (not free: keep it off outside benchmarks).
+   *
+   * @param[in]  enable  On or off.
+   */
+  void setProfiling(const bool enable) { profiling = enable; }
+
+  /**
+   * @brief      Collision checker profile since the last reset.
+   */
+  const PlannerProfile &getProfile() const { return profile; }
+
+  /**
+   * @brief      Clears the collision checker profile.
+   */
+  void resetProfile() { profile = PlannerProfile(); }
+
   void setPathCallback(const pathCallback &pathCallback) { pathCallback_ = pathCallback; }
 
   /**
@@ -149,12 +349,23 @@ public:
 
   /**
    * @brief     OMPL collision detector. Checks among local submaps using spatial hash table.
+   * Only reads the snapshot: safe to call from several planner instances at once.
    *
    * @param[in]  state          Queried state.
    *
    */
   bool detectCollision(const ompl::base::State *state);
 
+  /**
+   * @brief     Distance to the closest obstacle, from the submaps distance layers.
+   * Submaps without a layer are ignored.
+   *
+   * @param[in]  state          Queried state.
+   *
+   * @return     The clearance (m), at most max_clearance.
+   */
+  double getClearance(const ompl::base::State *state);
+
   /**
    * @brief     OMPL termination condition function. Checks if 
    * preempted, or time limit has passed
@@ -162,7 +373,195 @@ public:
    */
   bool terminatePlanner();
 
+private:
+
+  /**
+   * @brief     Collects the distance layers of the submaps overlapping the
+   * bounding box of a sphere (deduplicated).
+   *
+   * @param[in]  r          Sphere centre (world frame).
+   * @param[in]  radius     Sphere radius.
+   * @param[out] esdfs      The layers.
+   *
+   * @return     False if part of the box is not in any submap, or if an overlapping submap
+   * has no layer (in both cases the layers alone can't tell whether the sphere is free).
+   */
+  bool overlappingEsdfs(const Eigen::Vector3d &r, const double radius, std::vector<EsdfQuery> &esdfs) const;
+
+  /**
+   * @brief     Sphere check with the distance layers alone.
+   *
+   * @param[in]  r          Sphere centre (world frame).
+   * @param[out] free       Whether the sphere is free, when the layers can tell.
+   *
+   * @return     False if the layers can't decide (no layers, or not all of the sphere observed).
+   */
+  bool checkEsdf(const Eigen::Vector3d &r, bool &free) const;
+
+  /**
+   * @brief     The collision check itself (detectCollision adds the profiling around it).
+   * Thread safe: planner instances check concurrently.
+   *
+   * @param[in]  state          Queried state.
+   * @param[out] local          Profile of the check (only if profiling).
+   *
+   * @return     True if the sphere around the state is free.
+   */
+  bool checkSphere(const ompl::base::State *state, PlannerProfile &local);
+
+  /**
+   * @brief     Sets the map res and rebuilds the sphere stencil at that step. Not while solving.
+   *
+   * @param[in]  res            Map resolution (m).
+   */
+  void setMapRes(const float res);
+
+  /**
+   * @brief     Takes a map snapshot (planMutex held), and follows its finest res.
+   *
+   * @param[in]  snapshot       The snapshot (usually the latest one).
+   */
+  void takeMapSnapshot(const std::shared_ptr<const MapSnapshot> &snapshot);
+
+  /**
+   * @brief     Adds the profile of one check to the planner one.
+   *
+   * @param[in]  local          The check profile.
+   */
+  void addProfile(const PlannerProfile &local);
+
+  /**
+   * @brief     Checks every motion of the planner trees against the current snapshot
+   * (planMutex held, not while solving).
+   *
+   * @return     True if they are all still free.
+   */
+  bool treeValid();
+
+  /**
+   * @brief     Planning thread: waits for the goals of requestPlan() and plans for the latest.
+   *
+   */
+  void planningLoop();
+
 };
 
+/**
+ * @brief Clearance cost: integral along the path of how much each state is within
+ * max_clearance of an obstacle. Combined with path length, it pushes the optimal
+ * planners (InformedRRT*) to keep away from obstacles.
+ *
+ */
+class ClearanceObjective : public ob::StateCostIntegralObjective
+{
+public:
+  ClearanceObjective(const ob::SpaceInformationPtr &si, Planner* planner, const double maxClearance)
+      : ob::StateCostIntegralObjective(si, false), planner_(planner), maxClearance_(maxClearance) {}
+
+  ob::Cost stateCost(const ob::State *s) const override {
+    return ob::Cost(1.0 - planner_->getClearance(s) / maxClearance_);
+  }
+
+private:
+  Planner* planner_;
+  double maxClearance_;
+};
+
+/**
+ * @brief Edge checker of the planner. Edges are checked one voxel apart (the end state with
+ * detectCollision), hierarchically: a sample whose sphere only covers hash boxes flagged free
+ * (see SpatialHash::Flags) passes without any voxel lookup, the others are probed voxel by voxel
+ * through a memo shared by the neighbouring samples.
+ *
+ * The memo lives as long as the query and the snapshot (see clear()). Each thread has its
+ * own: the planner instances of a parallel query check edges concurrently.
+ *
+ */
+class SubmapMotionValidator : public ob::MotionValidator
+{
+public:
+  SubmapMotionValidator(const ob::SpaceInformationPtr &si, Planner* planner);
+
+  bool checkMotion(const ob::State *s1, const ob::State *s2) const override;
+
+  bool checkMotion(const ob::State *s1, const ob::State *s2, std::pair<ob::State *, double> &lastValid) const override;
+
+  /**
+   * @brief      Empties the voxel memos (new query, or new snapshot) and rebuilds the
+   * stencil at the planner map res, which may have changed with the snapshot.
+   */
+  void clear();
+
+private:
+  static constexpr int kMemoBits = 16; // direct mapped, 2^16 voxels
+  static constexpr SpatialHash::Key kNoVoxel = ~SpatialHash::Key(0); // pack() never gives it
+
+  // what a checking thread keeps between its checks
+  struct ThreadState {
+    const SubmapMotionValidator* owner = nullptr;
+    uint64_t epoch = 0; // memo valid while it matches epoch_
+    Eigen::Vector3i lastMinBox; // last range asked to boxesFree, and its answer
+    Eigen::Vector3i lastMaxBox;
+    bool lastBoxesFree = false;
+    std::vector<SpatialHash::Key> memoKeys;
+    std::vector<uint8_t> memoFree;
+    PlannerProfile profile; // of the current check, merged into the planner one
+  };
+
+  /**
+   * @brief     State of the calling thread, reset if its memo is stale.
+   */
+  ThreadState &threadState() const;
+
+  /**
+   * @brief     Checks the samples strictly between two states, in order.
+   *
+   * @param[in]  state      Thread state.
+   * @param[in]  s1         First state.
+   * @param[in]  s2         Second state.
+   * @param[out] steps      Number of steps the edge is split in.
+   *
+   * @return     Index of the first sample in collision (in [1, steps)), or steps if all are free.
+   */
+  int checkSamples(ThreadState &state, const ob::State *s1, const ob::State *s2, int &steps) const;
+
+  /**
+   * @brief     Checks the sphere around one edge sample.
+   *
+   * @param[in]  state      Thread state.
+   * @param[in]  r          Sample (world frame).
+   *
+   * @return     True if free.
+   */
+  bool checkSample(ThreadState &state, const Eigen::Vector3d &r) const;
+
+  /**
+   * @brief     Whether every hash box in a range is flagged free.
+   *
+   * @param[in]  state      Thread state.
+   * @param[in]  minBox     First box.
+   * @param[in]  maxBox     Last box (included).
+   */
+  bool boxesFree(ThreadState &state, const Eigen::Vector3i &minBox, const Eigen::Vector3i &maxBox) const;
+
+  /**
+   * @brief     Occupancy of one voxel (world grid, map res), memoized.
+   *
+   * @param[in]  state      Thread state.
+   * @param[in]  voxel      Voxel coordinates.
+   *
+   * @return     True if observed and free (weighted average over the submaps, as detectCollision).
+   */
+  bool voxelFree(ThreadState &state, const Eigen::Vector3i &voxel) const;
+
+  Planner* planner_;
+
+  // sphereStencil, in voxels, grown by half a voxel diagonal (it is centred on the voxel of
+  // a sample, not on the sample)
+  Eigen::Matrix3Xi stencil_;
+
+  // current memo generation, unique across all the validators (see clear())
+  std::atomic<uint64_t> epoch_;
+};
 
 #endif /* INCLUDE_PLANNER_HPP_ */
\ No newline at end of file
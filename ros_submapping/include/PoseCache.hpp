@@ -0,0 +1,139 @@
+#ifndef INCLUDE_POSECACHE_HPP_
+#define INCLUDE_POSECACHE_HPP_
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include <Eigen/StdVector>
+#include <okvis/ViInterface.hpp>
+#include <okvis/kinematics/Transformation.hpp>
+
+/**
+ * @brief A pose lookup for one depth frame: the timestamp goes in, the rest comes out.
+ *
+ */
+struct PoseQuery {
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  okvis::Time timestamp;                      ///< Depth frame stamp.
+  bool found = false;                         ///< False: no state at or before the stamp any more.
+  okvis::kinematics::Transformation T_WS;     ///< Interpolated IMU pose at the stamp.
+  Eigen::Vector3d v_W = Eigen::Vector3d::Zero(); ///< Interpolated velocity at the stamp.
+  uint64_t keyframeId = 0;                    ///< Keyframe active at the stamp.
+  uint64_t loopClosures = 0;                  ///< Loop closures up to the stamp (a running count).
+  uint64_t poseVersion = 0;                   ///< Keyframe pose store version of the state before the stamp.
+};
+
+typedef std::vector<PoseQuery, Eigen::aligned_allocator<PoseQuery>> PoseQueryVec;
+
+/**
+ * @brief Fixed size ring buffer of the latest okvis states, written by the okvis callback and
+ * read by the data preparation thread. A lookup is a binary search for the two states around the
+ * stamp plus an interpolation (cubic on the position, using the state velocities, slerp on the
+ * rotation): nothing is copied but the answer, and all the frames of a batch share one lock.
+ *
+ * Each state also carries the keyframe active at it and the running count of loop closures, so
+ * readers find out about a loop closure even when the state that reported it is long gone.
+ * okvis does not correct the states it already sent, so a loop closure empties the cache: the
+ * states before it are in the uncorrected world frame.
+ *
+ */
+class PoseCache {
+public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  /**
+   * @brief      Constructs an empty cache.
+   *
+   * @param[in]  capacity  Number of states kept.
+   */
+  explicit PoseCache(const size_t capacity);
+
+  /**
+   * @brief      Blocking: add() waits instead of overwriting states pending lookups still need.
+   */
+  void setBlocking(const bool blocking);
+
+  /**
+   * @brief      Adds the latest okvis state. States older than the newest one are ignored, one
+   * with the same stamp replaces it.
+   *
+   * @param[in]  state        The state.
+   * @param[in]  isKeyframe   Is it a keyframe?
+   * @param[in]  loopClosure  Did okvis close a loop with it?
+   * @param[in]  poseVersion  Keyframe pose store version after the keyframe update of the same callback.
+   *
+   * @return     True if (non blocking) a state still needed by pending lookups was overwritten.
+   */
+  bool add(const okvis::State &state, const bool isKeyframe, const bool loopClosure, const uint64_t poseVersion);
+
+  /**
+   * @brief      Looks up a batch of stamps, under one lock.
+   *
+   * @param[in,out] queries  The stamps in, the poses out (any order).
+   *
+   * @return     Number of queries found. Stamps newer than the newest state are not found either.
+   */
+  size_t lookup(PoseQueryVec &queries) const;
+
+  /**
+   * @brief      No lookup older than the given stamp will come: the states before it can go.
+   *
+   * @param[in]  timestamp  Stamp of the last depth frame looked up.
+   */
+  void release(const okvis::Time &timestamp);
+
+  /**
+   * @brief      Stamp of the newest state.
+   *
+   * @param[out] timestamp  The stamp.
+   *
+   * @return     False if the cache is empty.
+   */
+  bool newest(okvis::Time &timestamp) const;
+
+  /**
+   * @brief      Number of stored states.
+   */
+  size_t size() const;
+
+  /**
+   * @brief      Bytes of the ring buffer (allocated once, full or not).
+   */
+  size_t memoryUsage() const { return entries_.capacity() * sizeof(Entry); }
+
+  /**
+   * @brief      Wakes up and returns a blocked add().
+   */
+  void shutdown();
+
+private:
+
+  struct Entry {
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    okvis::Time timestamp;
+    okvis::kinematics::Transformation T_WS;
+    Eigen::Vector3d v_W;
+    uint64_t keyframeId;
+    uint64_t loopClosures;
+    uint64_t poseVersion;
+  };
+
+  // i-th oldest entry
+  const Entry &at(const size_t i) const { return entries_[(head_ + i) % entries_.size()]; }
+
+  std::vector<Entry, Eigen::aligned_allocator<Entry>> entries_;
+  size_t head_;  // oldest entry
+  size_t count_;
+  uint64_t keyframeId_; // 0: no keyframe yet
+  uint64_t loopClosures_;
+  okvis::Time released_;
+  bool blocking_;
+  bool shutdown_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable cvReleased_;
+};
+
+#endif /* INCLUDE_POSECACHE_HPP_ */
@@ -41,12 +41,16 @@
 #ifndef INCLUDE_PUBLISHER_HPP_
 #define INCLUDE_PUBLISHER_HPP_
 
+#include <algorithm>
 #include <fstream>
 #include <filesystem>
 #include <memory>
+#include <mutex>
+#include <unordered_set>
 
 #include <pcl/point_types.h>
 
+#include <diagnostic_msgs/DiagnosticArray.h>
 #include <geometry_msgs/PoseStamped.h>
 #include <sensor_msgs/PointCloud2.h>
 #include <visualization_msgs/Marker.h>
@@ -56,6 +60,7 @@
 #include <opencv2/core/core.hpp>
 #include <ros/ros.h>
 #include <tf/transform_broadcaster.h>
+#include <tf2_ros/static_transform_broadcaster.h>
 // #include <pcl_ros/point_cloud.h>
 #pragma GCC diagnostic pop
 #include <nav_msgs/Odometry.h>
@@ -193,13 +198,6 @@ class Publisher
   ///        maximum is reached, the last pose is copied in a new path message. The rest are deleted.
   void setPath(const okvis::kinematics::Transformation& T_WS);
 
-  /**
-   * @brief Sets the meshes directory where the submaps are.
-   * @param meshesDir Directory where the meshes are.
-   * 
-   */
-  void setMeshesPath(std::string meshesDir);
-
   /**
    * @brief Sets T_SC to visualize camera frustum for keyframes.
   */
@@ -255,17 +253,26 @@ class Publisher
       const okvis::MapPointVector & transferredLandmarks);
 
   /**
-   * @brief Publish submaps as meshes.
+   * @brief Publish submaps as meshes (triangle lists). The marker of each submap is built
+   * and sent once, from its in-memory mesh, in the submap tf frame (submap_<id>): pose
+   * changes only re-broadcast the frames.
+   * @param  id Id of the submap the mesh belongs to.
+   * @param  mesh Mesh of a newly finished submap, nullptr to only update the poses.
    * @param  submapPoseLookup The lookup table with submaps (kf) poses.
    */
-  void publishSubmapMeshesAsCallback(std::unordered_map<uint64_t, Transformation> submapPoseLookup);
+  void publishSubmapMeshesAsCallback(const uint64_t id, const std::shared_ptr<const SubmapMesh> &mesh,
+                                     const std::unordered_map<uint64_t, Transformation> &submapPoseLookup);
 
   /**
-   * @brief Publish submaps as array of occupied voxels.
+   * @brief Publish submaps as array of occupied voxels, in the submap tf frames (submap_<id>).
+   * The markers are only built and sent for the submap that changed (and the ones never
+   * sent): pose changes only re-broadcast the frames.
+   * @param  id Id of the submap whose geometry changed (0 if none).
    * @param  submapPoseLookup The lookup table with submaps (kf) poses.
    * @param  submapLookup The lookup table with submaps.
    */
-  void publishSubmapsAsCallback(std::unordered_map<uint64_t, Transformation> submapPoseLookup, std::unordered_map<uint64_t, SubmapList::iterator> submapLookup);
+  void publishSubmapsAsCallback(const uint64_t id, const std::unordered_map<uint64_t, Transformation> &submapPoseLookup,
+                                const std::unordered_map<uint64_t, SubmapPtr> &submapLookup);
 
   /**
    * @brief Publish keyframe states.
@@ -286,6 +293,22 @@ class Publisher
    */
   void publishPathAsCallback(const ompl::geometric::PathGeometric & path);
 
+  /**
+   * @brief Publish the mapping pipeline timing on /diagnostics (one status per stage and
+   * per queue). Warns once queues start dropping.
+   * 
+   * @param  stats The pipeline statistics.
+   */
+  void publishPipelineStats(const PipelineStats & stats);
+
+  /**
+   * @brief Publish the mapping memory on /diagnostics: totals, spatial hash, planner snapshot,
+   * queues, then one status per submap.
+   * 
+   * @param  stats The memory statistics.
+   */
+  void publishMemoryStats(const MemoryStats & stats);
+
   /**
    * @brief Set and publish tracked marker.
    * @remark This can be registered with the VioInterface.
@@ -359,6 +382,7 @@ class Publisher
 
   ros::NodeHandle* nh_; ///< The node handle.
   tf::TransformBroadcaster pubTf_;  ///< The transform broadcaster.
+  tf2_ros::StaticTransformBroadcaster pubStaticTf_; ///< Latched broadcaster of the submap frames.
   // ros::Publisher pubPointsMatched_; ///< The publisher for matched points.
   // ros::Publisher pubPointsUnmatched_; ///< The publisher for unmatched points.
   // ros::Publisher pubPointsTransferred_; ///< The publisher for transferred/marginalised points.
@@ -373,8 +397,38 @@ class Publisher
 
   ros::Publisher pubKeyframes_; ///< The publisher for keyframe states
   ros::Publisher pubSubmaps_; ///< The publisher for se submaps
-  std::string meshesDir_; ///< The directory where submaps are
+  /**
+   * @brief Builds the occupied voxel markers of a submap (one cube list per voxel size),
+   * in the submap tf frame.
+   * @param  id Id of the submap.
+   * @param  map The submap.
+   * @return The markers.
+   */
+  std::vector<visualization_msgs::Marker> buildVoxelMarkers(const uint64_t id, const se::OccupancyMap<se::Res::Multi> &map);
+
+  /**
+   * @brief Stores the submap poses and sends the tf frames of the ones that changed (new
+   * submaps, loop closures) on /tf_static. The broadcaster latches all the frames sent so
+   * far, so late subscribers (rviz) get them too and nothing is re-sent periodically.
+   * @param  submapPoseLookup The lookup table with submaps (kf) poses.
+   */
+  void updateSubmapFrames(const std::unordered_map<uint64_t, Transformation> &submapPoseLookup);
+
+  /**
+   * @brief Transform message of a submap frame (child of "odom").
+   * @param  id Id of the submap.
+   * @param  T_WK Pose of the submap.
+   * @param  stamp Stamp of the transform.
+   * @return The message.
+   */
+  static geometry_msgs::TransformStamped toTransformMsg(const uint64_t id, const Transformation &T_WK, const ros::Time &stamp);
+
+  std::unordered_map<uint64_t, std::vector<std::pair<std::string, int>>> voxelSubmaps_; ///< (ns, id) of the voxel markers sent per submap
+  std::mutex voxelSubmapsMutex_; ///< Voxel callbacks run on their own threads
+  std::unordered_map<uint64_t, Transformation> submapFrames_; ///< Last broadcast submap frames
+  std::mutex submapFramesMutex_; ///< Written by the submap callbacks (mesh and voxel threads)
   ros::Publisher pubOMPLPath_; ///< The publisher for OMPL-computed path
+  ros::Publisher pubDiagnostics_; ///< The publisher for the pipeline statistics
 
   // Block publishers
   ros::Publisher map_free_pub_;
@@ -0,0 +1,200 @@
+#ifndef INCLUDE_SPATIALHASH_HPP_
+#define INCLUDE_SPATIALHASH_HPP_
+
+#include <cstdint>
+#include <vector>
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+
+/**
+ * @brief Flat spatial hash table: maps box coordinates to the ids of the submaps overlapping the box.
+ * Cells live in a single open-addressing array (linear probing, backward-shift deletion) keyed on the
+ * packed 64 bit box coordinates. The first kInlineIds ids of a cell are stored inline; cells with more
+ * ids spill the extra ones into a shared pool.
+ *
+ * Each id of a cell carries occupancy flags of its submap over the box, and each cell a summary of
+ * them: checks can then skip the octrees of boxes that are known to be free.
+ *
+ */
+class SpatialHash {
+public:
+
+  typedef uint64_t Key;
+
+  // ids stored inside the cell before spilling
+  static constexpr uint32_t kInlineIds = 4;
+
+  /// \brief Occupancy of a submap over a box (per id), or of all the submaps of a box (cell summary).
+  enum Flags : uint8_t {
+    kFree = 1,       // id: the whole box is in the submap, observed and free.
+                     // cell: observed free by some submap, and no submap has anything occupied in it
+    kOccupied = 2,   // something in the box may be occupied (in any submap, for the cell)
+    kUnobserved = 4, // id: part of the box is unobserved, or out of the submap.
+                     // cell: no submap observes all of it
+    kUnknown = kOccupied | kUnobserved // not evaluated (e.g. the octree was not looked at)
+  };
+
+  struct Entry {
+    int id;
+    uint8_t flags;
+  };
+
+  struct Cell {
+    Key key;                     // packed box coordinates
+    int ids[kInlineIds];         // first ids of the cell
+    uint8_t flags[kInlineIds];   // ... and their flags
+    uint8_t summary;             // flags of the cell, from the ones of all its ids
+    uint32_t count;              // total number of ids in the cell
+    uint32_t spill;              // index of the spilled ids in the pool (only used if count > kInlineIds)
+
+    bool free() const { return summary & kFree; }
+  };
+
+  /**
+   * @brief      Constructs an empty table.
+   *
+   * @param[in]  capacity  Initial number of slots (rounded up to a power of 2).
+   */
+  explicit SpatialHash(const size_t capacity = 1024);
+
+  /**
+   * @brief      Packs box coordinates in a key (21 bits per axis, offset so negative coords are fine).
+   */
+  static Key pack(const Eigen::Vector3i &coord);
+
+  /**
+   * @brief      Inverse of pack().
+   */
+  static Eigen::Vector3i unpack(const Key key);
+
+  /**
+   * @brief      Appends the keys of all the boxes intersecting an oriented box (each box once).
+   * Exact separating axis test between the oriented box and each candidate box.
+   * Keys are appended in increasing order.
+   *
+   * @param[in]  T_WB      Pose of the oriented box frame.
+   * @param[in]  min       Min corner of the oriented box, in its own frame.
+   * @param[in]  max       Max corner of the oriented box, in its own frame.
+   * @param[in]  cellSize  Side of the hash boxes.
+   * @param[out] keys      Output keys.
+   */
+  static void rasterizeBox(const Eigen::Matrix4f &T_WB, const Eigen::Vector3f &min, const Eigen::Vector3f &max,
+                           const float cellSize, std::vector<Key> &keys);
+
+  /**
+   * @brief      Adds a submap id to a box. If the id is there already, only its flags are set.
+   *
+   * @param[in]  flags  Occupancy of the submap over the box (Flags).
+   *
+   * @return     True if the id was not in the box yet.
+   */
+  bool insert(const Eigen::Vector3i &coord, const int id, const uint8_t flags = kUnknown) { return insert(pack(coord), id, flags); }
+  bool insert(const Key key, const int id, const uint8_t flags = kUnknown);
+
+  /**
+   * @brief      Sets the flags of a submap id of a box.
+   *
+   * @return     False if the id is not in the box.
+   */
+  bool setFlags(const Key key, const int id, const uint8_t flags);
+
+  /**
+   * @brief      Removes a submap id from a box. Boxes left without ids are removed.
+   *
+   * @return     True if the id was in the box.
+   */
+  bool erase(const Eigen::Vector3i &coord, const int id) { return erase(pack(coord), id); }
+  bool erase(const Key key, const int id);
+
+  /**
+   * @brief      Looks up a box.
+   *
+   * @return     The cell, or nullptr if no submap overlaps the box.
+   */
+  const Cell* find(const Eigen::Vector3i &coord) const { return find(pack(coord)); }
+  const Cell* find(const Key key) const;
+
+  bool count(const Eigen::Vector3i &coord) const { return find(coord) != nullptr; }
+
+  /**
+   * @brief      Calls f(id) for every submap id of a cell.
+   */
+  template <typename F>
+  void forEachId(const Cell &cell, F f) const {
+    const uint32_t inlineCount = cell.count < kInlineIds ? cell.count : kInlineIds;
+    for (uint32_t i = 0; i < inlineCount; i++) f(cell.ids[i]);
+    if (cell.count > kInlineIds) {
+      for (const Entry &entry : spill_[cell.spill]) f(entry.id);
+    }
+  }
+
+  /**
+   * @brief      Calls f(id, flags) for every submap id of a cell.
+   */
+  template <typename F>
+  void forEachEntry(const Cell &cell, F f) const {
+    const uint32_t inlineCount = cell.count < kInlineIds ? cell.count : kInlineIds;
+    for (uint32_t i = 0; i < inlineCount; i++) f(cell.ids[i], cell.flags[i]);
+    if (cell.count > kInlineIds) {
+      for (const Entry &entry : spill_[cell.spill]) f(entry.id, entry.flags);
+    }
+  }
+
+  /**
+   * @brief      Calls f(key, cell) for every non empty cell.
+   */
+  template <typename F>
+  void forEachCell(F f) const {
+    for (const Cell &cell : cells_) {
+      if (cell.key != kEmptyKey) f(cell.key, cell);
+    }
+  }
+
+  size_t size() const { return size_; } // number of non empty cells
+  bool empty() const { return size_ == 0; }
+  size_t capacity() const { return cells_.size(); }
+  double loadFactor() const { return static_cast<double>(size_) / cells_.size(); }
+
+  /**
+   * @brief      Bytes allocated by the table (slots + spilled ids).
+   */
+  size_t memoryUsage() const;
+
+  void clear();
+
+private:
+
+  static constexpr Key kEmptyKey = ~Key(0); // pack() never produces this (top bit is always 0)
+
+  // murmur3 64 bit finalizer: good avalanche, also for small and negative coords
+  static uint64_t mix(Key key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+  }
+
+  size_t home(const Key key) const { return mix(key) & mask_; }
+
+  // index of the slot holding key, or of the empty slot where it should go
+  size_t probe(const Key key) const;
+
+  void grow();
+
+  void eraseSlot(size_t i);
+
+  // recomputes the summary from the flags of the ids
+  void summarize(Cell &cell) const;
+
+  uint32_t allocateSpill();
+
+  std::vector<Cell> cells_;
+  std::vector<std::vector<Entry>> spill_; // pool of spilled ids
+  std::vector<uint32_t> freeSpill_;     // unused entries of the pool
+  size_t size_;
+  size_t mask_;
+};
+
+#endif /* INCLUDE_SPATIALHASH_HPP_ */
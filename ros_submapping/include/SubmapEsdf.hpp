@@ -0,0 +1,86 @@
+#ifndef INCLUDE_SUBMAPESDF_HPP_
+#define INCLUDE_SUBMAPESDF_HPP_
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <Eigen/Core>
+#include <se/supereight.hpp>
+
+/**
+ * @brief Euclidean distance layer of a single submap, on a dense grid at map resolution over the
+ * observed bounds. It holds two fields, both measured between voxel centres and truncated at
+ * maxDistance:
+ * - signed distance to the closest occupied voxel (negative inside obstacles),
+ * - distance to the closest voxel which is not observed free (occupied or unobserved), used to
+ *   know whether a sphere lies entirely in observed space.
+ *
+ */
+class SubmapEsdf {
+public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  /**
+   * @brief      Computes the distance layer of a map.
+   *
+   * @param[in]  map          The submap.
+   * @param[in]  bounds       Observed bounds of the submap (min, max) in metres, map frame.
+   * @param[in]  maxDistance  Distances are truncated here (in metres).
+   *
+   * @return     The distance layer.
+   */
+  static std::shared_ptr<const SubmapEsdf> compute(const se::OccupancyMap<se::Res::Multi> &map,
+                                                   const Eigen::Matrix<float,6,1> &bounds,
+                                                   const float maxDistance);
+
+  /**
+   * @brief      Is a point (keyframe frame, same as map->contains()) inside the grid?
+   */
+  bool contains(const Eigen::Vector3f &r_map) const;
+
+  /**
+   * @brief      Interpolated signed distance to the closest occupied voxel. Outside the grid
+   * this is a lower bound (distance at the closest grid point minus the distance to the grid).
+   *
+   * @param[in]  r_map  Point in keyframe frame (same as map->getData()).
+   */
+  float occupiedDistance(const Eigen::Vector3f &r_map) const;
+
+  /**
+   * @brief      Interpolated distance to the closest voxel that is not observed free (0 outside the grid).
+   *
+   * @param[in]  r_map  Point in keyframe frame (same as map->getData()).
+   */
+  float observedClearance(const Eigen::Vector3f &r_map) const;
+
+  float maxDistance() const { return maxDistance_; }
+
+  size_t memoryUsage() const { return occupied_.capacity() + notFree_.capacity(); }
+
+private:
+
+  SubmapEsdf() = default;
+
+  // keyframe frame -> continuous grid coords (voxel centres at integer coords)
+  Eigen::Vector3f toGrid(const Eigen::Vector3f &r_map) const {
+    return ((T_MK_.topLeftCorner<3,3>() * r_map + T_MK_.topRightCorner<3,1>()) - origin_) / res_;
+  }
+
+  // trilinear interpolation at the closest grid point, stored units -> metres.
+  // outside is set to the distance (metres) between u and that point
+  float interpolate(const std::vector<int8_t> &field, const Eigen::Vector3f &u, float &outside) const;
+
+  size_t index(const int x, const int y, const int z) const { return x + dims_(0) * (y + dims_(1) * static_cast<size_t>(z)); }
+
+  Eigen::Matrix4f T_MK_;    // keyframe frame -> map (octree) frame
+  Eigen::Vector3f origin_;  // centre of voxel (0,0,0) of the grid, map frame
+  Eigen::Vector3i dims_;
+  float res_;
+  float maxDistance_;
+  float quantum_;           // metres per stored unit
+
+  std::vector<int8_t> occupied_;
+  std::vector<int8_t> notFree_;
+};
+
+#endif /* INCLUDE_SUBMAPESDF_HPP_ */
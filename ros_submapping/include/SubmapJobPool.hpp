@@ -0,0 +1,91 @@
+#ifndef INCLUDE_SUBMAPJOBPOOL_HPP_
+#define INCLUDE_SUBMAPJOBPOOL_HPP_
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/**
+ * @brief Fixed-size pool of worker threads running the per-submap jobs (hashing etc.).
+ * Jobs of the same submap run one at a time, in the order they were pushed, so e.g. a
+ * rehash never overtakes the hashing of a submap. Jobs of different submaps run in parallel.
+ * A rehash pushed while an older rehash of the same submap is still pending replaces it
+ * (the newest pose is the only one worth hashing). Same for the snapshot and eviction scan
+ * jobs, which only need to run once for the latest state.
+ *
+ */
+class SubmapJobPool {
+public:
+
+  enum class JobType { Prelim, Finalize, Rehash, Evict, Allocate, Snapshot, EvictionScan };
+
+  /**
+   * @brief      Starts the workers.
+   *
+   * @param[in]  numThreads  Number of worker threads (at least 1).
+   */
+  explicit SubmapJobPool(const size_t numThreads);
+
+  /**
+   * @brief      Calls shutdown().
+   */
+  ~SubmapJobPool();
+
+  SubmapJobPool(const SubmapJobPool &) = delete;
+  SubmapJobPool &operator=(const SubmapJobPool &) = delete;
+
+  /**
+   * @brief      Queues a job.
+   *
+   * @param[in]  type  Job type.
+   * @param[in]  id    Id of the submap the job works on.
+   * @param[in]  job   The job.
+   *
+   * @return     False if the job was dropped (after shutdown) or replaced a pending one
+   * (rehash, snapshot, eviction scan).
+   */
+  bool push(const JobType type, const uint64_t id, std::function<void()> job);
+
+  /**
+   * @brief      Drops the pending jobs and waits for the running ones. Returns once all
+   * the workers are joined, so nothing the jobs reference is used afterwards.
+   */
+  void shutdown();
+
+  /**
+   * @brief      Number of jobs not started yet.
+   */
+  size_t pending();
+
+  /**
+   * @brief      Number of jobs not finished yet (pending or running).
+   */
+  size_t outstanding();
+
+private:
+
+  struct Job {
+    JobType type;
+    std::function<void()> run;
+  };
+
+  void workerLoop();
+
+  std::mutex mutex_;
+  std::condition_variable cvJobs_;
+  std::unordered_map<uint64_t, std::deque<Job>> jobs_; // pending jobs per submap
+  std::unordered_set<uint64_t> busy_;                  // submaps with a running job
+  std::deque<uint64_t> ready_;                         // submaps with pending jobs and none running (FIFO)
+  size_t numPending_;
+  bool shutdown_;
+
+  std::vector<std::thread> workers_;
+};
+
+#endif /* INCLUDE_SUBMAPJOBPOOL_HPP_ */
@@ -0,0 +1,82 @@
+#ifndef INCLUDE_SUBMAPSESSION_HPP_
+#define INCLUDE_SUBMAPSESSION_HPP_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <Eigen/Core>
+#include <SpatialHash.hpp>
+#include <SubmapStore.hpp>
+
+/**
+ * @brief Everything needed to restore a finished submap: its octree, pose, bounds and
+ * spatial hash boxes.
+ *
+ */
+struct SessionSubmap {
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  uint64_t id = 0;
+  Eigen::Matrix4d T_WK = Eigen::Matrix4d::Identity(); // keyframe (submap) pose
+  Eigen::Matrix<float,6,1> bounds = Eigen::Matrix<float,6,1>::Zero(); // map frame, as in submapDimensionLookup_
+  std::vector<SpatialHash::Key> cells; // sorted, as in hashTableInverse_
+  SubmapPtr map;
+};
+
+/**
+ * @brief What a session index lists: the save it belongs to and its submaps.
+ *
+ */
+struct SessionIndex {
+  uint64_t generation = 0; // bumped at each save, part of the submap file names
+  std::vector<uint64_t> ids;
+};
+
+/**
+ * @brief Versioned binary session format: one file per submap (header, hash boxes and
+ * the octree dump of SubmapStore::serialize) plus an index listing them. Each save writes
+ * its files under a new generation, then replaces the index atomically, then deletes the
+ * files of the older generations: a save that dies halfway leaves the previous session
+ * as it was. On load, submap files that fail their checks are skipped.
+ *
+ */
+class SubmapSession {
+public:
+
+  /**
+   * @brief      Writes the submaps and the index to a directory, and removes the submap
+   * files of the previous sessions there.
+   *
+   * @param[in]  directory  Existing output directory.
+   * @param[in]  submaps    The submaps (maps not modified while saving).
+   *
+   * @return     False if a file could not be written.
+   */
+  static bool save(const std::string &directory, const std::vector<SessionSubmap> &submaps);
+
+  /**
+   * @brief      Reads the index of a directory.
+   *
+   * @param[in]  directory  Session directory.
+   * @param[out] index      Generation and ids of the saved submaps.
+   *
+   * @return     False if there is no index, or of a different version.
+   */
+  static bool readIndex(const std::string &directory, SessionIndex &index);
+
+  /**
+   * @brief      Reads a submap of a session.
+   *
+   * @param[in]  directory   Session directory.
+   * @param[in]  index       Its index (readIndex).
+   * @param[in]  id          Id of the submap.
+   * @param[in]  mapConfig   Config to construct the map with (res, dim and T_MW come from the file).
+   * @param[in]  dataConfig  Occupancy config to construct the map with.
+   * @param[out] submap      The submap.
+   *
+   * @return     False if the file is missing or invalid.
+   */
+  static bool load(const std::string &directory, const SessionIndex &index, const uint64_t id,
+                   const se::MapConfig &mapConfig, const se::OccupancyDataConfig &dataConfig, SessionSubmap &submap);
+};
+
+#endif /* INCLUDE_SUBMAPSESSION_HPP_ */
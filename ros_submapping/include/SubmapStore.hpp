@@ -0,0 +1,141 @@
+#ifndef INCLUDE_SUBMAPSTORE_HPP_
+#define INCLUDE_SUBMAPSTORE_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <MemoryStats.hpp>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <se/supereight.hpp>
+
+typedef std::shared_ptr<se::OccupancyMap<se::Res::Multi>> SubmapPtr;
+
+/**
+ * @brief Eviction statistics.
+ *
+ */
+struct SubmapStoreStats {
+  size_t evictions = 0;   // submaps written to disk
+  size_t hits = 0;        // load() served from the reload cache
+  size_t misses = 0;      // load() that had to read the file
+  size_t bytesOnDisk = 0; // size of the evicted submap files
+};
+
+/**
+ * @brief On-disk storage of evicted submaps. save() writes the octree of a map (every
+ * node with its data and max data, every block with its current and all coarser scales)
+ * to a compact binary file; load() rebuilds the map from the memory-mapped file. The
+ * rebuilt map answers getData() / getMaxData() at any scale as the evicted one did.
+ * Recently loaded maps are kept in a small LRU cache, so a planner repeatedly querying
+ * an evicted submap reads it only once. Thread safe.
+ *
+ */
+class SubmapStore {
+public:
+
+  /**
+   * @brief      Constructs the store.
+   *
+   * @param[in]  directory   Where the files go.
+   * @param[in]  mapConfig   Config the submaps were created with (res, dim and T_MW come from the files).
+   * @param[in]  dataConfig  Occupancy config the submaps were created with.
+   * @param[in]  cacheSize   Max number of reloaded maps kept in memory.
+   */
+  SubmapStore(const std::string &directory, const se::MapConfig &mapConfig,
+              const se::OccupancyDataConfig &dataConfig, const size_t cacheSize);
+
+  /**
+   * @brief      Writes a map to disk. Once it returns true, load(id) works.
+   *
+   * @param[in]  id   Id of the map.
+   * @param[in]  map  The map, not modified by anyone while saving.
+   *
+   * @return     False if the file could not be written.
+   */
+  bool save(const uint64_t id, const se::OccupancyMap<se::Res::Multi> &map);
+
+  /**
+   * @brief      Gets an evicted map, from the cache or from disk.
+   *
+   * @param[in]  id  Id of the map.
+   *
+   * @return     The map, nullptr if it was never saved or the file is unreadable.
+   */
+  SubmapPtr load(const uint64_t id);
+
+  /**
+   * @brief      True if the map was saved.
+   */
+  bool contains(const uint64_t id) const;
+
+  /**
+   * @brief      Eviction statistics.
+   */
+  SubmapStoreStats stats() const;
+
+  /**
+   * @brief      Estimated memory used by a map (octants and their data).
+   *
+   * @param[in]  map  The map.
+   *
+   * @return     Bytes.
+   */
+  static size_t memoryUsage(const se::OccupancyMap<se::Res::Multi> &map) { return octreeMemory(map).bytes; }
+
+  /**
+   * @brief      Blocks, nodes and estimated memory of a map, in one walk over its leaves.
+   *
+   * @param[in]  map  The map.
+   */
+  static OctreeMemory octreeMemory(const se::OccupancyMap<se::Res::Multi> &map);
+
+  /**
+   * @brief      Writes the octree of a map to a buffer: nodes parents first, blocks with
+   * their whole scale pyramid (data and max data).
+   *
+   * @param[in]  map  The map.
+   * @param[out] out  The serialized map.
+   */
+  static void serialize(const se::OccupancyMap<se::Res::Multi> &map, std::string &out);
+
+  /**
+   * @brief      Restores the octree written by serialize() into an empty map.
+   *
+   * @param[in]  data  The serialized map.
+   * @param[in]  size  Its size in bytes.
+   * @param[out] map   The map to fill, freshly constructed with the same config.
+   *
+   * @return     False if the buffer is not a serialized map of this type.
+   */
+  static bool deserialize(const char *data, const size_t size, se::OccupancyMap<se::Res::Multi> &map);
+
+  /**
+   * @brief      Reads the res, dim and T_MW a serialized map was created with.
+   *
+   * @param[in]  data       The serialized map.
+   * @param[in]  size       Its size in bytes.
+   * @param[in,out] mapConfig  Config to construct the map with, the defaults in.
+   *
+   * @return     False if the buffer is not a serialized map of the current version.
+   */
+  static bool readConfig(const char *data, const size_t size, se::MapConfig &mapConfig);
+
+private:
+  std::string filename(const uint64_t id) const;
+
+  const std::string directory_;
+  const se::MapConfig mapConfig_;
+  const se::OccupancyDataConfig dataConfig_;
+  const size_t cacheSize_;
+
+  mutable std::mutex mutex_;
+  std::unordered_set<uint64_t> saved_;
+  std::list<std::pair<uint64_t, SubmapPtr>> cache_; // most recently used first
+  SubmapStoreStats stats_;
+};
+
+#endif /* INCLUDE_SUBMAPSTORE_HPP_ */
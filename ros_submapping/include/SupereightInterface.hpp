@@ -1,10 +1,19 @@
 #ifndef INCLUDE_SUPEREIGHTINTERFACE_HPP_
 #define INCLUDE_SUPEREIGHTINTERFACE_HPP_
 
+#include <atomic>
 #include <boost/functional/hash.hpp>
+#include <BufferPool.hpp>
 #include <chrono>
 #include <condition_variable>
+#include <deque>
+#include <DepthPreprocessor.hpp>
+#include <FrameScheduler.hpp>
 #include <functional>
+#include <KeyframePoseStore.hpp>
+#include <limits>
+#include <list>
+#include <MemoryStats.hpp>
 #include <okvis/FrameTypedefs.hpp>
 #include <okvis/Measurements.hpp>
 #include <okvis/ViInterface.hpp>
@@ -13,13 +22,32 @@
 #include <okvis/ceres/ImuError.hpp>
 #include <okvis/kinematics/Transformation.hpp>
 #include <okvis/threadsafe/ThreadsafeQueue.hpp>
+#include <PipelineStats.hpp>
+#include <PoseCache.hpp>
 #include <se/supereight.hpp>
+#include <SpatialHash.hpp>
+#include <SubmapEsdf.hpp>
+#include <SubmapJobPool.hpp>
+#include <SubmapSession.hpp>
+#include <SubmapStore.hpp>
 #include <thread>
+#include <unordered_set>
 
 // Some convenient typedefs
 typedef se::Image<float> DepthFrame;
-typedef okvis::CameraMeasurement CameraMeasurement;
-typedef okvis::threadsafe::ThreadSafeQueue<CameraMeasurement> DepthFrameQueue;
+
+/**
+ * @brief Depth frame waiting for its pose. The frame is converted once, when it
+ * arrives, and then only the pointer is copied around (queue peeks, seframes).
+ *
+ */
+struct DepthMeasurement {
+  okvis::Time timeStamp;
+  std::shared_ptr<const DepthFrame> depthFrame;
+  std::chrono::steady_clock::time_point arrival; // when addDepthImage got it, to measure latency
+};
+
+typedef okvis::threadsafe::ThreadSafeQueue<DepthMeasurement> DepthFrameQueue;
 typedef okvis::StateId StateId;
 typedef okvis::kinematics::Transformation Transformation;
 typedef okvis::TrackingState TrackingState;
@@ -28,65 +56,27 @@ typedef okvis::State State;
 typedef se::Octree<se::Data<se::Field::Occupancy, se::Colour::Off, se::Semantics::Off>, se::Res::Multi, 8> OctreeT;
 typedef typename OctreeT::BlockType BlockType;
 
-/**
- * @brief Extended okvis update: contains all the things we need for depth integration.
- *
- */
-struct OkvisUpdate {
-  State latestState;
-  StateVector keyframeStates;
-  okvis::Time timestamp;
-  bool isKeyframe;
-  uint64_t currentKeyframe;
-  bool loop_closure;
-  OkvisUpdate(const State &latestState = State(),
-              const StateVector &keyframeStates = StateVector(),
-              const okvis::Time &timestamp = okvis::Time(),
-              const bool isKeyframe = false,
-              const uint64_t currentKeyframe = 1,
-              const bool &loop_closure = false)
-      : latestState(latestState), keyframeStates(keyframeStates),
-        timestamp(timestamp), isKeyframe(isKeyframe), 
-        currentKeyframe(currentKeyframe), loop_closure(loop_closure){};
-};
-
-typedef okvis::threadsafe::ThreadSafeQueue<OkvisUpdate> StateUpdatesQueue;
-
-/**
- * @brief Contains essential data about a keyframe: its Id and transformation.
- *
- */
-struct KeyframeData {
-  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
-  uint64_t id;
-  Transformation T_WM;
-  KeyframeData(const uint64_t &id = 0,
-               const Transformation &T_WM = Transformation::Identity())
-      : id(id), T_WM(T_WM){};
-};
-
-typedef std::vector<KeyframeData, Eigen::aligned_allocator<KeyframeData>>
-    KeyFrameDataVec;
-
 /**
  * @brief Contains the data required for a single supereight map integration
- * step. each seframe contains the entire list of keyframes with updated poses
+ * step. Keyframe poses are fetched from the KeyframePoseStore when integrating.
  *
  */
 struct SupereightFrame {
   Transformation T_WC; // camera pose
-  DepthFrame depthFrame;
+  std::shared_ptr<const DepthFrame> depthFrame; // shared with the depth queue, never modified
   uint64_t keyframeId; // id of current kf
-  KeyFrameDataVec keyFrameDataVec;
   bool loop_closure;
+  uint64_t poseVersion = 0; // keyframe pose store version T_WC goes with
+  std::chrono::steady_clock::time_point arrival; // of the depth frame
+  std::chrono::steady_clock::time_point queued; // pushed for integration
 
   SupereightFrame(const Transformation &T_WC = Transformation::Identity(),
-                  const DepthFrame &depthFrame = DepthFrame(640, 480, 0.f),
+                  const std::shared_ptr<const DepthFrame> &depthFrame = nullptr,
                   const uint64_t &keyframeId = 0,
-                  const KeyFrameDataVec &keyFrameDataVec = KeyFrameDataVec{},
-                  const bool &loop_closure = false)
+                  const bool &loop_closure = false,
+                  const std::chrono::steady_clock::time_point &arrival = std::chrono::steady_clock::time_point())
       : T_WC(T_WC), depthFrame(depthFrame), keyframeId(keyframeId),
-        keyFrameDataVec(keyFrameDataVec), loop_closure(loop_closure){};
+        loop_closure(loop_closure), arrival(arrival){};
 };
 
 typedef okvis::threadsafe::ThreadSafeQueue<SupereightFrame>
@@ -94,8 +84,107 @@ typedef okvis::threadsafe::ThreadSafeQueue<SupereightFrame>
 
 typedef std::list<std::shared_ptr<se::OccupancyMap<se::Res::Multi>>> SubmapList;
 
-typedef std::function<void(std::unordered_map<uint64_t, Transformation>)> submapMeshesCallback;
-typedef std::function<void(std::unordered_map<uint64_t, Transformation>, std::unordered_map<uint64_t, SubmapList::iterator>)> submapCallback;
+/**
+ * @brief Immutable copy of the lookups needed by the planner. A new snapshot is
+ * published by the integration thread whenever a submap is created or (re)hashed.
+ * Readers just grab the shared_ptr and keep using it for the whole query.
+ *
+ */
+struct MapSnapshot {
+  uint64_t version = 0; // incremented at each publication
+  float hashCellSize = 1.f; // side of the hash table boxes
+  float finestRes = 0.f; // finest resolution of all the submaps so far, evicted ones included (0: none)
+  std::unordered_map<uint64_t, SubmapPtr> submapLookup; // resident submaps
+  std::shared_ptr<SubmapStore> submapStore; // evicted submaps, loaded on demand (nullptr if eviction is off)
+  std::unordered_map<uint64_t, Transformation> submapPoseLookup;
+  std::unordered_map<uint64_t, Eigen::Matrix4d, std::hash<uint64_t>, std::equal_to<uint64_t>,
+                     Eigen::aligned_allocator<std::pair<const uint64_t, Eigen::Matrix4d>>> submapInversePoseLookup; // world wrt kf, for collision checking
+  SpatialHash hashTable;
+  std::unordered_map<uint64_t, std::shared_ptr<const SubmapEsdf>> submapEsdfLookup; // only for submaps that have one
+  std::unordered_map<uint64_t, Transformation> submapHashedPoseLookup; // poses the box flags were computed at (finished submaps)
+  std::unordered_set<uint64_t> movedSubmaps; // off their hashed pose (e.g. loop closure, rehash pending or under tolerance)
+
+  /**
+   * @brief      Fills movedSubmaps: the submaps whose current pose is off the hashed one
+   * by more than the tolerances. Their box flags no longer describe the boxes.
+   *
+   * @param[in]  translationTol  Translation tolerance (m).
+   * @param[in]  rotationTol     Rotation tolerance (rad).
+   */
+  void findMovedSubmaps(const float translationTol, const float rotationTol);
+
+  /**
+   * @brief      Whether a box can be taken as free without looking at the octrees: its
+   * summary says so, and none of its submaps moved since their flags were computed.
+   */
+  bool cellFree(const SpatialHash::Cell &cell) const {
+    if (!cell.free()) return false;
+    if (movedSubmaps.empty()) return true;
+    bool moved = false;
+    hashTable.forEachId(cell, [&](const int id) { moved = moved || movedSubmaps.count(id); });
+    return !moved;
+  }
+
+  /**
+   * @brief      Whether a pose moved beyond translation / rotation tolerances.
+   */
+  static bool poseChanged(const Transformation &T_old, const Transformation &T_new,
+                          const float translationTol, const float rotationTol);
+};
+
+/**
+ * @brief Submapping configuration (the "submaps" node of the supereight config file).
+ *
+ */
+struct SubmapConfig {
+  double distThreshold = 4;      // distance between keyframes (m) to start a new submap
+  int hashingThreads = 2;        // workers of the hashing job pool
+  float rehashTranslationTol = 0.02f; // on loop closure, submaps that moved less than this (m) ...
+  float rehashRotationTol = 0.005f;   // ... and rotated less than this (rad) are not rehashed
+  float hashCellSize = 1.f;      // side of the spatial hash boxes (m)
+  bool hashObservedBlocksOnly = false; // hash only the boxes with observed octants, not the whole bounding box
+  bool useEsdf = false;          // compute a distance layer per submap, for the planner
+  float esdfMaxDistance = 1.f;   // distances are truncated here (m). Should be > mav_radius
+  int activeEsdfInterval = 20;   // the active submap distance layer is recomputed at most once per this many integrated frames
+  float residentBudget = 0.f;    // memory (MB) for resident submaps, beyond it distant ones go to disk. 0: never evict
+  float evictionDistance = 10.f; // only submaps farther than this (m) from the current pose are evicted
+  int evictionCacheSize = 4;     // evicted submaps kept in memory once reloaded
+  bool loadSession = false;      // restore the finished submaps saved by the previous run at startup
+  bool saveSession = false;      // save the finished submaps at shutdown
+  bool saveHashTable = false;    // write the spatial hash cells at shutdown (utils/hash_cells.csv, spatial hash benchmark input)
+  bool adaptiveResolution = false; // scale each new submap (res and dim, by powers of 2) to the scene depth and speed
+  float adaptiveReferenceDepth = 4.f; // scene extent (m) the map config is meant for
+  float adaptiveSpeedHorizon = 2.f;   // travel time (s) added to the scene depth to get the extent
+  float minRes = 0.05f;          // finest adaptive submap resolution (m) ...
+  float maxRes = 0.8f;           // ... and coarsest. The map config res is always allowed
+  float submapMemoryBudget = 0.f; // memory (MB) of the active submap, beyond it integration stops until the next one. 0: no cap
+  float memoryStatsPeriod = 0.f; // the node samples the memory statistics into utils/memory_stats.csv this often (s). 0: never
+  FrameSchedulerConfig scheduler; // queue bounds and frame decimation ("scheduler" node)
+  DepthPreprocessorConfig depth;  // depth downsampling and clipping ("depth_preprocessing" node)
+
+  /**
+   * @brief      Reads the config from file. Missing entries keep their default value.
+   *
+   * @param[in]  filename  The supereight config file.
+   */
+  void readYaml(const std::string &filename);
+
+  /**
+   * @brief      Scale (a power of 2) applied to the res and dim of the map config for a new
+   * submap: the octree keeps its size, the voxels get coarser or finer. 1 if not adaptive.
+   *
+   * @param[in]  res     Resolution of the map config.
+   * @param[in]  extent  Scene extent (m), 0 for the finest allowed scale.
+   */
+  float submapScale(const float res, const float extent) const;
+};
+
+// triangle vertices (3 per triangle) of a submap mesh, in the submap (keyframe) frame [m]
+typedef std::vector<Eigen::Vector3f> SubmapMesh;
+// (id, mesh of a newly finished submap or nullptr for a pose update only, submap poses)
+typedef std::function<void(uint64_t, const std::shared_ptr<const SubmapMesh>&, const std::unordered_map<uint64_t, Transformation>&)> submapMeshesCallback;
+// (id of the submap whose geometry changed or 0, submap poses, submaps)
+typedef std::function<void(uint64_t, const std::unordered_map<uint64_t, Transformation>&, const std::unordered_map<uint64_t, SubmapPtr>&)> submapCallback;
 
 class SupereightInterface {
 public:
@@ -110,45 +199,83 @@ public:
    * @param[in]  mapConfig Map configuration.
    * @param[in]  dataConfig Occupancy mapping configuration.
    * @param[in]  T_SC Homogenous transformation from sensor to depth camera.
-   * @param[in]  mapConfig Map configuration.
    * @param[in]  meshesPath  Directory where we store map meshes.
+   * @param[in]  submapConfig  Submapping configuration.
    */
   SupereightInterface(const se::PinholeCameraConfig &cameraConfig,
                       const se::MapConfig &mapConfig,
                       const se::OccupancyDataConfig &dataConfig,
                       const Eigen::Matrix4d &T_SC,
                       const std::string &meshesPath,
-                      const double &distThreshold = 4)
-      : T_SC_(T_SC), T_CS_(T_SC.inverse()), sensor_(cameraConfig), mapConfig_(mapConfig),
-        dataConfig_(dataConfig), meshesPath_(meshesPath), distThreshold_(distThreshold) {
+                      const SubmapConfig &submapConfig = SubmapConfig())
+      : T_SC_(T_SC), T_CS_(T_SC.inverse()),
+        sensor_(se::PinholeCamera(cameraConfig), submapConfig.depth.downsampling), mapConfig_(mapConfig),
+        dataConfig_(dataConfig), meshesPath_(meshesPath), submapConfig_(submapConfig),
+        keyframePoses_(Transformation(T_SC)), appliedPoseVersion_(0),
+        poseCache_(submapConfig.scheduler.stateQueueSize), loopClosuresSeen_(0),
+        scheduler_(submapConfig.scheduler), depthPreprocessor_(submapConfig.depth),
+        stats_(std::make_shared<PipelineStats>()) {
     
     //se::OccupancyMap<se::Res::Multi> map(mapConfig_, dataConfig_);
-    no_kf_yet = true;
-    latestKeyframeId = 1;
     blocking_ = true;
-
-    std::cout << "\n\nSubmap distance threshold: " << distThreshold_ << "\n\n";
+    poseCache_.setBlocking(true);
+    mapSnapshot_ = std::make_shared<const MapSnapshot>();
+    mapSnapshotDirty_ = false;
+    posesMoved_ = false;
+    recentDepth_ = 0.f;
+    recentSpeed_ = 0.f;
+    activeMapFull_ = false;
+    activeEsdfRequested_ = false;
+    activeMemoryRequested_ = false;
+    shutdown_ = false;
+    hashingPool_.reset(new SubmapJobPool(submapConfig_.hashingThreads));
+    if (submapConfig_.residentBudget > 0)
+      submapStore_.reset(new SubmapStore(meshesPath_, mapConfig_, dataConfig_, submapConfig_.evictionCacheSize));
+
+    // recycled depth frames: no allocations per frame once the pipeline runs
+    const int width = depthPreprocessor_.outputSize(cameraConfig.width);
+    const int height = depthPreprocessor_.outputSize(cameraConfig.height);
+    // a frame is held by either queue, plus the one being pushed and the one being integrated
+    const size_t depthPoolSize = submapConfig_.scheduler.depthQueueSize + submapConfig_.scheduler.supereightQueueSize + 2;
+    depthFramePool_.reset(new BufferPool<DepthFrame>(depthPoolSize, [width, height] { return std::make_shared<DepthFrame>(width, height); }, 8));
+    depthFrameWidth_ = width;
+    depthFrameHeight_ = height;
+
+    std::cout << "\n\nSubmap distance threshold: " << submapConfig_.distThreshold << "\n\n";
   };
 
   /**
    * @brief      Destroys the object.
    */
   ~SupereightInterface() {
+    shutdown_ = true;
+
     // Shutdown all the Queues.
     depthMeasurements_.Shutdown();
-    stateUpdates_.Shutdown();
+    poseCache_.shutdown();
     supereightFrames_.Shutdown();
 
+    // Wake up the threads (taking the mutexes so that the notification is not lost)
+    { std::lock_guard<std::mutex> lk(cvMutex_); }
+    cvNewSensorMeasurements_.notify_all();
+    { std::lock_guard<std::mutex> lk(s8Mutex_); }
+    cvNewSupereightData_.notify_all();
+
     // Wait for threads
-    processingThread_.join();
-    dataPreparationThread_.join();
+    if (processingThread_.joinable()) processingThread_.join();
+    if (dataPreparationThread_.joinable()) dataPreparationThread_.join();
+
+    // Only the processing thread pushes hashing jobs, and the jobs hold iterators
+    // into submaps_: stop them before the members go away.
+    hashingPool_->shutdown();
   };
 
   /**
    * @brief      Adds a depth frame to the measurement Queue.
    *
    * @param[in]  stamp       The timestamp.
-   * @param[in]  depthFrame  The depth frame.
+   * @param[in]  depthFrame  The depth frame (CV_32FC1, metres). Copied once into a
+   * supereight image before returning, so it can share the ROS message buffer.
    *
    * @return     True if successful.
    */
@@ -171,7 +298,7 @@ public:
    *
    * @param[in]  latestState          The current OKVIS state
    * @param[in]  latestTrackingState  The current tracking state
-   * @param[in]  keyframeStates       The state of the updated Keyframes
+   * @param[in]  keyframeStates       The state of the updated Keyframes (only the changed poses are passed on)
    *
    * @return     True when successful
    */
@@ -186,22 +313,42 @@ public:
    */
   size_t getSupereightQueueSize() { return supereightFrames_.Size(); };
 
+  /**
+   * @brief      Gets the work not done yet, e.g. to wait for the pipeline to drain.
+   *
+   * @return     The depth frames waiting for a pose, the supereight frames waiting for
+   * integration and the submap jobs (hashing, finalizing, eviction) queued or running.
+   * Depth frames newer than the last okvis update stay counted.
+   */
+  size_t pendingWork() { return depthMeasurements_.Size() + supereightFrames_.Size() + hashingPool_->outstanding(); }
+
   /**
    * @brief      Set blocking/not blocking mode.
    *
    */
   void setBlocking(bool blocking) {
   blocking_ = blocking;
+  poseCache_.setBlocking(blocking);
 }
 
 
 /**
-   * @brief      Called by the planner: copies lookup tables that are needed by the planner and saves them in separate data structures.
-   * We do this instead of just using a mutex because planner needs to use the lookups lots of 
-   * times and we don't want to slow down the main pipeline.
+   * @brief      Called by the planner: returns the latest published lookups snapshot.
+   * Taking the snapshot is O(1) and does not block the main pipeline. The snapshot
+   * stays valid (and unchanged) for as long as the caller holds it.
    *
+   * @return     The latest map snapshot.
    */
-void fixReadLookups();
+std::shared_ptr<const MapSnapshot> getMapSnapshot() const { return std::atomic_load(&mapSnapshot_); }
+
+/**
+   * @brief      Called by the planner: asks for the distance layer of the submap being
+   * integrated to be (re)computed. It is done lazily by the processing thread after the next
+   * integration (at most once every active_esdf_interval frames of that submap), and shows up
+   * in the following snapshots. No-op if use_esdf is off.
+   *
+   */
+void requestActiveEsdf() { activeEsdfRequested_ = submapConfig_.useEsdf; }
 
 /**
    * @brief      Set function that handles submaps visualization (meshes version)
@@ -221,48 +368,108 @@ void setSubmapCallback(const submapCallback &submapCallback) { submapCallback_ =
    */
 void publishSubmaps();
 
+/**
+   * @brief      Writes all the spatial hash entries as "x,y,z,id" lines (one per box and submap).
+   * Used to feed the spatial hash benchmark with recorded data.
+   *
+   * @param[in]  filename  Output csv file.
+   *
+   * @return     True when successful.
+   */
+bool saveHashTable(const std::string &filename);
 
-// to hash a 3 int eigen vector
-struct SpatialHasher {
-  std::size_t operator()(const Eigen::Vector3i& a) const {
-      std::size_t h = 0;
+/**
+   * @brief      Waits for the queued and running submap jobs (hashing, finalizing, eviction),
+   * then stops the hashing pool: jobs pushed afterwards are dropped. Call at shutdown, before
+   * saveSession(), so that the submaps finished by then are all in the save.
+   */
+void finishSubmapJobs();
 
-      // taken from matthias teschner 2003 collision
-      const int p1 = 73856093;
-      const int p2 = 19349663;
-      const int p3 = 83492791;
-      h = a[0]*p1 ^ a[1]*p2 ^ a[2]*p3;
+/**
+   * @brief      Saves the finished submaps (octree, pose, bounds and hash boxes) so that a
+   * later run can resume from them. The submap being integrated is left out, and so are
+   * those whose finalization did not run yet (see finishSubmapJobs()). Safe to call
+   * while running.
+   *
+   * @param[in]  directory  Existing output directory.
+   *
+   * @return     True when successful.
+   */
+bool saveSession(const std::string &directory);
+
+/**
+   * @brief      Restores the submaps saved by saveSession(), one loading thread per core.
+   * They get new ids (okvis restarts its own) and keep their saved poses, i.e. the new run
+   * is assumed to start in the frame of the saved one. Call before start().
+   *
+   * @param[in]  directory  Session directory.
+   *
+   * @return     False if there is no session there.
+   */
+bool loadSession(const std::string &directory);
+
+/**
+   * @brief      Submap eviction statistics (all 0 if eviction is off).
+   *
+   */
+SubmapStoreStats getEvictionStats() const { return submapStore_ ? submapStore_->stats() : SubmapStoreStats(); }
+
+/**
+   * @brief      Timing of the pipeline stages, queue depths and drops. Safe to read while running.
+   *
+   */
+std::shared_ptr<const PipelineStats> getPipelineStats() const { return stats_; }
+
+/**
+   * @brief      Memory of the submap octrees, spatial hash, planner snapshot and queues. Safe to
+   * call while running. The active submap is measured by the processing thread, which is asked
+   * to do so here: its counts are those of the previous request (or of the memory budget check).
+   *
+   */
+MemoryStats getMemoryStats();
+
+/**
+   * @brief      Occupancy flags of a map over each of its boxes (SpatialHash::Flags), from the
+   * max occupancy of its octree nodes (at most block scale) overlapping the box. The planner
+   * skips the octrees of the boxes this calls free, so reloaded maps (SubmapStore, sessions)
+   * must have their coarse scales.
+   *
+   * @param[in]  map       The map.
+   * @param[in]  cells     Its boxes.
+   * @param[in]  T_WM      Pose of the map (octree) frame.
+   * @param[in]  cellSize  Side of the boxes (hash_cell_size).
+   *
+   * @return     One entry per box.
+   */
+static std::vector<uint8_t> computeCellFlags(const se::OccupancyMap<se::Res::Multi> &map,
+                                             const std::vector<SpatialHash::Key> &cells,
+                                             const Eigen::Matrix4f &T_WM, const float cellSize);
 
-      return h;
-  }   
-};
 
 // To access maps
-std::unordered_map<uint64_t, SubmapList::iterator> submapLookup_; // use this to access submaps (index,submap)
+std::unordered_map<uint64_t, SubmapList::iterator> submapLookup_; // use this to access submaps (index,submap). the submap is nullptr once evicted
 std::unordered_map<uint64_t, Transformation> submapPoseLookup_; // use this to access submap poses (index,pose in camera frame)
 std::unordered_map<uint64_t, Eigen::Matrix<float,6,1>> submapDimensionLookup_; // use this when reindexing maps on loop closures (index,dims)
-// spatial hash maps: side x side x side boxes 
-std::unordered_map<Eigen::Vector3i, std::unordered_set<int>, SpatialHasher> hashTable_; // a hash table for quick submap access (box coord, list of indexes)
-std::unordered_map<int, std::unordered_set<Eigen::Vector3i, SpatialHasher>> hashTableInverse_; // inverse access hash table (index, list of box coords)
-// Static lookups to use for collision checking 
-// We need a separate copy or else segfault bc multiple threads accessing
-// cannot pass map by value... the function is called thousands of times
-std::unordered_map<uint64_t, SubmapList::iterator> submapLookup_read; 
-std::unordered_map<uint64_t, Transformation> submapPoseLookup_read;
-std::unordered_map<Eigen::Vector3i, std::unordered_set<int>, SpatialHasher> hashTable_read;
+// spatial hash maps: side x side x side boxes (side is hash_cell_size)
+SpatialHash hashTable_; // a hash table for quick submap access (box coord, list of indexes)
+std::unordered_map<int, std::vector<SpatialHash::Key>> hashTableInverse_; // inverse access hash table (index, sorted list of packed box coords)
+std::unordered_map<uint64_t, Transformation> submapHashedPoseLookup_; // pose each finished submap was last hashed with (index, pose). guarded by hashTableMutex_
+std::unordered_map<uint64_t, std::shared_ptr<const SubmapEsdf>> submapEsdfLookup_; // distance layers (index, esdf). guarded by hashTableMutex_
 
 
 private:
 
   /**
-   * @brief      Converts an OpenCV Mat depth frame following the TUM convention
-   * (5000.f -> 1m ) into the depth Images used in supereight
+   * @brief      Converts an OpenCV Mat depth frame (CV_32FC1, 1.0 = 1m) into the depth
+   * Images used in supereight. This is the only copy of the depth data in the pipeline.
+   * Works on non continuous Mats too (e.g. ROS images with padded rows). The output
+   * comes from the depth frame pool when it has the configured sensor size.
    *
    * @param[in]  inputDepth  The input OpenCV Mat depth
    *
    * @return     The depth frame as a supereight Image
    */
-  static DepthFrame depthMat2Image(const cv::Mat &inputDepth);
+  std::shared_ptr<const DepthFrame> depthMat2Image(const cv::Mat &inputDepth);
 
   /**
    * @brief      Converts a supereight depth Image into an OpenCV Mat following
@@ -275,20 +482,18 @@ private:
   static cv::Mat depthImage2Mat(const DepthFrame &depthFrame);
 
   /**
-   * @brief      Given time stamp of depth frame, propagates latest okvis update to get pose estimate. It also gets from the states updates queue: 
-   * vector of updated keyframes, latest keyframe id, loop closure status.
+   * @brief      Turns the pose cache answer for a depth frame into its pose estimate, the
+   * latest keyframe id and the loop closure status.
    *
-   * @param[in]  finalTimestamp  Timestamp of the depth frame. 
+   * @param[in]  query  Pose cache lookup at the stamp of the depth frame.
    * @param[out]  T_WC  Predicted depth frame pose w.r.t. world.
    * @param[out]  keyframeId  Latest Keyframe Id.
-   * @param[out]  keyFrameDataVec  Array of updated Keyframes.
-   * @param[out]  loop_closure  Is the latest Okvis update a loop closure update?
+   * @param[out]  loop_closure  Did okvis close a loop since the previous predicted frame?
    *
-   * @return     The depth frame as a supereight Image
+   * @return     False if the frame has no pose (yet).
    */
-  bool predict(const okvis::Time &finalTimestamp,
+  bool predict(const PoseQuery &query,
                Transformation &T_WC, uint64_t &keyframeId,
-               KeyFrameDataVec &keyFrameDataVec,
                bool &loop_closure);
 
   /**
@@ -321,7 +526,7 @@ private:
    * @param[in]  map  Pointer to the map.
    * 
    */
-  void redoSpatialHashing(const uint64_t id, const Transformation Tf, const SubmapList::iterator map);
+  void redoSpatialHashing(const uint64_t id, const Transformation Tf, const SubmapPtr map);
 
   /**
    * @brief   Pre-index new map as soon as we start integrating.
@@ -340,7 +545,197 @@ private:
    * @param[in]  map  Pointer to the map.
    * 
    */
-  void doSpatialHashing(const uint64_t id, const Transformation Tf, const SubmapList::iterator map);
+  void doSpatialHashing(const uint64_t id, const Transformation Tf, const SubmapPtr map);
+
+  /**
+   * @brief   Finalization stage of a map that is done being integrated: bounds, hashing and
+   * mesh generation. Runs on the hashing pool, off the integration thread. The map is then
+   * published by publishFinalizedSubmaps().
+   * 
+   * @param[in]  id  Id of the map.
+   * @param[in]  Tf  Pose of the map
+   * @param[in]  map  Pointer to the map.
+   * 
+   */
+  void finalizeSubmap(const uint64_t id, const Transformation Tf, const SubmapPtr map);
+
+  /**
+   * @brief   Publishes the finalized submaps, in the order they were completed, with the
+   * latest lookups snapshot. Processing thread only.
+   * 
+   */
+  void publishFinalizedSubmaps();
+
+  /**
+   * @brief   Allocates the next active submap on the hashing pool.
+   * 
+   * @param[in]  scale  Scale of the map config for it (see SubmapConfig::submapScale).
+   * 
+   */
+  void prepareSpareSubmap(const float scale);
+
+  /**
+   * @brief   Takes the pre-allocated submap (allocates it if it is not ready yet, or if the
+   * scene now needs another scale) and prepares the next one. Processing thread only.
+   * 
+   * @return  The new, empty submap.
+   */
+  SubmapPtr takeSpareSubmap();
+
+  /**
+   * @brief   Scale of the map config for a submap created now, from the recent scene depth
+   * and speed. 1 if not adaptive, or before any depth frame.
+   * 
+   */
+  float newSubmapScale() const;
+
+  /**
+   * @brief   The map config scaled for a submap: res, dim and the map origin.
+   * 
+   * @param[in]  scale  The scale.
+   * 
+   */
+  se::MapConfig scaledMapConfig(const float scale) const;
+
+  /**
+   * @brief   Folds a depth frame and the velocity at its stamp into the recent scene
+   * depth and speed. Data preparation thread only.
+   * 
+   * @param[in]  depthFrame  The depth frame.
+   * @param[in]  v_W  Velocity at its stamp.
+   * 
+   */
+  void updateSceneStatistics(const DepthFrame &depthFrame, const Eigen::Vector3d &v_W);
+
+  /**
+   * @brief   The resident submaps (the evicted ones are left out).
+   * 
+   */
+  std::unordered_map<uint64_t, SubmapPtr> residentSubmaps() const;
+
+  /**
+   * @brief   Submap switch: if the resident submaps are over budget, pushes an eviction scan
+   * (scanEvictionCandidates) to the hashing pool. O(1) here. Processing thread only.
+   * 
+   * @param[in]  r_W  Current position.
+   * 
+   */
+  void evictSubmaps(const Eigen::Vector3d &r_W);
+
+  /**
+   * @brief   Eviction scan, on the hashing pool: walks the submaps from the least recently
+   * used and pushes eviction jobs for the distant ones until the resident submaps fit in the
+   * budget. Poses and maps come from the latest snapshot. The maps are released by
+   * releaseEvictedSubmaps() once they are on disk.
+   * 
+   * @param[in]  r_W  Position at the switch.
+   * 
+   */
+  void scanEvictionCandidates(const Eigen::Vector3d &r_W);
+
+  /**
+   * @brief   Marks a submap as the most recently used one. O(1). Caller holds hashTableMutex_.
+   * 
+   */
+  void touchSubmap(const uint64_t id);
+
+  /**
+   * @brief   Drops the submaps whose eviction job completed. Processing thread only.
+   * 
+   * @return  True if any was dropped.
+   */
+  bool releaseEvictedSubmaps();
+
+  /**
+   * @brief   Launch visualization threads for the lookups of a snapshot.
+   * 
+   * @param[in]  snapshot  Lookups snapshot (shared with the threads, not copied).
+   * @param[in]  id  Id of the submap the mesh belongs to.
+   * @param[in]  mesh  Mesh of a newly finished submap, nullptr to only update the poses.
+   * 
+   */
+  void publishSubmaps(const std::shared_ptr<const MapSnapshot> &snapshot,
+                      const uint64_t id = 0, const std::shared_ptr<const SubmapMesh> &mesh = nullptr);
+
+  /**
+   * @brief   Extracts the mesh of a map, in memory.
+   * 
+   * @param[in]  map  The map.
+   * 
+   * @return  The mesh, in the map (keyframe) frame.
+   */
+  static std::shared_ptr<const SubmapMesh> extractMesh(const se::OccupancyMap<se::Res::Multi> &map);
+
+  /**
+   * @brief   Boxes of the spatial hash covered by a map: the ones intersecting its oriented
+   * bounding box, or only the ones intersecting its observed octants.
+   * 
+   * @param[in]  map  The map (only read if observedOnly).
+   * @param[in]  bounds  Map bounds (min, max corners, metres) in map frame.
+   * @param[in]  T_WM  Pose of the map (octree) frame.
+   * @param[in]  observedOnly  Rasterize the observed octants instead of the bounding box.
+   * 
+   * @return  The packed box coords, sorted and unique.
+   */
+  std::vector<SpatialHash::Key> computeSubmapCells(const se::OccupancyMap<se::Res::Multi> &map,
+                                                   const Eigen::Matrix<float,6,1> &bounds,
+                                                   const Eigen::Matrix4f &T_WM,
+                                                   const bool observedOnly) const;
+
+  /**
+   * @brief   Sets the boxes of a map in the hash table, only touching the boxes
+   * that changed (and the flags of the others). Caller holds hashTableMutex_.
+   * 
+   * @param[in]  id  Id of the map.
+   * @param[in]  cells  New boxes of the map, sorted and unique.
+   * @param[in]  flags  Their flags (computeCellFlags), or empty if the octree was not looked at.
+   * 
+   */
+  void applySubmapCells(const uint64_t id, std::vector<SpatialHash::Key> &&cells, const std::vector<uint8_t> &flags = {});
+
+  /**
+   * @brief   Did a map move beyond the rehash tolerances?
+   * 
+   */
+  bool poseChanged(const Transformation &T_old, const Transformation &T_new) const;
+
+  /**
+   * @brief   Observed bounds of a map: min and max corners (metres) of the
+   * observed octants, in map frame. Visits each leaf once (blocks are taken
+   * whole, their voxels are not visited).
+   * 
+   * @param[in]  map  The map.
+   * 
+   */
+  static Eigen::Matrix<float,6,1> computeMapBounds(const se::OccupancyMap<se::Res::Multi> &map);
+
+  /**
+   * @brief   Publish a new immutable snapshot of the lookups for the planner. Runs on the
+   * hashing pool (requestMapSnapshot), or before start(): it copies the submap lookups under
+   * lookupMutex_ and the hash table under hashTableMutex_.
+   * 
+   */
+  void publishMapSnapshot();
+
+  /**
+   * @brief   Has the hashing pool build and publish a new snapshot, then the finalized
+   * submaps (and the submap frames after a loop closure) with it. Called by the processing
+   * thread and by the hashing jobs once they are done. A pending request is replaced, so
+   * the snapshots come out in order and only for the latest state.
+   * 
+   */
+  void requestMapSnapshot();
+
+  /**
+   * @brief      Measures the active submap and keeps the result for getMemoryStats().
+   * Processing thread only.
+   *
+   * @param[in]  id   Id of the active submap.
+   * @param[in]  map  The active submap.
+   *
+   * @return     Its octree memory.
+   */
+  OctreeMemory measureActiveSubmap(const uint64_t id, const se::OccupancyMap<se::Res::Multi> &map);
 
   const Transformation
       T_SC_; ///< Transformation of the depth camera frame wrt IMU sensor frame
@@ -352,8 +747,6 @@ private:
   std::string meshesPath_;  ///< Path to save the meshes
   DepthFrameQueue
       depthMeasurements_; ///< Queue with the buffered Depth measurements
-  StateUpdatesQueue
-      stateUpdates_; ///< Queue containing all the state updates from okvis
   SupereightFrameQueue
       supereightFrames_; ///< Queue with the s8 frames (i.e. poses and depth
                          ///< frames) to be processed
@@ -367,6 +760,10 @@ private:
   std::mutex cvMutex_;
   std::mutex s8Mutex_;
   std::mutex hashTableMutex_; // either dohashing or redohashing
+  // The processing thread is the only writer of submaps_, submapLookup_, submapPoseLookup_
+  // and finestRes_: it takes this to write them, the snapshot jobs to read them. Taken before
+  // hashTableMutex_ when both are held.
+  std::mutex lookupMutex_;
 
   std::thread processingThread_;      ///< Thread running processing loop.
   std::thread dataPreparationThread_; ///< Thread running data preparation loop.
@@ -380,15 +777,103 @@ private:
 
   bool blocking_;
 
-  // We use this to store the active keyframe in predict(), to prepare the supereightframe
-  uint64_t latestKeyframeId;
-  bool no_kf_yet;
-
-  // Need this to extract okvis estimates at abitrary timestamps
-  okvis::Trajectory propagatedStates;
-
-  // Distance threshold to generate new map.
-  const double distThreshold_;
+  // Distance threshold to generate new map, distance layers.
+  const SubmapConfig submapConfig_;
+
+  // Raised by the planner, the processing thread then recomputes the active submap distance layer.
+  std::atomic<bool> activeEsdfRequested_;
+
+  // Runs the finalization and (re)hashing of the submaps. Jobs of a submap run in order, one at a time.
+  std::unique_ptr<SubmapJobPool> hashingPool_;
+
+  // Submaps waiting for publication: ids in the order they were completed, meshes of the
+  // finalized ones (nullptr if not meshed). Both guarded by finalizedMutex_.
+  std::deque<uint64_t> finalizationQueue_;
+  std::unordered_map<uint64_t, std::shared_ptr<const SubmapMesh>> finalizedSubmaps_;
+  std::mutex finalizedMutex_;
+
+  // Next active submap, allocated on the hashing pool ahead of the switch (guarded by spareMutex_).
+  // The allocation jobs run under their own id, one at a time.
+  static constexpr uint64_t kSpareSubmapId = std::numeric_limits<uint64_t>::max();
+  // Same for the snapshot builds and the eviction scans.
+  static constexpr uint64_t kSnapshotJobId = std::numeric_limits<uint64_t>::max() - 1;
+  static constexpr uint64_t kEvictionScanId = std::numeric_limits<uint64_t>::max() - 2;
+  SubmapPtr spareSubmap_;
+  float spareScale_ = 1.f; // scale it was allocated at
+  std::mutex spareMutex_;
+
+  // Adaptive submaps: smoothed median scene depth (m, 0 before any frame) and speed (m/s),
+  // written by the data preparation thread, read at the submap switch.
+  std::atomic<float> recentDepth_;
+  std::atomic<float> recentSpeed_;
+  std::vector<float> depthSamples_; // scratch, data preparation thread
+
+  // The active submap reached submapMemoryBudget: no integration until the next submap.
+  bool activeMapFull_;
+
+  // Finest resolution of the submaps created or loaded so far (0: none). Written under lookupMutex_.
+  float finestRes_ = 0.f;
+
+  // Memory instrumentation: octrees of the finished submaps (filled in by the finalization jobs,
+  // kept once evicted) and the last measurement of the active one, both under hashTableMutex_.
+  std::unordered_map<uint64_t, SubmapMemory> submapMemoryStats_;
+  SubmapMemory activeMemory_;
+  std::atomic<bool> activeMemoryRequested_; // raised by getMemoryStats()
+
+  // Integrator of the active submap, kept across frames. Rebuilt when a new submap starts.
+  std::unique_ptr<se::MapIntegrator<se::OccupancyMap<se::Res::Multi>>> activeIntegrator_;
+
+  // Raised by the destructor, makes the processing and data preparation loops return.
+  std::atomic<bool> shutdown_;
+
+  // Recycled depth frames (sensor size).
+  std::unique_ptr<BufferPool<DepthFrame>> depthFramePool_;
+  int depthFrameWidth_;
+  int depthFrameHeight_;
+
+  // Keyframe poses, written by stateUpdateCallback. The processing thread applies the changes
+  // since appliedPoseVersion_ to submapPoseLookup_, up to the version each frame was predicted with.
+  KeyframePoseStore keyframePoses_;
+  uint64_t appliedPoseVersion_;
+  KeyFrameDataVec changedPoses_; // scratch
+  std::unordered_set<uint64_t> movedSinceRehash_; // ids whose pose changed since the last loop closure
+
+  // okvis states, to get poses at the depth stamps
+  PoseCache poseCache_;
+  uint64_t loopClosuresSeen_; // loop closure count at the last predicted frame
+  PoseQueryVec poseQueries_; // one per depth frame of the current batch
+  std::vector<DepthMeasurement> depthBatch_;
+
+  // Submap eviction, all under hashTableMutex_. Sizes are filled in by the finalization jobs,
+  // uses by the processing thread, candidates picked by the eviction scan, evicted ids by the
+  // eviction jobs. The totals are kept up to date so the switch does not walk the submaps.
+  std::shared_ptr<SubmapStore> submapStore_; // nullptr if eviction is off
+  std::unordered_map<uint64_t, size_t> submapMemoryLookup_; // bytes of each finished resident submap
+  size_t residentBytes_ = 0; // their sum
+  std::vector<uint64_t> evictedSubmaps_; // on disk, to be released
+  std::list<uint64_t> submapLru_; // submap ids, least recently used first
+  std::unordered_map<uint64_t, std::list<uint64_t>::iterator> submapLruPos_; // (id, its position in submapLru_)
+  std::unordered_set<uint64_t> evicting_; // eviction job pushed
+  size_t evictingBytes_ = 0; // their sizes
+
+  // Picks the depth frames to integrate, from the integration latency.
+  FrameScheduler scheduler_;
+
+  // Downsamples / clips the depth frames in depthMat2Image (the sensor model matches its output).
+  DepthPreprocessor depthPreprocessor_;
+
+  // Pipeline instrumentation, fed by all threads. Shared with the detached publishing threads.
+  std::shared_ptr<PipelineStats> stats_;
+
+  // Latest lookups snapshot read by the planner. Swapped atomically, never modified in place.
+  std::shared_ptr<const MapSnapshot> mapSnapshot_;
+
+  // Raised by the processing thread (loop closure, evictions, active distance layer), which
+  // requests a new snapshot once per frame. The hashing jobs request theirs directly.
+  std::atomic<bool> mapSnapshotDirty_;
+
+  // A loop closure moved the submaps, the visualization is told after the next snapshot.
+  std::atomic<bool> posesMoved_;
 
 };
 
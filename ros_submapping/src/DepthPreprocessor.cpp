@@ -0,0 +1,68 @@
+#include <DepthPreprocessor.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+
+DepthPreprocessor::DepthPreprocessor(const DepthPreprocessorConfig &config) : config_(config)
+{
+  // checked when reading the config
+  assert(config_.downsampling == 1 || config_.downsampling == 2 || config_.downsampling == 4);
+  static_assert(DepthPreprocessorConfig::kMaxDownsampling == 4, "block sizes are powers of 2 up to 4");
+}
+
+void DepthPreprocessor::process(const float *input, const int width, const int height, const size_t stride, float *output) const
+{
+  const int ds = config_.downsampling;
+  const int outWidth = outputSize(width);
+  const int outHeight = outputSize(height);
+
+  // valid range. without clipping only NaNs and non positive depths are invalid
+  // (comparisons with NaN are false, so they fail the range test too)
+  const float lo = config_.clipRange ? config_.nearPlane : std::numeric_limits<float>::min();
+  const float hi = config_.clipRange ? config_.farPlane : std::numeric_limits<float>::max();
+
+  if (ds == 1) {
+    for (int v = 0; v < outHeight; v++) {
+      const float *in = input + v * stride;
+      float *out = output + v * outWidth;
+      for (int u = 0; u < outWidth; u++) {
+        const float d = in[u];
+        out[u] = (d >= lo && d <= hi) ? d : 0.f;
+      }
+    }
+    return;
+  }
+
+  // one row of block values at a time, invalid pixels are +inf so they never win the min
+  // and sort last for the median
+  const float inf = std::numeric_limits<float>::infinity();
+  const int n = ds * ds;
+  float block[DepthPreprocessorConfig::kMaxDownsampling * DepthPreprocessorConfig::kMaxDownsampling];
+
+  for (int v = 0; v < outHeight; v++) {
+    float *out = output + v * outWidth;
+    for (int u = 0; u < outWidth; u++) {
+      int k = 0;
+      for (int dv = 0; dv < ds; dv++) {
+        const float *in = input + (v * ds + dv) * stride + u * ds;
+        for (int du = 0; du < ds; du++, k++) {
+          const float d = in[du];
+          block[k] = (d >= lo && d <= hi) ? d : inf;
+        }
+      }
+
+      float value;
+      if (config_.pooling == DepthPreprocessorConfig::Pooling::Min) {
+        value = block[0];
+        for (k = 1; k < n; k++) value = std::min(value, block[k]);
+      } else {
+        // median of the valid ones (lower median for even counts)
+        std::sort(block, block + n);
+        const int valid = std::lower_bound(block, block + n, inf) - block;
+        value = valid ? block[(valid - 1) / 2] : inf;
+      }
+      out[u] = value < inf ? value : 0.f;
+    }
+  }
+}
@@ -0,0 +1,82 @@
+#include <FrameScheduler.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+// weight of the newest sample in the moving averages
+const double kAlpha = 0.1;
+}
+
+FrameScheduler::FrameScheduler(const FrameSchedulerConfig &config)
+    : config_(config), integrationTime_(0), latency_(0), havePose_(false),
+      keyframeId_(0), sinceKeyframe_(0), consecutiveSkips_(0), skipped_(0)
+{
+}
+
+bool FrameScheduler::accept(const okvis::kinematics::Transformation &T_WC, const uint64_t keyframeId,
+                            const double waited, const size_t queued, const bool force)
+{
+  std::lock_guard<std::mutex> lk(mutex_);
+
+  if (keyframeId != keyframeId_) {
+    keyframeId_ = keyframeId;
+    sinceKeyframe_ = 0;
+  } else {
+    sinceKeyframe_++;
+  }
+
+  bool keep = true;
+  if (config_.decimate && havePose_ && !force) {
+    // this frame is done once the queued ones and itself are integrated
+    const double predicted = waited + (queued + 1) * integrationTime_;
+    if (predicted > config_.latencyBudget) {
+      const okvis::kinematics::Transformation T_delta = T_WC_last_.inverse() * T_WC;
+      const double angle = 2.0 * std::acos(std::min(1.0, std::abs(T_delta.q().w())));
+      keep = sinceKeyframe_ < config_.keyframeFrames
+          || T_delta.r().norm() > config_.minTranslation
+          || angle > config_.minRotation
+          || consecutiveSkips_ >= config_.maxConsecutiveSkips;
+    }
+  }
+
+  if (keep) {
+    T_WC_last_ = T_WC;
+    havePose_ = true;
+    consecutiveSkips_ = 0;
+  } else {
+    consecutiveSkips_++;
+    skipped_++;
+  }
+  return keep;
+}
+
+void FrameScheduler::reportIntegration(const double integrationTime, const double latency)
+{
+  std::lock_guard<std::mutex> lk(mutex_);
+  if (integrationTime_ == 0) {
+    integrationTime_ = integrationTime;
+    latency_ = latency;
+  } else {
+    integrationTime_ += kAlpha * (integrationTime - integrationTime_);
+    latency_ += kAlpha * (latency - latency_);
+  }
+}
+
+double FrameScheduler::integrationTime() const
+{
+  std::lock_guard<std::mutex> lk(mutex_);
+  return integrationTime_;
+}
+
+double FrameScheduler::latency() const
+{
+  std::lock_guard<std::mutex> lk(mutex_);
+  return latency_;
+}
+
+size_t FrameScheduler::skipped() const
+{
+  std::lock_guard<std::mutex> lk(mutex_);
+  return skipped_;
+}
@@ -0,0 +1,57 @@
+#include <KeyframePoseStore.hpp>
+#include <algorithm>
+
+uint64_t KeyframePoseStore::update(const okvis::AlignedVector<okvis::State> &states)
+{
+  std::lock_guard<std::mutex> lk(mutex_);
+
+  for (const auto &state : states) {
+    const uint64_t id = state.id.value();
+    const okvis::kinematics::Transformation T_WM = state.T_WS * T_SC_;
+
+    auto it = poses_.find(id);
+    if (it != poses_.end()) {
+      // the optimisation window keeps resending the same poses
+      if (it->second.T() == T_WM.T()) continue;
+    } else {
+      it = poses_.emplace(id, T_WM).first;
+    }
+
+    version_++;
+    it->second = T_WM;
+    changes_.emplace(version_, KeyframeData(id, T_WM));
+  }
+
+  return version_;
+}
+
+uint64_t KeyframePoseStore::version() const
+{
+  std::lock_guard<std::mutex> lk(mutex_);
+  return version_;
+}
+
+uint64_t KeyframePoseStore::getChangedSince(const uint64_t since, const uint64_t until, KeyFrameDataVec &changed)
+{
+  changed.clear();
+
+  std::lock_guard<std::mutex> lk(mutex_);
+  const uint64_t upTo = std::max(since, std::min(until, version_));
+
+  // in version order: the last change of an id up to the version wins
+  changedScratch_.clear();
+  const auto end = changes_.upper_bound(upTo);
+  for (auto it = changes_.upper_bound(since); it != end; ++it) {
+    const auto index = changedScratch_.emplace(it->second.id, changed.size());
+    if (index.second) changed.push_back(it->second);
+    else changed[index.first->second] = it->second;
+  }
+  changes_.erase(changes_.begin(), end);
+  return upTo;
+}
+
+size_t KeyframePoseStore::size() const
+{
+  std::lock_guard<std::mutex> lk(mutex_);
+  return poses_.size();
+}
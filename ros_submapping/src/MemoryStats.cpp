@@ -0,0 +1,39 @@
+#include <MemoryStats.hpp>
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+
+size_t MemoryStats::totalBytes() const
+{
+  const size_t frames = std::max(depthPoolFrames, depthQueueFrames + supereightQueueFrames);
+  return resident.bytes + hashBytes + hashInverseBytes + snapshotBytes + esdfBytes
+       + frames * depthFrameBytes + poseCacheBytes;
+}
+
+bool MemoryStats::writeCsvRow(const std::string &filename, const bool first) const
+{
+  std::ofstream file(filename, first ? std::ios::trunc : std::ios::app);
+  if (!file.good()) return false;
+
+  // sizes in bytes, one row per sample
+  if (first)
+    file << "stamp,total_bytes,submaps,resident_blocks,resident_nodes,resident_bytes,active_bytes,"
+            "evicted,bytes_on_disk,hash_cells,hash_capacity,hash_load_factor,hash_bytes,"
+            "hash_inverse_bytes,snapshot_version,snapshot_bytes,esdf_bytes,depth_queue_frames,"
+            "supereight_queue_frames,queue_bytes,depth_pool_frames,depth_pool_misses,pose_cache_bytes\n";
+
+  size_t active = 0;
+  for (const SubmapMemory &submap : submaps) {
+    if (submap.active) active += submap.octree.bytes;
+  }
+
+  file << std::fixed << std::setprecision(3) << stamp << "," << totalBytes() << "," << submaps.size() << ","
+       << resident.blocks << "," << resident.nodes << "," << resident.bytes << "," << active << ","
+       << evicted << "," << bytesOnDisk << "," << hashCells << "," << hashCapacity << ","
+       << std::setprecision(4) << hashLoadFactor << "," << hashBytes << "," << hashInverseBytes << ","
+       << snapshotVersion << "," << snapshotBytes << "," << esdfBytes << "," << depthQueueFrames << ","
+       << supereightQueueFrames << "," << queueBytes() << "," << depthPoolFrames << ","
+       << depthPoolMisses << "," << poseCacheBytes << "\n";
+
+  return file.good();
+}
@@ -0,0 +1,126 @@
+#include <PipelineStats.hpp>
+#include <algorithm>
+#include <fstream>
+
+Histogram::Histogram() : count_(0), sum_(0), max_(0)
+{
+  for (auto &bucket : buckets_) bucket.store(0, std::memory_order_relaxed);
+}
+
+void Histogram::add(const uint64_t value)
+{
+  // index of the highest set bit, plus one
+  int bucket = 0;
+  for (uint64_t v = value; v && bucket < kBuckets - 1; v >>= 1) bucket++;
+
+  buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(value, std::memory_order_relaxed);
+
+  uint64_t max = max_.load(std::memory_order_relaxed);
+  while (value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {}
+}
+
+Histogram::Summary Histogram::summary() const
+{
+  Summary summary;
+  std::array<uint64_t, kBuckets> buckets;
+  for (int b = 0; b < kBuckets; b++) {
+    buckets[b] = buckets_[b].load(std::memory_order_relaxed);
+    summary.count += buckets[b];
+  }
+  if (!summary.count) return summary;
+
+  summary.mean = double(sum_.load(std::memory_order_relaxed)) / summary.count;
+  summary.max = max_.load(std::memory_order_relaxed);
+
+  // writers are not stopped: count, sum and buckets can be off by the values being added
+  auto percentile = [&](const double fraction) -> uint64_t {
+    const uint64_t rank = std::max<uint64_t>(1, uint64_t(fraction * summary.count));
+    uint64_t seen = 0;
+    for (int b = 0; b < kBuckets; b++) {
+      seen += buckets[b];
+      if (seen >= rank) return std::min(b ? (uint64_t(1) << b) - 1 : 0, summary.max);
+    }
+    return summary.max;
+  };
+  summary.p50 = percentile(0.5);
+  summary.p90 = percentile(0.9);
+  summary.p99 = percentile(0.99);
+  return summary;
+}
+
+PipelineStats::PipelineStats() : skipped_(0)
+{
+  for (auto &drops : drops_) drops.store(0, std::memory_order_relaxed);
+}
+
+void PipelineStats::addDuration(const Stage stage, const double seconds)
+{
+  durations_[static_cast<int>(stage)].add(uint64_t(std::max(0.0, seconds) * 1e6));
+}
+
+void PipelineStats::addQueueDepth(const Queue queue, const size_t depth)
+{
+  queueDepths_[static_cast<int>(queue)].add(depth);
+}
+
+void PipelineStats::addDrop(const Queue queue)
+{
+  drops_[static_cast<int>(queue)].fetch_add(1, std::memory_order_relaxed);
+}
+
+bool PipelineStats::writeCsv(const std::string &filename) const
+{
+  std::ofstream file(filename);
+  if (!file.good()) return false;
+
+  // one row per histogram: durations in ms, depths in elements. bucket b: values < 2^b
+  file << "type,name,count,mean,p50,p90,p99,max,drops";
+  for (int b = 0; b < Histogram::kBuckets; b++) file << ",bucket_" << b;
+  file << "\n";
+
+  auto writeRow = [&](const char *type, const char *name, const Histogram &histogram,
+                      const double scale, const uint64_t drops) {
+    const Histogram::Summary summary = histogram.summary();
+    file << type << "," << name << "," << summary.count << "," << summary.mean * scale << ","
+         << summary.p50 * scale << "," << summary.p90 * scale << "," << summary.p99 * scale << ","
+         << summary.max * scale << "," << drops;
+    for (int b = 0; b < Histogram::kBuckets; b++) file << "," << histogram.bucket(b);
+    file << "\n";
+  };
+
+  for (int s = 0; s < static_cast<int>(Stage::Count); s++)
+    writeRow("duration_ms", name(Stage(s)), durations_[s], 1e-3, 0);
+  for (int q = 0; q < static_cast<int>(Queue::Count); q++)
+    writeRow("queue_depth", name(Queue(q)), queueDepths_[q], 1.0, drops(Queue(q)));
+  // scheduler skips: a counter only
+  file << "skipped,scheduler,0,0,0,0,0,0," << skipped() << "\n";
+
+  return file.good();
+}
+
+const char *PipelineStats::name(const Stage stage)
+{
+  switch (stage) {
+    case Stage::DepthQueue: return "depth_queue";
+    case Stage::Prediction: return "prediction";
+    case Stage::SupereightQueue: return "supereight_queue";
+    case Stage::Integration: return "integration";
+    case Stage::EndToEnd: return "end_to_end";
+    case Stage::Hashing: return "hashing";
+    case Stage::Meshing: return "meshing";
+    case Stage::Publishing: return "publishing";
+    default: return "unknown";
+  }
+}
+
+const char *PipelineStats::name(const Queue queue)
+{
+  switch (queue) {
+    case Queue::Depth: return "depth";
+    case Queue::State: return "state";
+    case Queue::Supereight: return "supereight";
+    default: return "unknown";
+  }
+}
@@ -4,6 +4,11 @@ Planner::Planner(SupereightInterface* se_interface_, const std::string& filename
 
   // Set preempt flag
   preempt_plan = false;
+  goalVersion = 0;
+  activeGoalVersion = 0;
+  shutdown = false;
+  have_tree = false;
+  tree_snapshot_version = 0;
   
   // ============ SET SEINTERFACE PTR ============  
 
@@ -57,6 +62,35 @@ Planner::Planner(SupereightInterface* se_interface_, const std::string& filename
 
   std::cout << "\n\nMAV radius in planner: " << mav_radius << "\n\n";
 
+  // sampling planner, and how long it may take
+  std::string planner_name = "rrt_connect";
+  se::yaml::subnode_as_string(node_planner, "planner_type", planner_name);
+  assert(planner_name == "rrt_connect" || planner_name == "informed_rrt_star");
+  planning_time = 10.0f;
+  se::yaml::subnode_as_float(node_planner, "planning_time", planning_time);
+  assert(planning_time > 0);
+  profiling = false;
+  planner_threads = 1;
+  se::yaml::subnode_as_int(node_planner, "planner_threads", planner_threads);
+  assert(planner_threads >= 1);
+  replan_reuse_distance = 0.2f;
+  se::yaml::subnode_as_float(node_planner, "replan_reuse_distance", replan_reuse_distance);
+  assert(replan_reuse_distance >= 0);
+
+  // clearance cost, only meaningful with the submap distance layers
+  clearance_weight = 0;
+  se::yaml::subnode_as_float(node_planner, "clearance_weight", clearance_weight);
+  assert(clearance_weight >= 0);
+
+  SubmapConfig submapConfig;
+  submapConfig.readYaml(filename);
+  max_clearance = submapConfig.esdfMaxDistance;
+  if (submapConfig.useEsdf && max_clearance < mav_radius)
+    std::cout << "\n\nesdf_max_distance < mav_radius: collision checks will not use the distance layers \n\n";
+
+  // sphere samples at the map config res, until a snapshot brings the submap ones
+  setMapRes(map_res);
+
   ob::RealVectorBounds bounds(3);
 
   // set bounds
@@ -91,10 +125,24 @@ Planner::Planner(SupereightInterface* se_interface_, const std::string& filename
   // set collision checker
   ss->setStateValidityChecker(std::bind(&Planner::detectCollision, this, std::placeholders::_1 )); 
 
+  // edges: hash box flags first, voxels only where needed (instead of a full check per sample)
+  motionValidator = std::make_shared<SubmapMotionValidator>(ss->getSpaceInformation(), this);
+  ss->getSpaceInformation()->setMotionValidator(motionValidator);
+
   // specify cost heuristic for planner.
   ob::OptimizationObjectivePtr obj(new ob::PathLengthOptimizationObjective(ss->getSpaceInformation()));
 	obj->setCostToGoHeuristic(&ob::goalRegionCostToGo);
 
+  // path length + clearance. heuristic still admissible, clearance cost is >= 0
+  if (submapConfig.useEsdf && clearance_weight > 0)
+  {
+    auto multi = std::make_shared<ob::MultiOptimizationObjective>(ss->getSpaceInformation());
+    multi->addObjective(obj, 1.0);
+    multi->addObjective(std::make_shared<ClearanceObjective>(ss->getSpaceInformation(), this, max_clearance), clearance_weight);
+    multi->setCostToGoHeuristic(&ob::goalRegionCostToGo);
+    obj = multi;
+  }
+
   // // (optional) if we want to benchmark the planner, lets take the first (prob. crappy) solution, with this hack
   // // if we dont set this, rrtstar will keep on looking for better solutions until it runs out of time
   // only need this for rrt* /informed rrt * (the optimal ones)
@@ -107,11 +155,7 @@ Planner::Planner(SupereightInterface* se_interface_, const std::string& filename
   ss->setOptimizationObjective(obj);
   
   // set planner
-  //rrt = std::make_shared<og::InformedRRTstar>(ss->getSpaceInformation());
-  rrt = std::make_shared<og::RRTConnect>(ss->getSpaceInformation());
-  rrt->setRange(0.4);
-
-  ss->setPlanner(rrt);
+  setPlannerType(planner_name == "informed_rrt_star" ? PlannerType::InformedRRTStar : PlannerType::RRTConnect);
 
   // create empty path
   path = std::make_shared<og::PathGeometric>(ss->getSpaceInformation());
@@ -132,18 +176,54 @@ void Planner::setGoal(const Eigen::Vector3d & r)
 
 }
 
+Planner::~Planner()
+{
+  {
+    std::lock_guard<std::mutex> lk(goalMutex);
+    shutdown = true;
+  }
+  preempt_plan = true;
+  cvGoal.notify_all();
+  if (planningThread.joinable()) planningThread.join();
+}
+
+void Planner::startPlanningThread()
+{
+  planningThread = std::thread(&Planner::planningLoop, this);
+}
+
+void Planner::requestPlan(const Eigen::Vector3d & r)
+{
+  {
+    std::lock_guard<std::mutex> lk(goalMutex);
+    goalMailbox = r;
+    goalVersion++;
+  }
+  // the running query (if any) sees the new version at its next termination check
+  cvGoal.notify_one();
+}
+
+void Planner::planningLoop()
+{
+  while (true) {
+    Eigen::Vector3d r;
+    {
+      std::unique_lock<std::mutex> lk(goalMutex);
+      cvGoal.wait(lk, [&] { return shutdown || goalVersion != activeGoalVersion; });
+      if (shutdown) return;
+      r = goalMailbox;
+      activeGoalVersion = goalVersion.load();
+    }
+    goal = r;
+    plan(r);
+  }
+}
+
 // pass by value to avoid dangling reference
 bool Planner::plan(const Eigen::Vector3d r)
 { 
 
-  // As of now, thread is blocked if there's a running plan() thread. 
-  // Should not be this way --> preempt running thread with latest
-  
-  // TODO:
-  // preempt any other running planning thread, and wait for it to free the mutex.
-  // warning: preempt is not immediate, so we should still wait for the thread to free the mutex.
-  // Almost there, but ptc does not work inside the planner! planner does not check for termination condition!
-
+  // preempt a running plan() (e.g. a direct call) and wait for it to free the mutex
   preempt_plan = true;
   std::unique_lock<std::mutex> lk(planMutex);
   // flag is lowered here, as soon as the thread takes control
@@ -152,10 +232,14 @@ bool Planner::plan(const Eigen::Vector3d r)
   // need this later, for a hack in collision detector
   start_fixed = start;
 
-  // set the fixed lookups for the collision checking func
-  se_interface->fixReadLookups();
+  // distance layer of the submap being integrated is only computed on demand
+  se_interface->requestActiveEsdf();
+
+  // take the lookups snapshot for the collision checking func.
+  // we keep using the same one until the query is done.
+  takeMapSnapshot(se_interface->getMapSnapshot());
 
-  if (se_interface->submapLookup_read.empty() || se_interface->hashTable_read.empty()) {
+  if (mapSnapshot->submapLookup.empty() || mapSnapshot->hashTable.empty()) {
     std::cout << "Planner failed. No maps yet. \n";
     return false;
   }
@@ -180,10 +264,33 @@ bool Planner::plan(const Eigen::Vector3d r)
   (*goal_ompl)[1] = r[1];
   (*goal_ompl)[2] = r[2];
 
-  ss->clear();
-
-  // load current start & goal
-  ss->setStartAndGoalStates(start_ompl, goal_ompl);
+  // same query, and the tree still valid on the current map: keep growing it. the snapshot
+  // changes all the time (new hashing, active distance layer...), mostly away from the tree,
+  // so on a new one its motions are checked again rather than dropped.
+  // the tree stays rooted at the old start, so the robot must be able to get back to it: the
+  // path is then led from the current start into that root
+  ob::ScopedState<ob::RealVectorStateSpace> root_ompl(space);
+  for (int k = 0; k < 3; k++) (*root_ompl)[k] = tree_start[k];
+  const bool moved = start_fixed != tree_start;
+  const bool reuse = have_tree && replan_reuse_distance > 0
+                     && (start_fixed - tree_start).norm() < replan_reuse_distance && r == tree_goal
+                     && (!moved || ss->getSpaceInformation()->checkMotion(start_ompl.get(), root_ompl.get()))
+                     && (tree_snapshot_version == mapSnapshot->version || treeValid());
+  if (reuse) {
+    ss->getProblemDefinition()->clearSolutionPaths();
+    tree_snapshot_version = mapSnapshot->version;
+  } else {
+    ss->clear();
+    for (auto &instance : planners) instance->clear();
+
+    // load current start & goal
+    ss->setStartAndGoalStates(start_ompl, goal_ompl);
+
+    tree_start = start_fixed;
+    tree_goal = r;
+    tree_snapshot_version = mapSnapshot->version;
+  }
+  have_tree = true;
 
   // Planner termination condition. 
   // Thread terminates either when preempted by new planing query
@@ -192,13 +299,42 @@ bool Planner::plan(const Eigen::Vector3d r)
   ob::PlannerTerminationCondition ptc(std::bind(&Planner::terminatePlanner,this));
   //ob::PlannerTerminationCondition ptc = ob::timedPlannerTerminationCondition(0.2);
 
+  // anytime: the optimal planners report each better solution while they keep improving it.
+  // called from the solver threads: what it needs is copied now, and the path is published
+  // on its own thread, as the final one, not to hold up the solve
+  const ob::SpaceInformationPtr si = ss->getSpaceInformation();
+  ss->getProblemDefinition()->setIntermediateSolutionCallback(
+      [this, si, reuse, moved, start_ompl](const ob::Planner *, const std::vector<const ob::State *> &states, const ob::Cost) {
+        if (!pathCallback_ || states.empty()) return;
+        og::PathGeometric intermediate(si);
+        // a reused tree is rooted at the old start: lead in from the current one
+        if (reuse && moved) intermediate.append(start_ompl.get());
+        // states come goal first
+        for (auto it = states.rbegin(); it != states.rend(); ++it) intermediate.append(*it);
+        std::thread publishPath(pathCallback_, intermediate);
+        publishPath.detach();
+      });
+
   // ob::PlannerStatus solved = ss->solve(10.0);
-  ob::PlannerStatus solved = ss->solve(ptc);
+  ob::PlannerStatus solved;
+  if (parallel) {
+    // space information and problem; the instances set themselves up when solving
+    ss->setup();
+    solved = parallel->solve(ptc, 1, planners.size(), planner_type == PlannerType::InformedRRTStar);
+  } else {
+    solved = ss->solve(ptc);
+  }
   
   if (solved) {
 
   // get optimal path
   *path = ss->getSolutionPath();
+  // from where the robot is now (the simplification shortcuts the way back to the old root)
+  if (reuse && moved) {
+    og::PathGeometric led(ss->getSpaceInformation(), start_ompl.get());
+    led.append(*path);
+    *path = led;
+  }
 
   og::PathSimplifier path_simp(ss->getSpaceInformation()); // path simplifier
   path_simp.simplify(*path,0.05); // "simplify" the path
@@ -225,6 +361,130 @@ bool Planner::plan() {
   return plan(goal);
 }
 
+bool Planner::treeValid()
+{
+  const ob::SpaceInformationPtr si = ss->getSpaceInformation();
+  auto valid = [&](const ob::PlannerPtr &instance) {
+    ob::PlannerData data(si);
+    instance->getPlannerData(data);
+    std::vector<unsigned int> edges;
+    for (unsigned int v = 0; v < data.numVertices(); v++)
+    {
+      data.getEdges(v, edges);
+      for (const unsigned int w : edges)
+      {
+        if (!si->checkMotion(data.getVertex(v).getState(), data.getVertex(w).getState())) return false;
+      }
+    }
+    return true;
+  };
+
+  // one tree per instance
+  if (planners.empty()) return valid(rrt);
+  for (const auto &instance : planners)
+  {
+    if (!valid(instance)) return false;
+  }
+  return true;
+}
+
+void Planner::setPlannerType(const PlannerType type)
+{
+  std::unique_lock<std::mutex> lk(planMutex);
+
+  planner_type = type;
+  planners.clear();
+  for (int i = 0; i < planner_threads; i++) {
+    if (type == PlannerType::InformedRRTStar) {
+      auto informed = std::make_shared<og::InformedRRTstar>(ss->getSpaceInformation());
+      informed->setRange(0.4);
+      planners.push_back(informed);
+    } else {
+      auto connect = std::make_shared<og::RRTConnect>(ss->getSpaceInformation());
+      connect->setRange(0.4);
+      planners.push_back(connect);
+    }
+  }
+  rrt = planners.front();
+
+  ss->setPlanner(rrt);
+
+  // the others share the problem of ss (and its solutions)
+  parallel.reset();
+  if (planners.size() > 1) {
+    parallel = std::make_shared<ompl::tools::ParallelPlan>(ss->getProblemDefinition());
+    for (auto &instance : planners) {
+      instance->setProblemDefinition(ss->getProblemDefinition());
+      parallel->addPlanner(instance);
+    }
+  } else {
+    planners.clear(); // ss owns the only one
+  }
+
+  // the new planner has no tree yet
+  have_tree = false;
+}
+
+void Planner::setPlannerThreads(const int threads)
+{
+  assert(threads >= 1);
+  {
+    std::unique_lock<std::mutex> lk(planMutex);
+    planner_threads = threads;
+  }
+  setPlannerType(planner_type);
+}
+
+void Planner::setMapRes(const float res)
+{
+  map_res = res;
+
+  // precompute the sphere samples for the collision checker.
+  // step is the map res, not to miss any voxels.
+  // radius of the sphere is actually not 
+  // the true radius, but:
+  // ceil is conservative, floor is faster but might get too close to obstacles
+  double radius = map_res * floor(mav_radius/map_res);
+
+  std::vector<Eigen::Vector3d> offsets;
+  for (float z = -radius; z <= radius; z += map_res)
+  {
+    for (float y = -radius; y <= radius; y += map_res)
+    {
+      for (float x = -radius; x <= radius; x += map_res)
+      {
+        if((std::pow(x,2) + std::pow(y,2) + std::pow(z,2)) > std::pow(radius,2)) continue; // skip if point is outside radius
+        offsets.emplace_back(x, y, z);
+      }
+    }
+  }
+
+  sphereStencil.resize(3, offsets.size());
+  for (size_t i = 0; i < offsets.size(); i++) sphereStencil.col(i) = offsets[i];
+}
+
+void Planner::takeMapSnapshot(const std::shared_ptr<const MapSnapshot> &snapshot)
+{
+  mapSnapshot = snapshot;
+
+  // adaptive submaps: step at the finest one there is, to skip no voxel in any of them
+  if (mapSnapshot->finestRes > 0 && mapSnapshot->finestRes != map_res) setMapRes(mapSnapshot->finestRes);
+  motionValidator->clear();
+}
+
+bool Planner::updateMapSnapshot()
+{
+  return updateMapSnapshot(se_interface->getMapSnapshot());
+}
+
+bool Planner::updateMapSnapshot(const std::shared_ptr<const MapSnapshot> &snapshot)
+{
+  std::unique_lock<std::mutex> lk(planMutex);
+  start_fixed = start;
+  takeMapSnapshot(snapshot);
+  return !mapSnapshot->submapLookup.empty() && !mapSnapshot->hashTable.empty();
+}
+
 void Planner::processState(const okvis::State& state, const okvis::TrackingState& trackingstate)
 {
 
@@ -234,96 +494,251 @@ void Planner::processState(const okvis::State& state, const okvis::TrackingState
 
 
 bool Planner::detectCollision(const ompl::base::State *state) 
+{
+
+  PlannerProfile local;
+  if (!profiling) return checkSphere(state, local);
+
+  const auto check_start = std::chrono::steady_clock::now();
+  const bool valid = checkSphere(state, local);
+  local.checkTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - check_start).count();
+  local.checks++;
+  if (valid) local.valid++;
+  addProfile(local);
+  return valid;
+
+}
+
+void Planner::addProfile(const PlannerProfile &local)
+{
+  std::lock_guard<std::mutex> lk(profileMutex);
+  profile.add(local);
+}
+
+bool Planner::checkSphere(const ompl::base::State *state, PlannerProfile &local) 
 {
 
   const ompl::base::RealVectorStateSpace::StateType *pos = state->as<ompl::base::RealVectorStateSpace::StateType>();
   
-  // the voxel we want to query (wrt world frame, homogenous)
-  Eigen::Vector4d r(pos->values[0],pos->values[1],pos->values[2],1);
+  // the voxel we want to query (wrt world frame)
+  const Eigen::Vector3d r(pos->values[0],pos->values[1],pos->values[2]);
 
   // Hack: when e.g. camera moves backwards we move out of the map -> this means that start
   // state is always invalid! We can avoid this by arbitrarily saying that if state is real close to 
   // start -> is free. Adds a bit of overhead (but maybe also saves some time). Comment out when benchmarking
-  if((r.head<3>() - start_fixed).norm() < 0.5) return true;
+  if((r - start_fixed).norm() < 0.5) return true;
+
+  // distance layers: one lookup per overlapping submap. If they can't decide, fall back to the sphere check
+  bool free;
+  if (checkEsdf(r, free)) return free;
+
+  // scratch buffers, reused across calls (one per thread)
+  thread_local SphereQuery query;
+  const auto hash_start = profiling ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+
+  // samples of the sphere around the drone (world frame), and the hash box each one is in
+  const Eigen::Index n = sphereStencil.cols();
+  const double cell_size = mapSnapshot->hashCellSize;
+  query.points.noalias() = sphereStencil.colwise() + r;
+  query.keys.resize(n);
+  query.order.resize(n);
+  for (Eigen::Index i = 0; i < n; i++)
+  {
+    const Eigen::Vector3i box_coord = (query.points.col(i) / cell_size).array().floor().cast<int>();
+    query.keys[i] = SpatialHash::pack(box_coord);
+    query.order[i] = i;
+  }
 
-  // check occ inside a sphere around the drone 
-  // step is the map res, not to miss any voxels.
-  // radius of the sphere is actually not 
-  // the true radius, but:
-  // ceil is conservative, floor is faster but might get too close to obstacles
-  double radius = map_res * floor(mav_radius/map_res);
+  // group samples by box: each box (and its submaps) is then resolved once
+  std::sort(query.order.begin(), query.order.end(), [&](const Eigen::Index a, const Eigen::Index b) { return query.keys[a] < query.keys[b]; });
 
-  for (float z = -radius; z <= radius; z += map_res)
+  // first pass: if any sample is not in any submap -> collision, before touching the octrees.
+  // samples in boxes flagged free need no octree either
+  query.cells.clear();
+  for (Eigen::Index begin = 0; begin < n; )
   {
-    for (float y = -radius; y <= radius; y += map_res)
+    Eigen::Index end = begin + 1;
+    while (end < n && query.keys[query.order[end]] == query.keys[query.order[begin]]) end++;
+    const SpatialHash::Cell* cell = mapSnapshot->hashTable.find(query.keys[query.order[begin]]);
+    if (!cell) {
+      if (profiling) local.hashTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - hash_start).count();
+      return false;
+    }
+    if (!mapSnapshot->cellFree(*cell)) query.cells.push_back({cell, begin, end});
+    begin = end;
+  }
+  if (query.cells.empty()) {
+    if (profiling) local.hashTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - hash_start).count();
+    return true;
+  }
+  const auto octree_start = profiling ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+  if (profiling) local.hashTime += std::chrono::duration<double>(octree_start - hash_start).count();
+
+  // need this to avg occupancy
+  query.occupancy.setZero(n);
+  query.weight.setZero(n);
+
+  // second pass: per box, transform all its samples at once in each of the box submaps
+  for (const auto &group : query.cells)
+  {
+    const Eigen::Index count = group.end - group.begin;
+    query.group.resize(4, count);
+    for (Eigen::Index j = 0; j < count; j++)
     {
-      for (float x = -radius; x <= radius; x += map_res)
+      query.group.col(j) << query.points.col(query.order[group.begin + j]), 1.0;
+    }
+
+    mapSnapshot->hashTable.forEachId(*group.cell, [&](const int id) {
+
+      // skip ids we don't have a pose or a map for (yet)
+      const auto T_fw = mapSnapshot->submapInversePoseLookup.find(id);
+      if (T_fw == mapSnapshot->submapInversePoseLookup.end()) return;
+      const auto resident = mapSnapshot->submapLookup.find(id);
+      SubmapPtr map;
+      if (resident != mapSnapshot->submapLookup.end()) map = resident->second;
+      else if (mapSnapshot->submapStore) map = mapSnapshot->submapStore->load(id); // evicted to disk
+      if (!map) return;
+
+      // transform state coords to check from world to map frame
+      query.groupMap.noalias() = T_fw->second * query.group; // state coordinates (homogenous) in map frame
+
+      for (Eigen::Index j = 0; j < count; j++)
       {
-        if((std::pow(x,2) + std::pow(y,2) + std::pow(z,2)) > std::pow(radius,2)) continue; // skip if point is outside radius
+        const Eigen::Vector3f r_map = query.groupMap.col(j).head<3>().cast<float>(); // take first 3 elems and cast to float
+
+        // if voxel belongs to current submap -> add occupancy
+        if(map->contains(r_map))
+        {
+          const Eigen::Index i = query.order[group.begin + j];
+          auto data = map->getData(r_map);
+          query.occupancy[i] += data.occupancy * data.weight;
+          query.weight[i] += data.weight;
+        }
+      }
+    });
+  }
+
+  if (profiling) local.octreeTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - octree_start).count();
+
+  // when done iterating over submaps, check total occupancy (weighted average)
+  for (const auto &group : query.cells)
+  {
+    for (Eigen::Index j = group.begin; j < group.end; j++)
+    {
+      const Eigen::Index i = query.order[j];
+      if(query.weight[i] == 0) return false;
+      if(query.occupancy[i]/query.weight[i] >= 0 ) return false; 
+    }
+  }
+
+  // if we reach this point, it means every point in the sphere is free
+  return true;
+
+}
+
+double Planner::getClearance(const ompl::base::State *state)
+{
+
+  const ompl::base::RealVectorStateSpace::StateType *pos = state->as<ompl::base::RealVectorStateSpace::StateType>();
+  const Eigen::Vector3d r(pos->values[0],pos->values[1],pos->values[2]);
+
+  thread_local std::vector<EsdfQuery> esdfs;
+  overlappingEsdfs(r, max_clearance, esdfs);
+
+  double clearance = max_clearance;
+  for (const auto &q : esdfs)
+  {
+    const Eigen::Vector3f r_map = (q.T_fw->topLeftCorner<3,3>() * r + q.T_fw->topRightCorner<3,1>()).cast<float>();
+    clearance = std::min(clearance, static_cast<double>(q.esdf->occupiedDistance(r_map)));
+  }
+
+  return std::max(clearance, 0.0);
+
+}
+
+bool Planner::overlappingEsdfs(const Eigen::Vector3d &r, const double radius, std::vector<EsdfQuery> &esdfs) const
+{
 
-        // CHECK OCCUPANCY AMONG LOCAL SUBMAPS:
+  esdfs.clear();
+  bool complete = true;
 
-        // add offset to r 
-        Eigen::Vector4d r_new = r;
-        r_new(0) += x;
-        r_new(1) += y;
-        r_new(2) += z;
+  // hash boxes overlapping the bounding box of the sphere
+  const double cell_size = mapSnapshot->hashCellSize;
+  const Eigen::Vector3i min_box = ((r.array() - radius) / cell_size).floor().cast<int>();
+  const Eigen::Vector3i max_box = ((r.array() + radius) / cell_size).floor().cast<int>();
 
-        // its respective truncated coordinates (the 1x1x1 box it's in)
-        Eigen::Vector3i box_coord;
-        for (int i = 0 ; i < 3 ; i++)
+  for (int x = min_box(0); x <= max_box(0); x++)
+  {
+    for (int y = min_box(1); y <= max_box(1); y++)
+    {
+      for (int z = min_box(2); z <= max_box(2); z++)
+      {
+        const SpatialHash::Cell* cell = mapSnapshot->hashTable.find(Eigen::Vector3i(x, y, z));
+        if (!cell)
         {
-          box_coord(i) = (int)(floor(r_new(i)));
+          complete = false;
+          continue;
         }
 
-        // need this to avg occupancy
-        double tot_occupancy = 0; 
-        double tot_weight = 0;
-        
-        // iterate over submap ids (only the ones that contain current state!)
-        // if not in any submap -> return false
-        if (!se_interface->hashTable_read.count(box_coord)) return false;
-        for (auto& id: se_interface->hashTable_read[box_coord]) {
-
-          // transform state coords to check from world to map frame
-          const Eigen::Matrix4d T_wf = se_interface->submapPoseLookup_read[id].T(); // kf wrt world
-          const Eigen::Vector4d r_map_hom = T_wf.inverse() * r_new;// state coordinates (homogenous) in map frame
-          const Eigen::Vector3f r_map = r_map_hom.head<3>().cast<float>(); // take first 3 elems and cast to float
-          
-          // if voxel belongs to current submap -> add occupancy
-          if(!se_interface->submapLookup_read.count(id)) continue;
-          if((*se_interface->submapLookup_read[id])->contains(r_map))
+        mapSnapshot->hashTable.forEachId(*cell, [&](const int id) {
+          const auto esdf = mapSnapshot->submapEsdfLookup.find(id);
+          const auto T_fw = mapSnapshot->submapInversePoseLookup.find(id);
+          if (esdf == mapSnapshot->submapEsdfLookup.end() || T_fw == mapSnapshot->submapInversePoseLookup.end())
           {
-            auto data = (*se_interface->submapLookup_read[id])->getData(r_map);
-            tot_occupancy += data.occupancy * data.weight;
-            tot_weight += data.weight;
+            complete = false;
+            return;
           }
-        } 
-        
-        // when done iterating over submaps, check total occupancy (weighted average)
-        if(tot_weight == 0) return false;
-        if(tot_occupancy/tot_weight >= 0 ) return false; 
-        //if(tot_occupancy > -20 || tot_weight == 0) return false; 
-        
-      } // x
-    } // y
-  } // z
+          for (const auto &q : esdfs) if (q.esdf == esdf->second.get()) return; // already there
+          esdfs.push_back({esdf->second.get(), &T_fw->second});
+        });
+      }
+    }
+  }
 
-  // if we reach this point, it means every point in the sphere is free
-  return true;
+  return complete;
+
+}
+
+bool Planner::checkEsdf(const Eigen::Vector3d &r, bool &free) const
+{
+
+  if (mapSnapshot->submapEsdfLookup.empty() || max_clearance < mav_radius) return false;
+
+  thread_local std::vector<EsdfQuery> esdfs;
+  if (!overlappingEsdfs(r, mav_radius, esdfs)) return false;
+
+  bool observed = false;
+  for (const auto &q : esdfs)
+  {
+    const Eigen::Vector3f r_map = (q.T_fw->topLeftCorner<3,3>() * r + q.T_fw->topRightCorner<3,1>()).cast<float>();
+    // conservative: an obstacle of any submap in the sphere is a collision
+    if (q.esdf->occupiedDistance(r_map) < mav_radius)
+    {
+      free = false;
+      return true;
+    }
+    // the whole sphere is observed (free) in this submap
+    if (q.esdf->observedClearance(r_map) >= mav_radius) observed = true;
+  }
+
+  // no obstacles, but no single submap observed the whole sphere
+  free = true;
+  return observed;
 
 }
 
 bool Planner::terminatePlanner(){
 
-  // if there's a new planning thread or too much time has elapsed
-  if (preempt_plan)
+  // if there's a new planning thread or too much time has elapsed.
+  // shutdown too: plan() lowers preempt_plan once it has the mutex, and may do so after the
+  // destructor raised it
+  if (preempt_plan || shutdown || goalVersion != activeGoalVersion)
   {
     std::cout << "\n\nNew query: planning preempted! \n\n";
     return true;
   }
 
-  if (std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - start_time).count() > 10.0)
+  if (std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - start_time).count() > planning_time)
   {
     std::cout << "\n\nTaking too long: aborting planning! \n\n";
     return true;
@@ -331,4 +746,227 @@ bool Planner::terminatePlanner(){
 
   return false;
 
-}
\ No newline at end of file
+}
+
+SubmapMotionValidator::SubmapMotionValidator(const ob::SpaceInformationPtr &si, Planner* planner)
+    : ob::MotionValidator(si), planner_(planner), epoch_(0)
+{
+  clear();
+}
+
+void SubmapMotionValidator::clear()
+{
+  // the voxels around the one of a sample. The stencil is centred on its centre, which can be
+  // half a voxel diagonal away from the sample: grow the radius by as much, so that every voxel
+  // detectCollision would check for the sample is in
+  const double res = planner_->map_res;
+  const double radius = res * std::floor(planner_->mav_radius / res) + 0.5 * std::sqrt(3.0) * res;
+  const int n = static_cast<int>(std::ceil(radius / res));
+  std::vector<Eigen::Vector3i> offsets;
+  for (int z = -n; z <= n; z++)
+  {
+    for (int y = -n; y <= n; y++)
+    {
+      for (int x = -n; x <= n; x++)
+      {
+        if (Eigen::Vector3d(x, y, z).norm() * res <= radius) offsets.emplace_back(x, y, z);
+      }
+    }
+  }
+  stencil_.resize(3, offsets.size());
+  for (size_t i = 0; i < offsets.size(); i++) stencil_.col(i) = offsets[i];
+
+  // threads drop their memo at their next check. drawn from a process wide counter: a
+  // validator created where a deleted one was must not take over its memos
+  static std::atomic<uint64_t> epochs(0);
+  epoch_ = ++epochs;
+}
+
+SubmapMotionValidator::ThreadState &SubmapMotionValidator::threadState() const
+{
+  thread_local ThreadState state;
+  const uint64_t epoch = epoch_.load();
+  if (state.owner != this || state.epoch != epoch)
+  {
+    state.owner = this;
+    state.epoch = epoch;
+    state.lastMinBox.setZero();
+    state.lastMaxBox.setConstant(-1); // empty range, never asked
+    state.lastBoxesFree = false;
+    state.memoKeys.assign(size_t(1) << kMemoBits, kNoVoxel);
+    state.memoFree.assign(size_t(1) << kMemoBits, 0);
+  }
+  state.profile = PlannerProfile();
+  return state;
+}
+
+bool SubmapMotionValidator::checkMotion(const ob::State *s1, const ob::State *s2) const
+{
+  const auto motion_start = std::chrono::steady_clock::now();
+  ThreadState &state = threadState();
+
+  // the end state first: cheapest way out, and it gets the full check
+  bool valid = si_->isValid(s2);
+  if (valid)
+  {
+    int steps;
+    valid = checkSamples(state, s1, s2, steps) == steps;
+  }
+
+  if (valid) valid_++;
+  else invalid_++;
+
+  if (planner_->profiling)
+  {
+    state.profile.motions++;
+    state.profile.motionTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - motion_start).count();
+    planner_->addProfile(state.profile);
+  }
+  return valid;
+}
+
+bool SubmapMotionValidator::checkMotion(const ob::State *s1, const ob::State *s2, std::pair<ob::State *, double> &lastValid) const
+{
+  const auto motion_start = std::chrono::steady_clock::now();
+  ThreadState &state = threadState();
+
+  // in order: the last valid state is the sample before the first collision
+  int steps;
+  const int first = checkSamples(state, s1, s2, steps); // steps: the end state is next
+  const bool valid = first == steps && si_->isValid(s2);
+  if (!valid)
+  {
+    lastValid.second = double(first - 1) / steps;
+    if (lastValid.first) si_->getStateSpace()->interpolate(s1, s2, lastValid.second, lastValid.first);
+    invalid_++;
+  }
+  else valid_++;
+
+  if (planner_->profiling)
+  {
+    state.profile.motions++;
+    state.profile.motionTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - motion_start).count();
+    planner_->addProfile(state.profile);
+  }
+  return valid;
+}
+
+int SubmapMotionValidator::checkSamples(ThreadState &state, const ob::State *s1, const ob::State *s2, int &steps) const
+{
+  const double *v1 = s1->as<ob::RealVectorStateSpace::StateType>()->values;
+  const double *v2 = s2->as<ob::RealVectorStateSpace::StateType>()->values;
+  const Eigen::Vector3d r1(v1[0], v1[1], v1[2]);
+  const Eigen::Vector3d r2(v2[0], v2[1], v2[2]);
+
+  // one voxel apart: no voxel of the swept sphere is skipped
+  steps = std::max(1, static_cast<int>(std::ceil((r2 - r1).norm() / planner_->map_res)));
+  for (int i = 1; i < steps; i++)
+  {
+    if (!checkSample(state, r1 + (r2 - r1) * (double(i) / steps))) return i;
+  }
+  return steps;
+}
+
+bool SubmapMotionValidator::checkSample(ThreadState &state, const Eigen::Vector3d &r) const
+{
+  // same hack as detectCollision
+  if ((r - planner_->start_fixed).norm() < 0.5) return true;
+
+  // coarse: all the boxes the sphere touches are free
+  const double cell_size = planner_->mapSnapshot->hashCellSize;
+  const Eigen::Vector3i min_box = ((r.array() - planner_->mav_radius) / cell_size).floor().cast<int>();
+  const Eigen::Vector3i max_box = ((r.array() + planner_->mav_radius) / cell_size).floor().cast<int>();
+  if (boxesFree(state, min_box, max_box))
+  {
+    state.profile.boxSamples++;
+    return true;
+  }
+
+  // near a surface (or the map border). distance layers, if they can tell
+  bool free;
+  if (planner_->checkEsdf(r, free)) return free;
+
+  // fine: the (grown) stencil, around the voxel of the sample. neighbouring samples share most voxels
+  state.profile.voxelSamples++;
+  const Eigen::Vector3i centre = (r / planner_->map_res).array().floor().cast<int>();
+  if (!voxelFree(state, centre)) return false;
+  for (Eigen::Index i = 0; i < stencil_.cols(); i++)
+  {
+    if (!voxelFree(state, centre + stencil_.col(i))) return false;
+  }
+  return true;
+}
+
+bool SubmapMotionValidator::boxesFree(ThreadState &state, const Eigen::Vector3i &minBox, const Eigen::Vector3i &maxBox) const
+{
+  // consecutive samples mostly span the same boxes
+  if (minBox == state.lastMinBox && maxBox == state.lastMaxBox) return state.lastBoxesFree;
+  state.lastMinBox = minBox;
+  state.lastMaxBox = maxBox;
+  state.lastBoxesFree = false;
+
+  const SpatialHash &hash_table = planner_->mapSnapshot->hashTable;
+  for (int x = minBox(0); x <= maxBox(0); x++)
+  {
+    for (int y = minBox(1); y <= maxBox(1); y++)
+    {
+      for (int z = minBox(2); z <= maxBox(2); z++)
+      {
+        const SpatialHash::Cell* cell = hash_table.find(Eigen::Vector3i(x, y, z));
+        if (!cell || !planner_->mapSnapshot->cellFree(*cell)) return false;
+      }
+    }
+  }
+
+  state.lastBoxesFree = true;
+  return true;
+}
+
+bool SubmapMotionValidator::voxelFree(ThreadState &state, const Eigen::Vector3i &voxel) const
+{
+  const SpatialHash::Key key = SpatialHash::pack(voxel);
+  const size_t slot = (key * 0x9E3779B97F4A7C15ull) >> (64 - kMemoBits);
+  state.profile.probes++;
+  if (state.memoKeys[slot] == key)
+  {
+    state.profile.memoHits++;
+    return state.memoFree[slot];
+  }
+
+  // voxel centre, as detectCollision checks a state
+  const MapSnapshot &snapshot = *planner_->mapSnapshot;
+  const Eigen::Vector3d p = (voxel.cast<double>().array() + 0.5) * planner_->map_res;
+  bool free = false;
+  const SpatialHash::Cell* cell = snapshot.hashTable.find(Eigen::Vector3i((p / snapshot.hashCellSize).array().floor().cast<int>()));
+  if (cell && snapshot.cellFree(*cell))
+  {
+    free = true;
+  }
+  else if (cell)
+  {
+    double occupancy = 0;
+    double weight = 0;
+    snapshot.hashTable.forEachId(*cell, [&](const int id) {
+      const auto T_fw = snapshot.submapInversePoseLookup.find(id);
+      if (T_fw == snapshot.submapInversePoseLookup.end()) return;
+      const auto resident = snapshot.submapLookup.find(id);
+      SubmapPtr map;
+      if (resident != snapshot.submapLookup.end()) map = resident->second;
+      else if (snapshot.submapStore) map = snapshot.submapStore->load(id);
+      if (!map) return;
+
+      const Eigen::Vector3f r_map = (T_fw->second.topLeftCorner<3,3>() * p + T_fw->second.topRightCorner<3,1>()).cast<float>();
+      if (map->contains(r_map))
+      {
+        const auto data = map->getData(r_map);
+        occupancy += data.occupancy * data.weight;
+        weight += data.weight;
+      }
+    });
+    free = weight > 0 && occupancy / weight < 0;
+  }
+
+  state.memoKeys[slot] = key;
+  state.memoFree[slot] = free;
+  return free;
+}
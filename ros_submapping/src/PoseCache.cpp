@@ -0,0 +1,139 @@
+#include <PoseCache.hpp>
+#include <algorithm>
+
+PoseCache::PoseCache(const size_t capacity)
+    : entries_(std::max<size_t>(2, capacity)), head_(0), count_(0), keyframeId_(0),
+      loopClosures_(0), blocking_(false), shutdown_(false) {}
+
+void PoseCache::setBlocking(const bool blocking)
+{
+  std::lock_guard<std::mutex> lk(mutex_);
+  blocking_ = blocking;
+}
+
+bool PoseCache::add(const okvis::State &state, const bool isKeyframe, const bool loopClosure, const uint64_t poseVersion)
+{
+  std::unique_lock<std::mutex> lk(mutex_);
+
+  const okvis::Time &timestamp = state.timestamp;
+  if (count_ && timestamp < at(count_ - 1).timestamp) return false;
+
+  // the first state is the first keyframe, whatever okvis says
+  if (isKeyframe || !keyframeId_) keyframeId_ = state.id.value();
+  if (loopClosure) loopClosures_++;
+
+  // a loop closure moves the world frame under the older states: a stamp interpolated between
+  // them and this one would be off by the whole correction. only the new state is kept, the
+  // depth frames before it get no pose
+  if (loopClosure) count_ = 0;
+
+  bool dropped = false;
+  Entry *entry;
+  if (count_ && timestamp == at(count_ - 1).timestamp) {
+    entry = &entries_[(head_ + count_ - 1) % entries_.size()];
+  } else {
+    if (count_ == entries_.size()) {
+      // the oldest state can go once no pending lookup falls between it and the next one
+      if (blocking_)
+        cvReleased_.wait(lk, [&] { return shutdown_ || at(1).timestamp <= released_; });
+      if (shutdown_) return false;
+      dropped = at(1).timestamp > released_;
+      head_ = (head_ + 1) % entries_.size();
+      count_--;
+    }
+    entry = &entries_[(head_ + count_) % entries_.size()];
+    count_++;
+  }
+
+  entry->timestamp = timestamp;
+  entry->T_WS = state.T_WS;
+  entry->v_W = state.v_W;
+  entry->keyframeId = keyframeId_;
+  entry->loopClosures = loopClosures_;
+  entry->poseVersion = poseVersion;
+  return dropped;
+}
+
+size_t PoseCache::lookup(PoseQueryVec &queries) const
+{
+  std::lock_guard<std::mutex> lk(mutex_);
+
+  size_t found = 0;
+  for (auto &query : queries) {
+    // first state after the stamp
+    size_t lo = 0, hi = count_;
+    while (lo < hi) {
+      const size_t mid = (lo + hi) / 2;
+      if (at(mid).timestamp <= query.timestamp) lo = mid + 1;
+      else hi = mid;
+    }
+
+    query.found = lo > 0 && (lo < count_ || at(lo - 1).timestamp == query.timestamp);
+    if (!query.found) continue;
+    found++;
+
+    const Entry &a = at(lo - 1);
+    query.keyframeId = a.keyframeId;
+    query.loopClosures = a.loopClosures;
+    query.poseVersion = a.poseVersion;
+    if (a.timestamp == query.timestamp) {
+      query.T_WS = a.T_WS;
+      query.v_W = a.v_W;
+      continue;
+    }
+
+    // never across a loop closure (the states are in different world frames): the later one
+    const Entry &b = at(lo);
+    if (b.loopClosures != a.loopClosures) {
+      query.T_WS = b.T_WS;
+      query.v_W = b.v_W;
+      query.keyframeId = b.keyframeId;
+      query.loopClosures = b.loopClosures;
+      query.poseVersion = b.poseVersion;
+      continue;
+    }
+
+    // cubic hermite on the position, the velocities as tangents
+    const double dt = (b.timestamp - a.timestamp).toSec();
+    const double s = (query.timestamp - a.timestamp).toSec() / dt;
+    const double s2 = s * s, s3 = s2 * s;
+    const Eigen::Vector3d r = (2 * s3 - 3 * s2 + 1) * a.T_WS.r() + (s3 - 2 * s2 + s) * dt * a.v_W
+                            + (3 * s2 - 2 * s3) * b.T_WS.r() + (s3 - s2) * dt * b.v_W;
+    query.T_WS = okvis::kinematics::Transformation(r, a.T_WS.q().slerp(s, b.T_WS.q()));
+    query.v_W = (1 - s) * a.v_W + s * b.v_W;
+  }
+  return found;
+}
+
+void PoseCache::release(const okvis::Time &timestamp)
+{
+  {
+    std::lock_guard<std::mutex> lk(mutex_);
+    if (timestamp <= released_) return;
+    released_ = timestamp;
+  }
+  cvReleased_.notify_all();
+}
+
+bool PoseCache::newest(okvis::Time &timestamp) const
+{
+  std::lock_guard<std::mutex> lk(mutex_);
+  if (!count_) return false;
+  timestamp = at(count_ - 1).timestamp;
+  return true;
+}
+
+size_t PoseCache::size() const
+{
+  std::lock_guard<std::mutex> lk(mutex_);
+  return count_;
+}
+
+void PoseCache::shutdown()
+{
+  {
+    std::lock_guard<std::mutex> lk(mutex_);
+    shutdown_ = true;
+  }
+  cvReleased_.notify_all();
+}
@@ -52,6 +52,15 @@
 Eigen::Vector3d target_pos(0,0,0);
 Eigen::Vector3d target_vel(0,0,0);
 
+namespace {
+
+// tf frame of a submap, its geometry is expressed in it
+std::string submapFrame(const uint64_t id) {
+  return "submap_" + std::to_string(id);
+}
+
+} // namespace
+
 /// \brief okvis Main namespace of this package.
 // namespace okvis {
 
@@ -118,6 +127,7 @@ void Publisher::setNodeHandle(ros::NodeHandle& nh)
   pubSubmaps_ = nh_->advertise<visualization_msgs::MarkerArray>( "se_submaps", 0 );
   pubOMPLPath_ = nh_->advertise<nav_msgs::Path>( "ompl_path", 0 );
   map_occupied_pub_ = nh_->advertise<visualization_msgs::MarkerArray>("se_map_occupied", 1);
+  pubDiagnostics_ = nh_->advertise<diagnostic_msgs::DiagnosticArray>("/diagnostics", 1);
 
 }
 
@@ -704,140 +714,71 @@ void Publisher::publishKeyframesAsCallback(const State &latestState, const Track
   
 }
 
-void Publisher::setMeshesPath(std::string meshesDir){
- meshesDir_ = meshesDir;
-}
-
-void Publisher::publishSubmapMeshesAsCallback(std::unordered_map<uint64_t, Transformation> submapPoseLookup) 
+void Publisher::publishSubmapMeshesAsCallback(const uint64_t id, const std::shared_ptr<const SubmapMesh> &mesh,
+                                              const std::unordered_map<uint64_t, Transformation> &submapPoseLookup) 
 {
-  
-  visualization_msgs::MarkerArray submaparraymsg_; // put all submaps here
-
-  // get array of all ply files:
-  
-  std::string extension = ".ply";
-  boost::filesystem::path root(meshesDir_);
-  std::vector<boost::filesystem::path> paths_ply; // paths of all ply files in directory
-  
-
-  if (boost::filesystem::exists(root) && boost::filesystem::is_directory(root))
-  {
-      for (auto const & entry : boost::filesystem::recursive_directory_iterator(root))
-      {
-          if (boost::filesystem::is_regular_file(entry) && entry.path().extension() == extension)
-              paths_ply.emplace_back(entry.path());
-      }
-  }
-
-  // iterate over plys and convert them to stl. then delete
-
-  for (int i = 0; i < paths_ply.size(); i++)
-  {  
-      pcl::PolygonMesh mesh; 
-      std::filesystem::path output_file(paths_ply[i].string()); // we save the stl mesh here
-      output_file.replace_extension(".stl");
 
-      // load mesh
-      // std::cout << "(publisher) loading" << paths[i].string() << " as mesh \n \n \n";
-      if (!pcl::io::loadPolygonFile(paths_ply[i].string(), mesh)) std::cout << "(publisher) error loading ply mesh! \n";
-      // save mesh as .stl
-      // std::cout << "(publisher) saving mesh as " << output_file.string() << " \n \n \n"; // exporting in binary format
-      if (!pcl::io::savePolygonFile(output_file.string(), mesh, true)) std::cout << "(publisher) error saving stl file! \n";
-      
-      // delete current ply
-      boost::filesystem::remove(paths_ply[i]);
-  }
+  // loop closures only move the submap frames
+  updateSubmapFrames(submapPoseLookup);
 
-  // get array of all stl files:
-
-  extension = ".stl";
-  std::vector<boost::filesystem::path> paths_stl; // paths of all stl files in directory
-  
+  if (!mesh) return;
 
-  if (boost::filesystem::exists(root) && boost::filesystem::is_directory(root))
+  // new submap: its marker is sent once, in its own frame
+  visualization_msgs::Marker submapmsg_;
+  // header
+  submapmsg_.header.frame_id = submapFrame(id);
+  submapmsg_.header.stamp = ros::Time(); // frame locked: latest transform
+  submapmsg_.ns = "submap_ns";
+  submapmsg_.id = id; // id of the keyframe
+  submapmsg_.type = visualization_msgs::Marker::TRIANGLE_LIST;
+  submapmsg_.action = visualization_msgs::Marker::ADD;
+  submapmsg_.lifetime = ros::Duration(0.0); // lasts forever
+  submapmsg_.frame_locked = true;
+  submapmsg_.pose.orientation.w = 1.0;
+  // vertices, in the submap frame
+  submapmsg_.points.resize(mesh->size());
+  for (size_t i = 0; i < mesh->size(); i++)
   {
-      for (auto const & entry : boost::filesystem::recursive_directory_iterator(root))
-      {
-          if (boost::filesystem::is_regular_file(entry) && entry.path().extension() == extension)
-              paths_stl.emplace_back(entry.path());
-      }
+      submapmsg_.points[i].x = (*mesh)[i].x();
+      submapmsg_.points[i].y = (*mesh)[i].y();
+      submapmsg_.points[i].z = (*mesh)[i].z();
   }
+  // scale
+  submapmsg_.scale.x = 1.0;
+  submapmsg_.scale.y = 1.0;
+  submapmsg_.scale.z = 1.0;
+  // color (randomly from color table)
+  const unsigned int idx = id % submap_colors.size(); 
+  submapmsg_.color.a = submap_colors[idx](0);
+  submapmsg_.color.r = submap_colors[idx](1);
+  submapmsg_.color.g = submap_colors[idx](2);
+  submapmsg_.color.b = submap_colors[idx](3);
 
-  // iterate over stls and load  single submap msg:
-
-  for (int i = 0; i < paths_stl.size(); i++)
-  {  
-      visualization_msgs::Marker submapmsg_;
-      // load marker msg:
-      // header
-      submapmsg_.header.frame_id = "odom";
-      submapmsg_.header.stamp = ros::Time::now();
-      submapmsg_.ns = "submap_ns";
-      submapmsg_.id = stoi(paths_stl[i].stem().string()); // id of the keyframe (filename wo extension)
-      submapmsg_.type = visualization_msgs::Marker::MESH_RESOURCE;
-      submapmsg_.mesh_resource = "file://" + paths_stl[i].string(); // resource_retriever url syntax
-      submapmsg_.action = visualization_msgs::Marker::ADD;
-      submapmsg_.lifetime = ros::Duration(0.0); // lasts forever (gets updated though)
-      submapmsg_.frame_locked = true;
-      // orientation
-      Eigen::Quaterniond q = submapPoseLookup[std::stoull(paths_stl[i].stem().string())].q(); // stoull to convert string -> uint64_t
-      submapmsg_.pose.orientation.x = q.x();
-      submapmsg_.pose.orientation.y = q.y();
-      submapmsg_.pose.orientation.z = q.z();
-      submapmsg_.pose.orientation.w = q.w();
-      // position
-      Eigen::Vector3d r = submapPoseLookup[std::stoull(paths_stl[i].stem().string())].r();
-      submapmsg_.pose.position.x = r[0];
-      submapmsg_.pose.position.y = r[1];
-      submapmsg_.pose.position.z = r[2];
-      // scale
-      submapmsg_.scale.x = 1.0;
-      submapmsg_.scale.y = 1.0;
-      submapmsg_.scale.z = 1.0;
-      // color (randomly from color table)
-      const unsigned int idx = stoi(paths_stl[i].stem().string()) % submap_colors.size(); 
-      submapmsg_.color.a = submap_colors[idx](0);
-      submapmsg_.color.r = submap_colors[idx](1);
-      submapmsg_.color.g = submap_colors[idx](2);
-      submapmsg_.color.b = submap_colors[idx](3);
-
-      // push current submap to the array of submaps
-      submaparraymsg_.markers.push_back(submapmsg_);
-
-  } // end loop over stls
-
-  // publish all submaps
+  visualization_msgs::MarkerArray submaparraymsg_;
+  submaparraymsg_.markers.push_back(std::move(submapmsg_));
   pubSubmaps_.publish(submaparraymsg_);
 
 }
 
 
-void Publisher::publishSubmapsAsCallback(std::unordered_map<uint64_t, Transformation> submapPoseLookup, std::unordered_map<uint64_t, SubmapList::iterator> submapLookup) 
+std::vector<visualization_msgs::Marker> Publisher::buildVoxelMarkers(const uint64_t id, const se::OccupancyMap<se::Res::Multi> &map)
 {
 
   typedef se::Octree<se::Data<se::Field::Occupancy, se::Colour::Off, se::Semantics::Off>, se::Res::Multi, 8> OctreeT;
 
   std_msgs::Header header;
-  header.stamp = ros::Time::now();
-  header.frame_id = "odom";
+  header.frame_id = submapFrame(id);
+  header.stamp = ros::Time(); // frame locked: latest transform
 
-  visualization_msgs::MarkerArray markerarraymsg_;
-
-  if(submapLookup.empty()) return;
-
-  // iterate over submaps
-  for (auto& it: submapLookup) {
-  
   // one cube list per size
   std::map<int, visualization_msgs::Marker> markers_occupied;
 
-  const auto id = it.first;
   const unsigned int idx = id % submap_colors.size(); 
 
-  const Eigen::Matrix4d T_wm = (*it.second)->getTWM().cast<double>(); // map wrt "odom", which is the kf
-  const Eigen::Matrix4d T_wf = submapPoseLookup[it.first].T(); // kf wrt world
+  // points are expressed in the kf (submap) frame
+  const Eigen::Matrix4d T_wm = map.getTWM().cast<double>(); // map wrt "odom", which is the kf
 
-  auto octree_ptr = (*it.second)->getOctree();
+  auto octree_ptr = map.getOctree();
 
   // for each leaf (node / voxel block)
   for (auto octant_it = se::LeavesIterator<OctreeT>(octree_ptr.get()); octant_it != se::LeavesIterator<OctreeT>(); ++octant_it) {
@@ -863,7 +804,7 @@ void Publisher::publishSubmapsAsCallback(std::unordered_map<uint64_t, Transforma
                 for (int z = 0; z < BlockType::getSize(); z += node_size) {
 
                   const Eigen::Vector3i node_coord = block_coord + Eigen::Vector3i(x, y, z);
-                  const Eigen::Vector3f node_centre_meter = (node_coord.template cast<float>() + Eigen::Vector3f::Constant((float) node_size / 2)) * (*it.second)->getRes();
+                  const Eigen::Vector3f node_centre_meter = (node_coord.template cast<float>() + Eigen::Vector3f::Constant((float) node_size / 2)) * map.getRes();
                   const auto data = block_ptr->getData(node_coord);
 
                   if (data.occupancy * data.weight <= 0) { // FREE / UNOBSERVED VOXELS (this hides unobserved vox, but the planner still treats them as occupied)
@@ -871,7 +812,7 @@ void Publisher::publishSubmapsAsCallback(std::unordered_map<uint64_t, Transforma
                   }
 
                   const int size = node_size;
-                  float resolution = (*it.second)->getRes();
+                  float resolution = map.getRes();
                   if (markers_occupied.count(size) == 0) {
                     std::string ns;
                     std_msgs::ColorRGBA volume_color;
@@ -900,7 +841,7 @@ void Publisher::publishSubmapsAsCallback(std::unordered_map<uint64_t, Transforma
                   }
                   // Append the current voxel.
                   const Eigen::Vector4d p_mp(node_centre_meter[0],node_centre_meter[1],node_centre_meter[2],1); // p wrt map (homogenous)
-                  const Eigen::Vector4d p_eigen = T_wf*T_wm*p_mp; // p wrt world (homogenous)
+                  const Eigen::Vector4d p_eigen = T_wm*p_mp; // p wrt kf (homogenous)
                   
                   geometry_msgs::Point p;
                   p.x = p_eigen[0];
@@ -925,7 +866,7 @@ void Publisher::publishSubmapsAsCallback(std::unordered_map<uint64_t, Transforma
 
         const int node_size = static_cast<typename OctreeT::NodeType*>(octant_ptr)->getSize();
         const int size = node_size;
-        float resolution = (*it.second)->getRes();
+        float resolution = map.getRes();
         if (markers_occupied.count(size) == 0) {
           std::string ns;
           std_msgs::ColorRGBA volume_color;
@@ -956,10 +897,10 @@ void Publisher::publishSubmapsAsCallback(std::unordered_map<uint64_t, Transforma
         // Append the current voxel.
 
         const Eigen::Vector3i node_coord = octant_ptr->getCoord();
-        const Eigen::Vector3f node_centre_meter = (node_coord.template cast<float>() + Eigen::Vector3f::Constant((float) node_size / 2)) * (*it.second)->getRes();
+        const Eigen::Vector3f node_centre_meter = (node_coord.template cast<float>() + Eigen::Vector3f::Constant((float) node_size / 2)) * map.getRes();
 
         const Eigen::Vector4d p_mp(node_centre_meter[0],node_centre_meter[1],node_centre_meter[2],1); // p wrt map (homogenous)
-        const Eigen::Vector4d p_eigen = T_wf*T_wm*p_mp; // p wrt world (homogenous)
+        const Eigen::Vector4d p_eigen = T_wm*p_mp; // p wrt kf (homogenous)
 
         geometry_msgs::Point p;
         p.x = p_eigen[0];
@@ -971,18 +912,211 @@ void Publisher::publishSubmapsAsCallback(std::unordered_map<uint64_t, Transforma
 
   } // for each node /voxel block
 
-  // finished iterating over this submap
-  // push markers to markerarray msg (one marker per size)
+  // finished iterating over this submap (one marker per size)
+  std::vector<visualization_msgs::Marker> markers;
   for (const auto& marker : markers_occupied) {
-        markerarraymsg_.markers.push_back(marker.second);
+        markers.push_back(marker.second);
+      }
+  return markers;
+}
+
+void Publisher::publishSubmapsAsCallback(const uint64_t id, const std::unordered_map<uint64_t, Transformation> &submapPoseLookup,
+                                         const std::unordered_map<uint64_t, SubmapPtr> &submapLookup) 
+{
+
+  // loop closures only move the submap frames
+  updateSubmapFrames(submapPoseLookup);
+  if (!id) return; // pose update only
+
+  std::lock_guard<std::mutex> lk(voxelSubmapsMutex_);
+
+  // geometry only for the submap that just changed and the ones never sent
+  visualization_msgs::MarkerArray markerarraymsg_;
+  for (const auto &submap : submapLookup) {
+    const auto sent = voxelSubmaps_.find(submap.first);
+    if (submap.first != id && sent != voxelSubmaps_.end()) continue;
+
+    std::vector<std::pair<std::string, int>> keys;
+    for (auto &marker : buildVoxelMarkers(submap.first, *submap.second)) {
+      keys.emplace_back(marker.ns, marker.id);
+      markerarraymsg_.markers.push_back(std::move(marker));
+    }
+
+    // sizes the submap no longer has: their old cube lists would stay in rviz
+    if (sent != voxelSubmaps_.end()) {
+      for (const auto &key : sent->second) {
+        if (std::find(keys.begin(), keys.end(), key) != keys.end()) continue;
+        visualization_msgs::Marker deletion;
+        deletion.header.frame_id = submapFrame(submap.first);
+        deletion.ns = key.first;
+        deletion.id = key.second;
+        deletion.action = visualization_msgs::Marker::DELETE;
+        markerarraymsg_.markers.push_back(std::move(deletion));
       }
+    }
+    voxelSubmaps_[submap.first] = std::move(keys);
+  }
+
+  // publish the changed markers
+  if (!markerarraymsg_.markers.empty()) map_occupied_pub_.publish(markerarraymsg_);
+}
+
+void Publisher::updateSubmapFrames(const std::unordered_map<uint64_t, Transformation> &submapPoseLookup)
+{
+  std::lock_guard<std::mutex> lk(submapFramesMutex_);
+
+  // broadcast only the frames that moved (or are new)
+  std::vector<geometry_msgs::TransformStamped> changed;
+  const ros::Time now = ros::Time::now();
+  for (const auto &pose : submapPoseLookup) {
+    auto frame = submapFrames_.find(pose.first);
+    if (frame != submapFrames_.end() && frame->second.T() == pose.second.T()) continue;
+    submapFrames_[pose.first] = pose.second;
+    changed.push_back(toTransformMsg(pose.first, pose.second, now));
+  }
+
+  // latched: the broadcaster merges them into the frames it holds and re-publishes the set once
+  if (!changed.empty()) pubStaticTf_.sendTransform(changed);
+}
+
+geometry_msgs::TransformStamped Publisher::toTransformMsg(const uint64_t id, const Transformation &T_WK, const ros::Time &stamp)
+{
+  geometry_msgs::TransformStamped msg;
+  msg.header.frame_id = "odom";
+  msg.header.stamp = stamp;
+  msg.child_frame_id = submapFrame(id);
+
+  // fill orientation
+  const Eigen::Quaterniond q = T_WK.q();
+  msg.transform.rotation.x = q.x();
+  msg.transform.rotation.y = q.y();
+  msg.transform.rotation.z = q.z();
+  msg.transform.rotation.w = q.w();
+
+  // fill position
+  const Eigen::Vector3d r = T_WK.r();
+  msg.transform.translation.x = r[0];
+  msg.transform.translation.y = r[1];
+  msg.transform.translation.z = r[2];
+  return msg;
+}
+
 
-  } // for each submap
+void Publisher::publishPipelineStats(const PipelineStats & stats)
+{
+  diagnostic_msgs::DiagnosticArray diagnosticsmsg_;
+  diagnosticsmsg_.header.stamp = ros::Time::now();
+
+  auto addValue = [](diagnostic_msgs::DiagnosticStatus &status, const std::string &key, const double value) {
+    diagnostic_msgs::KeyValue keyValue;
+    keyValue.key = key;
+    keyValue.value = std::to_string(value);
+    status.values.push_back(keyValue);
+  };
+
+  // one status per stage, durations in ms
+  for (int s = 0; s < static_cast<int>(PipelineStats::Stage::Count); s++) {
+    const PipelineStats::Stage stage = PipelineStats::Stage(s);
+    const Histogram::Summary summary = stats.duration(stage).summary();
+    diagnostic_msgs::DiagnosticStatus status;
+    status.level = diagnostic_msgs::DiagnosticStatus::OK;
+    status.name = std::string("submapping: stage ") + PipelineStats::name(stage);
+    status.hardware_id = "submapping";
+    status.message = std::to_string(summary.count) + " samples";
+    addValue(status, "mean [ms]", summary.mean * 1e-3);
+    addValue(status, "p50 [ms]", summary.p50 * 1e-3);
+    addValue(status, "p90 [ms]", summary.p90 * 1e-3);
+    addValue(status, "p99 [ms]", summary.p99 * 1e-3);
+    addValue(status, "max [ms]", summary.max * 1e-3);
+    diagnosticsmsg_.status.push_back(status);
+  }
+
+  // one status per queue, warn once it dropped something
+  for (int q = 0; q < static_cast<int>(PipelineStats::Queue::Count); q++) {
+    const PipelineStats::Queue queue = PipelineStats::Queue(q);
+    const Histogram::Summary summary = stats.queueDepth(queue).summary();
+    const uint64_t drops = stats.drops(queue);
+    diagnostic_msgs::DiagnosticStatus status;
+    status.level = drops ? diagnostic_msgs::DiagnosticStatus::WARN : diagnostic_msgs::DiagnosticStatus::OK;
+    status.name = std::string("submapping: queue ") + PipelineStats::name(queue);
+    status.hardware_id = "submapping";
+    status.message = drops ? std::to_string(drops) + " dropped" : "no drops";
+    addValue(status, "mean depth", summary.mean);
+    addValue(status, "p90 depth", summary.p90);
+    addValue(status, "max depth", summary.max);
+    addValue(status, "drops", drops);
+    if (queue == PipelineStats::Queue::Depth) addValue(status, "skipped by scheduler", stats.skipped());
+    diagnosticsmsg_.status.push_back(status);
+  }
 
-  // publish all markers
-  map_occupied_pub_.publish(markerarraymsg_);
+  pubDiagnostics_.publish(diagnosticsmsg_);
 }
 
+void Publisher::publishMemoryStats(const MemoryStats & stats)
+{
+  diagnostic_msgs::DiagnosticArray diagnosticsmsg_;
+  diagnosticsmsg_.header.stamp = ros::Time::now();
+
+  auto addValue = [](diagnostic_msgs::DiagnosticStatus &status, const std::string &key, const double value) {
+    diagnostic_msgs::KeyValue keyValue;
+    keyValue.key = key;
+    keyValue.value = std::to_string(value);
+    status.values.push_back(keyValue);
+  };
+  auto makeStatus = [](const std::string &name, const std::string &message) {
+    diagnostic_msgs::DiagnosticStatus status;
+    status.level = diagnostic_msgs::DiagnosticStatus::OK;
+    status.name = "submapping: memory " + name;
+    status.hardware_id = "submapping";
+    status.message = message;
+    return status;
+  };
+  const double MB = 1.0 / (1024 * 1024);
+
+  diagnostic_msgs::DiagnosticStatus total = makeStatus("total", std::to_string(stats.totalBytes() / (1024 * 1024)) + " MB");
+  addValue(total, "total [MB]", stats.totalBytes() * MB);
+  addValue(total, "submaps", stats.submaps.size());
+  addValue(total, "resident blocks", stats.resident.blocks);
+  addValue(total, "resident nodes", stats.resident.nodes);
+  addValue(total, "resident octrees [MB]", stats.resident.bytes * MB);
+  addValue(total, "evicted", stats.evicted);
+  addValue(total, "on disk [MB]", stats.bytesOnDisk * MB);
+  diagnosticsmsg_.status.push_back(total);
+
+  diagnostic_msgs::DiagnosticStatus hash = makeStatus("hash table", std::to_string(stats.hashCells) + " cells");
+  addValue(hash, "cells", stats.hashCells);
+  addValue(hash, "capacity", stats.hashCapacity);
+  addValue(hash, "load factor", stats.hashLoadFactor);
+  addValue(hash, "table [MB]", stats.hashBytes * MB);
+  addValue(hash, "inverse [MB]", stats.hashInverseBytes * MB);
+  diagnosticsmsg_.status.push_back(hash);
+
+  diagnostic_msgs::DiagnosticStatus snapshot = makeStatus("snapshot", "version " + std::to_string(stats.snapshotVersion));
+  addValue(snapshot, "copy [MB]", stats.snapshotBytes * MB);
+  addValue(snapshot, "distance layers [MB]", stats.esdfBytes * MB);
+  diagnosticsmsg_.status.push_back(snapshot);
+
+  diagnostic_msgs::DiagnosticStatus queues = makeStatus("queues", std::to_string(stats.depthQueueFrames + stats.supereightQueueFrames) + " frames queued");
+  addValue(queues, "depth frames", stats.depthQueueFrames);
+  addValue(queues, "supereight frames", stats.supereightQueueFrames);
+  addValue(queues, "queued [MB]", stats.queueBytes() * MB);
+  addValue(queues, "pooled frames", stats.depthPoolFrames);
+  addValue(queues, "pool misses", stats.depthPoolMisses);
+  addValue(queues, "pose cache [MB]", stats.poseCacheBytes * MB);
+  diagnosticsmsg_.status.push_back(queues);
+
+  for (const SubmapMemory &submap : stats.submaps) {
+    diagnostic_msgs::DiagnosticStatus status = makeStatus("submap " + std::to_string(submap.id),
+        submap.active ? "active" : submap.resident ? "resident" : "evicted");
+    addValue(status, "res [m]", submap.res);
+    addValue(status, "blocks", submap.octree.blocks);
+    addValue(status, "nodes", submap.octree.nodes);
+    addValue(status, "octree [MB]", submap.octree.bytes * MB);
+    diagnosticsmsg_.status.push_back(status);
+  }
+
+  pubDiagnostics_.publish(diagnosticsmsg_);
+}
 
 void Publisher::publishPathAsCallback(const ompl::geometric::PathGeometric & path)
 {
@@ -0,0 +1,274 @@
+#include <SpatialHash.hpp>
+
+#include <cmath>
+
+namespace {
+
+const int kBitsPerAxis = 21;
+const int64_t kAxisOffset = int64_t(1) << (kBitsPerAxis - 1); // coords in [-2^20, 2^20)
+const uint64_t kAxisMask = (uint64_t(1) << kBitsPerAxis) - 1;
+
+}
+
+SpatialHash::SpatialHash(const size_t capacity) : size_(0)
+{
+  size_t slots = 16;
+  while (slots < capacity) slots <<= 1;
+
+  Cell empty;
+  empty.key = kEmptyKey;
+  empty.summary = 0;
+  empty.count = 0;
+  empty.spill = 0;
+  cells_.assign(slots, empty);
+  mask_ = slots - 1;
+}
+
+SpatialHash::Key SpatialHash::pack(const Eigen::Vector3i &coord)
+{
+  const uint64_t x = static_cast<uint64_t>(coord(0) + kAxisOffset) & kAxisMask;
+  const uint64_t y = static_cast<uint64_t>(coord(1) + kAxisOffset) & kAxisMask;
+  const uint64_t z = static_cast<uint64_t>(coord(2) + kAxisOffset) & kAxisMask;
+  return x | (y << kBitsPerAxis) | (z << (2 * kBitsPerAxis));
+}
+
+Eigen::Vector3i SpatialHash::unpack(const Key key)
+{
+  return Eigen::Vector3i(static_cast<int>(static_cast<int64_t>(key & kAxisMask) - kAxisOffset),
+                         static_cast<int>(static_cast<int64_t>((key >> kBitsPerAxis) & kAxisMask) - kAxisOffset),
+                         static_cast<int>(static_cast<int64_t>((key >> (2 * kBitsPerAxis)) & kAxisMask) - kAxisOffset));
+}
+
+void SpatialHash::rasterizeBox(const Eigen::Matrix4f &T_WB, const Eigen::Vector3f &min, const Eigen::Vector3f &max,
+                               const float cellSize, std::vector<Key> &keys)
+{
+  // oriented box: centre, half sides and axes (columns of R) in world frame
+  const Eigen::Matrix3f R = T_WB.topLeftCorner<3,3>();
+  const Eigen::Vector3f hb = 0.5f * (max - min);
+  const Eigen::Vector3f cb = R * (0.5f * (max + min)) + T_WB.topRightCorner<3,1>();
+  const Eigen::Matrix3f absR = R.cwiseAbs().array() + 1e-6f; // epsilon for near parallel axes
+
+  // candidates: boxes overlapping the world aligned bounds of the oriented box
+  const Eigen::Vector3f extent = absR * hb;
+  const Eigen::Vector3i lo = ((cb - extent) / cellSize).array().floor().cast<int>();
+  const Eigen::Vector3i hi = ((cb + extent) / cellSize).array().floor().cast<int>();
+
+  const float ha = 0.5f * cellSize;
+  const Eigen::Vector3f ha3 = Eigen::Vector3f::Constant(ha);
+  const Eigen::Vector3f rb = R.transpose().cwiseAbs() * ha3; // cell radius on the oriented box axes, same for all cells
+
+  // z outer, x inner: keys come out sorted (see pack())
+  for (int z = lo(2); z <= hi(2); z++) {
+    for (int y = lo(1); y <= hi(1); y++) {
+      for (int x = lo(0); x <= hi(0); x++) {
+        // centre of the oriented box wrt the cell centre. world axes overlap by construction
+        const Eigen::Vector3f t = cb - (Eigen::Vector3f(x, y, z).array() + 0.5f).matrix() * cellSize;
+
+        // axes of the oriented box
+        const Eigen::Vector3f tb = R.transpose() * t;
+        if ((tb.cwiseAbs().array() > (rb + hb).array()).any()) continue;
+
+        // cross products of world axis i and box axis j
+        bool separated = false;
+        for (int i = 0; i < 3 && !separated; i++) {
+          const int i1 = (i + 1) % 3, i2 = (i + 2) % 3;
+          for (int j = 0; j < 3; j++) {
+            const int j1 = (j + 1) % 3, j2 = (j + 2) % 3;
+            const float ra = ha * (absR(i1, j) + absR(i2, j));
+            const float rB = hb(j1) * absR(i, j2) + hb(j2) * absR(i, j1);
+            if (std::abs(t(i2) * R(i1, j) - t(i1) * R(i2, j)) > ra + rB) { separated = true; break; }
+          }
+        }
+        if (separated) continue;
+
+        keys.push_back(pack(Eigen::Vector3i(x, y, z)));
+      }
+    }
+  }
+}
+
+size_t SpatialHash::probe(const Key key) const
+{
+  size_t i = home(key);
+  while (cells_[i].key != kEmptyKey && cells_[i].key != key) i = (i + 1) & mask_;
+  return i;
+}
+
+const SpatialHash::Cell* SpatialHash::find(const Key key) const
+{
+  const Cell &cell = cells_[probe(key)];
+  return cell.key == key ? &cell : nullptr;
+}
+
+bool SpatialHash::insert(const Key key, const int id, const uint8_t flags)
+{
+  // keep load factor <= 0.7, probes stay short
+  if (10 * (size_ + 1) > 7 * cells_.size()) grow();
+
+  Cell &cell = cells_[probe(key)];
+
+  if (cell.key == kEmptyKey) {
+    cell.key = key;
+    cell.ids[0] = id;
+    cell.flags[0] = flags;
+    cell.count = 1;
+    summarize(cell);
+    size_++;
+    return true;
+  }
+
+  // already there?
+  if (setFlags(key, id, flags)) return false;
+
+  if (cell.count < kInlineIds) {
+    cell.ids[cell.count] = id;
+    cell.flags[cell.count] = flags;
+  } else {
+    if (cell.count == kInlineIds) cell.spill = allocateSpill();
+    spill_[cell.spill].push_back({id, flags});
+  }
+  cell.count++;
+  summarize(cell);
+  return true;
+}
+
+bool SpatialHash::setFlags(const Key key, const int id, const uint8_t flags)
+{
+  Cell &cell = cells_[probe(key)];
+  if (cell.key != key) return false;
+
+  bool found = false;
+  for (uint32_t j = 0; j < cell.count && j < kInlineIds && !found; j++) {
+    if (cell.ids[j] == id) { cell.flags[j] = flags; found = true; }
+  }
+  if (!found && cell.count > kInlineIds) {
+    for (Entry &entry : spill_[cell.spill]) {
+      if (entry.id == id) { entry.flags = flags; found = true; break; }
+    }
+  }
+  if (found) summarize(cell);
+  return found;
+}
+
+void SpatialHash::summarize(Cell &cell) const
+{
+  uint8_t any = 0;
+  forEachEntry(cell, [&](const int, const uint8_t flags) { any |= flags; });
+
+  // free for all: no submap may be occupied there, and one of them saw it all
+  cell.summary = 0;
+  if (any & kOccupied) cell.summary |= kOccupied;
+  if (!(any & kFree)) cell.summary |= kUnobserved;
+  else if (!(any & kOccupied)) cell.summary |= kFree;
+}
+
+bool SpatialHash::erase(const Key key, const int id)
+{
+  const size_t i = probe(key);
+  Cell &cell = cells_[i];
+  if (cell.key != key) return false;
+
+  // position of the id: inline slot, or kInlineIds + index in the spill
+  uint32_t pos = cell.count;
+  for (uint32_t j = 0; j < cell.count && j < kInlineIds; j++) {
+    if (cell.ids[j] == id) { pos = j; break; }
+  }
+  if (pos == cell.count && cell.count > kInlineIds) {
+    const std::vector<Entry> &spilled = spill_[cell.spill];
+    for (uint32_t j = 0; j < spilled.size(); j++) {
+      if (spilled[j].id == id) { pos = kInlineIds + j; break; }
+    }
+  }
+  if (pos == cell.count) return false;
+
+  // move the last id (and its flags) in place of the removed one
+  if (cell.count > kInlineIds) {
+    std::vector<Entry> &spilled = spill_[cell.spill];
+    if (pos < kInlineIds) {
+      cell.ids[pos] = spilled.back().id;
+      cell.flags[pos] = spilled.back().flags;
+    } else {
+      spilled[pos - kInlineIds] = spilled.back();
+    }
+    spilled.pop_back();
+    if (spilled.empty()) freeSpill_.push_back(cell.spill);
+  } else {
+    cell.ids[pos] = cell.ids[cell.count - 1];
+    cell.flags[pos] = cell.flags[cell.count - 1];
+  }
+  cell.count--;
+
+  if (cell.count == 0) eraseSlot(i);
+  else summarize(cell);
+  return true;
+}
+
+void SpatialHash::eraseSlot(size_t i)
+{
+  // backward-shift deletion: pull back the following entries of the cluster
+  // so that lookups never need tombstones
+  size_t j = i;
+  while (true) {
+    j = (j + 1) & mask_;
+    if (cells_[j].key == kEmptyKey) break;
+    const size_t k = home(cells_[j].key);
+    // entry at j can fill the hole at i only if its home is not in (i, j] (cyclically)
+    const bool inRange = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+    if (!inRange) {
+      cells_[i] = cells_[j];
+      i = j;
+    }
+  }
+  cells_[i].key = kEmptyKey;
+  cells_[i].count = 0;
+  size_--;
+}
+
+void SpatialHash::grow()
+{
+  std::vector<Cell> old;
+  old.swap(cells_);
+
+  Cell empty;
+  empty.key = kEmptyKey;
+  empty.summary = 0;
+  empty.count = 0;
+  empty.spill = 0;
+  cells_.assign(2 * old.size(), empty);
+  mask_ = cells_.size() - 1;
+
+  // spill indices are unchanged, only the slots move
+  for (const Cell &cell : old) {
+    if (cell.key != kEmptyKey) cells_[probe(cell.key)] = cell;
+  }
+}
+
+uint32_t SpatialHash::allocateSpill()
+{
+  if (!freeSpill_.empty()) {
+    const uint32_t index = freeSpill_.back();
+    freeSpill_.pop_back();
+    return index;
+  }
+  spill_.emplace_back();
+  return static_cast<uint32_t>(spill_.size() - 1);
+}
+
+size_t SpatialHash::memoryUsage() const
+{
+  size_t bytes = cells_.capacity() * sizeof(Cell);
+  bytes += spill_.capacity() * sizeof(std::vector<Entry>) + freeSpill_.capacity() * sizeof(uint32_t);
+  for (const auto &spilled : spill_) bytes += spilled.capacity() * sizeof(Entry);
+  return bytes;
+}
+
+void SpatialHash::clear()
+{
+  for (Cell &cell : cells_) {
+    cell.key = kEmptyKey;
+    cell.count = 0;
+  }
+  spill_.clear();
+  freeSpill_.clear();
+  size_ = 0;
+}
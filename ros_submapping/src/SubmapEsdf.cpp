@@ -0,0 +1,196 @@
+#include <SubmapEsdf.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+typedef se::Octree<se::Data<se::Field::Occupancy, se::Colour::Off, se::Semantics::Off>, se::Res::Multi, 8> OctreeT;
+typedef typename OctreeT::BlockType BlockType;
+
+enum VoxelState : uint8_t { kUnknown = 0, kFree = 1, kOccupied = 2 };
+
+const float kFar = 1e10f; // "no site" in the squared distance transform
+
+// Felzenszwalb & Huttenlocher 1D squared distance transform, in place on a strided line
+void transformLine(float* f, const size_t n, const size_t stride,
+                   std::vector<float> &line, std::vector<int> &v, std::vector<float> &z)
+{
+  for (size_t q = 0; q < n; q++) line[q] = f[q * stride];
+
+  int k = 0;
+  v[0] = 0;
+  z[0] = -kFar;
+  z[1] = kFar;
+  for (int q = 1; q < static_cast<int>(n); q++) {
+    float s = ((line[q] + q * q) - (line[v[k]] + v[k] * v[k])) / (2 * q - 2 * v[k]);
+    while (s <= z[k]) {
+      k--;
+      s = ((line[q] + q * q) - (line[v[k]] + v[k] * v[k])) / (2 * q - 2 * v[k]);
+    }
+    k++;
+    v[k] = q;
+    z[k] = s;
+    z[k + 1] = kFar;
+  }
+
+  k = 0;
+  for (int q = 0; q < static_cast<int>(n); q++) {
+    while (z[k + 1] < q) k++;
+    f[q * stride] = (q - v[k]) * (q - v[k]) + line[v[k]];
+  }
+}
+
+// squared euclidean distance transform (voxel units) of a dense grid, separable over x, y, z
+void transform(std::vector<float> &grid, const Eigen::Vector3i &dims)
+{
+  const size_t maxDim = dims.maxCoeff();
+  std::vector<float> line(maxDim);
+  std::vector<int> v(maxDim);
+  std::vector<float> z(maxDim + 1);
+
+  const size_t sx = 1, sy = dims(0), sz = static_cast<size_t>(dims(0)) * dims(1);
+  for (int zz = 0; zz < dims(2); zz++)
+    for (int yy = 0; yy < dims(1); yy++)
+      transformLine(&grid[yy * sy + zz * sz], dims(0), sx, line, v, z);
+  for (int zz = 0; zz < dims(2); zz++)
+    for (int xx = 0; xx < dims(0); xx++)
+      transformLine(&grid[xx * sx + zz * sz], dims(1), sy, line, v, z);
+  for (int yy = 0; yy < dims(1); yy++)
+    for (int xx = 0; xx < dims(0); xx++)
+      transformLine(&grid[xx * sx + yy * sy], dims(2), sz, line, v, z);
+}
+
+}
+
+std::shared_ptr<const SubmapEsdf> SubmapEsdf::compute(const se::OccupancyMap<se::Res::Multi> &map,
+                                                      const Eigen::Matrix<float,6,1> &bounds,
+                                                      const float maxDistance)
+{
+  std::shared_ptr<SubmapEsdf> esdf(new SubmapEsdf());
+
+  esdf->res_ = map.getRes();
+  esdf->T_MK_ = map.getTWM().inverse();
+  esdf->maxDistance_ = maxDistance;
+  esdf->quantum_ = maxDistance / 127.f;
+
+  // grid over the bounds (in voxels), plus a 1 voxel unobserved border
+  const Eigen::Vector3i min_voxel = (bounds.head<3>() / esdf->res_).array().round().cast<int>() - 1;
+  const Eigen::Vector3i max_voxel = (bounds.tail<3>() / esdf->res_).array().round().cast<int>() + 1;
+  esdf->dims_ = (max_voxel - min_voxel).cwiseMax(1);
+  esdf->origin_ = (min_voxel.cast<float>() + Eigen::Vector3f::Constant(0.5f)) * esdf->res_;
+
+  const Eigen::Vector3i &dims = esdf->dims_;
+  const size_t size = static_cast<size_t>(dims(0)) * dims(1) * dims(2);
+  std::vector<uint8_t> state(size, kUnknown);
+
+  // fills the grid voxels covered by an octant (octree voxel coords)
+  auto fill = [&](const Eigen::Vector3i &coord, const int node_size, const uint8_t value) {
+    const Eigen::Vector3i lo = (coord - min_voxel).cwiseMax(0);
+    const Eigen::Vector3i hi = (coord - min_voxel + Eigen::Vector3i::Constant(node_size)).cwiseMin(dims);
+    for (int z = lo(2); z < hi(2); z++)
+      for (int y = lo(1); y < hi(1); y++)
+        for (int x = lo(0); x < hi(0); x++)
+          state[esdf->index(x, y, z)] = value;
+  };
+
+  // same classification as the collision checker: unobserved if weight is 0, occupied if occupancy >= 0
+  auto classify = [](const auto &data) -> uint8_t {
+    if (data.weight == 0) return kUnknown;
+    return data.occupancy >= 0 ? kOccupied : kFree;
+  };
+
+  auto octree_ptr = map.getOctree();
+  for (auto octant_it = se::LeavesIterator<OctreeT>(octree_ptr.get()); octant_it != se::LeavesIterator<OctreeT>(); ++octant_it) {
+    const auto octant_ptr = *octant_it;
+
+    if (octant_ptr->isBlock()) {
+      // iterate over the voxels at the current scale
+      const Eigen::Vector3i block_coord = octant_ptr->getCoord();
+      const BlockType* block_ptr = static_cast<const BlockType*>(octant_ptr);
+      const int node_size = 1 << block_ptr->getCurrentScale();
+      for (int x = 0; x < BlockType::getSize(); x += node_size) {
+        for (int y = 0; y < BlockType::getSize(); y += node_size) {
+          for (int z = 0; z < BlockType::getSize(); z += node_size) {
+            const Eigen::Vector3i node_coord = block_coord + Eigen::Vector3i(x, y, z);
+            fill(node_coord, node_size, classify(block_ptr->getData(node_coord)));
+          }
+        }
+      }
+    } else {
+      // nodes: conservative, occupied if any child is
+      const auto node_ptr = static_cast<typename OctreeT::NodeType*>(octant_ptr);
+      const auto data = node_ptr->getData();
+      if (data.weight == 0) continue;
+      const uint8_t value = node_ptr->getMaxData().occupancy >= 0 ? kOccupied : kFree;
+      fill(octant_ptr->getCoord(), node_ptr->getSize(), value);
+    }
+  }
+
+  // squared distances to the sites, then signed/truncated and quantized
+  std::vector<float> toOccupied(size), toNotOccupied(size), toNotFree(size);
+  for (size_t i = 0; i < size; i++) {
+    toOccupied[i] = state[i] == kOccupied ? 0.f : kFar;
+    toNotOccupied[i] = state[i] == kOccupied ? kFar : 0.f;
+    toNotFree[i] = state[i] == kFree ? kFar : 0.f;
+  }
+  transform(toOccupied, dims);
+  transform(toNotOccupied, dims);
+  transform(toNotFree, dims);
+
+  auto quantize = [&](const float metres) -> int8_t {
+    const float clamped = std::max(-maxDistance, std::min(maxDistance, metres));
+    return static_cast<int8_t>(std::lround(clamped / esdf->quantum_));
+  };
+
+  esdf->occupied_.resize(size);
+  esdf->notFree_.resize(size);
+  for (size_t i = 0; i < size; i++) {
+    const float signedDistance = state[i] == kOccupied ? -std::sqrt(toNotOccupied[i]) : std::sqrt(toOccupied[i]);
+    esdf->occupied_[i] = quantize(signedDistance * esdf->res_);
+    esdf->notFree_[i] = quantize(std::sqrt(toNotFree[i]) * esdf->res_);
+  }
+
+  return esdf;
+}
+
+bool SubmapEsdf::contains(const Eigen::Vector3f &r_map) const
+{
+  const Eigen::Vector3f u = toGrid(r_map);
+  return (u.array() >= 0.f).all() && (u.array() <= (dims_ - Eigen::Vector3i::Ones()).cast<float>().array()).all();
+}
+
+float SubmapEsdf::occupiedDistance(const Eigen::Vector3f &r_map) const
+{
+  float outside;
+  const float distance = interpolate(occupied_, toGrid(r_map), outside);
+  return distance - outside;
+}
+
+float SubmapEsdf::observedClearance(const Eigen::Vector3f &r_map) const
+{
+  float outside;
+  const float distance = interpolate(notFree_, toGrid(r_map), outside);
+  return outside > 0.f ? 0.f : distance;
+}
+
+float SubmapEsdf::interpolate(const std::vector<int8_t> &field, const Eigen::Vector3f &u, float &outside) const
+{
+  const Eigen::Vector3f clamped = u.cwiseMax(0.f).cwiseMin((dims_ - Eigen::Vector3i::Ones()).cast<float>());
+  outside = (u - clamped).norm() * res_;
+
+  const Eigen::Vector3i lo = clamped.array().floor().cast<int>();
+  const Eigen::Vector3i hi = (lo + Eigen::Vector3i::Ones()).cwiseMin(dims_ - Eigen::Vector3i::Ones());
+  const Eigen::Vector3f t = clamped - lo.cast<float>();
+
+  auto at = [&](const int x, const int y, const int z) { return static_cast<float>(field[index(x, y, z)]); };
+
+  const float c00 = at(lo(0), lo(1), lo(2)) * (1 - t(0)) + at(hi(0), lo(1), lo(2)) * t(0);
+  const float c10 = at(lo(0), hi(1), lo(2)) * (1 - t(0)) + at(hi(0), hi(1), lo(2)) * t(0);
+  const float c01 = at(lo(0), lo(1), hi(2)) * (1 - t(0)) + at(hi(0), lo(1), hi(2)) * t(0);
+  const float c11 = at(lo(0), hi(1), hi(2)) * (1 - t(0)) + at(hi(0), hi(1), hi(2)) * t(0);
+  const float c0 = c00 * (1 - t(1)) + c10 * t(1);
+  const float c1 = c01 * (1 - t(1)) + c11 * t(1);
+
+  return (c0 * (1 - t(2)) + c1 * t(2)) * quantum_;
+}
@@ -0,0 +1,97 @@
+#include <SubmapJobPool.hpp>
+
+SubmapJobPool::SubmapJobPool(const size_t numThreads) : numPending_(0), shutdown_(false)
+{
+  const size_t n = numThreads > 0 ? numThreads : 1;
+  for (size_t i = 0; i < n; i++) workers_.emplace_back(&SubmapJobPool::workerLoop, this);
+}
+
+SubmapJobPool::~SubmapJobPool()
+{
+  shutdown();
+}
+
+bool SubmapJobPool::push(const JobType type, const uint64_t id, std::function<void()> job)
+{
+  std::unique_lock<std::mutex> lk(mutex_);
+  if (shutdown_) return false;
+
+  std::deque<Job> &queue = jobs_[id];
+
+  // newer pose for a rehash (newer state for a snapshot / scan) that did not start yet: just swap the job
+  const bool replaceable = type == JobType::Rehash || type == JobType::Snapshot || type == JobType::EvictionScan;
+  if (replaceable && !queue.empty() && queue.back().type == type) {
+    queue.back().run = std::move(job);
+    return false;
+  }
+
+  // the submap becomes ready if it had nothing pending or running
+  if (queue.empty() && !busy_.count(id)) ready_.push_back(id);
+  queue.push_back({type, std::move(job)});
+  numPending_++;
+
+  lk.unlock();
+  cvJobs_.notify_one();
+  return true;
+}
+
+void SubmapJobPool::shutdown()
+{
+  std::unique_lock<std::mutex> lk(mutex_);
+  shutdown_ = true;
+  jobs_.clear();
+  ready_.clear();
+  numPending_ = 0;
+  lk.unlock();
+  cvJobs_.notify_all();
+
+  for (auto &worker : workers_) {
+    if (worker.joinable()) worker.join();
+  }
+  workers_.clear();
+}
+
+size_t SubmapJobPool::pending()
+{
+  std::lock_guard<std::mutex> lk(mutex_);
+  return numPending_;
+}
+
+size_t SubmapJobPool::outstanding()
+{
+  std::lock_guard<std::mutex> lk(mutex_);
+  return numPending_ + busy_.size();
+}
+
+void SubmapJobPool::workerLoop()
+{
+  while (true) {
+    std::unique_lock<std::mutex> lk(mutex_);
+    cvJobs_.wait(lk, [&] { return shutdown_ || !ready_.empty(); });
+    if (shutdown_) return;
+
+    // oldest ready submap, and its oldest job
+    const uint64_t id = ready_.front();
+    ready_.pop_front();
+    std::deque<Job> &queue = jobs_[id];
+    Job job = std::move(queue.front());
+    queue.pop_front();
+    numPending_--;
+    busy_.insert(id);
+    lk.unlock();
+
+    job.run();
+
+    lk.lock();
+    busy_.erase(id);
+    if (shutdown_) return;
+    auto it = jobs_.find(id);
+    if (it != jobs_.end() && !it->second.empty()) {
+      ready_.push_back(id);
+      lk.unlock();
+      cvJobs_.notify_one();
+    } else if (it != jobs_.end()) {
+      jobs_.erase(it);
+    }
+  }
+}
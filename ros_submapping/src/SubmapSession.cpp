@@ -0,0 +1,123 @@
+#include <SubmapSession.hpp>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <set>
+#include <boost/filesystem.hpp>
+
+namespace {
+
+const uint32_t kMagic = 0x42555353; // "SSUB"
+const uint32_t kVersion = 2; // 2: files named after the save generation
+const char *kIndexName = "session.index";
+
+struct Header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t id;
+  double T_WK[16]; // column major
+  float bounds[6];
+  uint64_t numCells;
+  uint64_t mapSize; // bytes of the octree dump
+};
+
+std::string submapName(const uint64_t generation, const uint64_t id) {
+  return std::to_string(generation) + "_" + std::to_string(id) + ".session";
+}
+
+std::string submapFilename(const std::string &directory, const uint64_t generation, const uint64_t id) {
+  return directory + "/" + submapName(generation, id);
+}
+
+} // namespace
+
+bool SubmapSession::save(const std::string &directory, const std::vector<SessionSubmap> &submaps)
+{
+  // okvis ids repeat across runs: the files of the new session never overwrite the ones the
+  // current index points at. a save that dies halfway leaves the previous session intact
+  SessionIndex previous;
+  const uint64_t generation = readIndex(directory, previous) ? previous.generation + 1 : 1;
+
+  std::string octree;
+  for (const auto &submap : submaps) {
+    SubmapStore::serialize(*submap.map, octree);
+
+    Header header;
+    std::memset(&header, 0, sizeof(header));
+    header.magic = kMagic;
+    header.version = kVersion;
+    header.id = submap.id;
+    Eigen::Map<Eigen::Matrix4d>(header.T_WK) = submap.T_WK;
+    Eigen::Map<Eigen::Matrix<float,6,1>>(header.bounds) = submap.bounds;
+    header.numCells = submap.cells.size();
+    header.mapSize = octree.size();
+
+    std::ofstream file(submapFilename(directory, generation, submap.id), std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char *>(submap.cells.data()), submap.cells.size() * sizeof(SpatialHash::Key));
+    file.write(octree.data(), octree.size());
+    if (!file.good()) return false;
+  }
+
+  // the index makes the new session visible
+  const std::string index = directory + "/" + kIndexName;
+  std::ofstream file(index + ".tmp", std::ios::trunc);
+  file << "submap_session " << kVersion << " " << generation << "\n";
+  for (const auto &submap : submaps) file << submap.id << "\n";
+  file.close();
+  if (!file.good()) return false;
+  if (std::rename((index + ".tmp").c_str(), index.c_str()) != 0) return false;
+
+  // now nothing points at the older files (nor at those of a save that died)
+  std::set<std::string> written;
+  for (const auto &submap : submaps) written.insert(submapName(generation, submap.id));
+  std::vector<boost::filesystem::path> stale;
+  boost::system::error_code error;
+  for (boost::filesystem::directory_iterator it(directory, error), end; !error && it != end; it.increment(error)) {
+    if (it->path().extension() == ".session" && !written.count(it->path().filename().string())) stale.push_back(it->path());
+  }
+  for (const auto &path : stale) boost::filesystem::remove(path, error);
+  return true;
+}
+
+bool SubmapSession::readIndex(const std::string &directory, SessionIndex &index)
+{
+  index = SessionIndex();
+  std::ifstream file(directory + "/" + kIndexName);
+  std::string tag;
+  uint32_t version = 0;
+  if (!(file >> tag >> version >> index.generation) || tag != "submap_session" || version != kVersion) return false;
+  uint64_t id;
+  while (file >> id) index.ids.push_back(id);
+  return true;
+}
+
+bool SubmapSession::load(const std::string &directory, const SessionIndex &index, const uint64_t id,
+                         const se::MapConfig &mapConfig, const se::OccupancyDataConfig &dataConfig, SessionSubmap &submap)
+{
+  std::ifstream file(submapFilename(directory, index.generation, id), std::ios::binary);
+  const std::string buffer((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+  Header header;
+  if (buffer.size() < sizeof(header)) return false;
+  std::memcpy(&header, buffer.data(), sizeof(header));
+  const size_t cellsSize = header.numCells * sizeof(SpatialHash::Key);
+  if (header.magic != kMagic || header.version != kVersion || header.id != id
+      || buffer.size() != sizeof(header) + cellsSize + header.mapSize) {
+    return false;
+  }
+
+  submap.id = id;
+  submap.T_WK = Eigen::Map<const Eigen::Matrix4d>(header.T_WK);
+  submap.bounds = Eigen::Map<const Eigen::Matrix<float,6,1>>(header.bounds);
+  submap.cells.resize(header.numCells);
+  std::memcpy(submap.cells.data(), buffer.data() + sizeof(header), cellsSize);
+
+  const char *mapData = buffer.data() + sizeof(header) + cellsSize;
+  se::MapConfig submapConfig = mapConfig;
+  if (!SubmapStore::readConfig(mapData, header.mapSize, submapConfig)) return false;
+  submap.map = std::make_shared<se::OccupancyMap<se::Res::Multi>>(submapConfig, dataConfig);
+  return SubmapStore::deserialize(mapData, header.mapSize, *submap.map);
+}
@@ -0,0 +1,345 @@
+#include <SubmapStore.hpp>
+
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+typedef se::Octree<se::Data<se::Field::Occupancy, se::Colour::Off, se::Semantics::Off>, se::Res::Multi, 8> OctreeT;
+typedef typename OctreeT::BlockType BlockType;
+typedef typename OctreeT::NodeType NodeType;
+typedef typename OctreeT::DataType DataType;
+
+const uint32_t kMagic = 0x50414d53; // "SMAP"
+const uint32_t kVersion = 3; // 3: all nodes and all block scales. 2: config record. 1 and 2 (leaves only) are rejected
+
+struct Header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t dataSize;   // sizeof(DataType) of the writer
+  uint32_t blockSize;
+  int32_t octreeSize;
+  uint32_t pad;
+  uint64_t numNodes;
+  uint64_t numBlocks;
+};
+
+// config of the map, submaps can differ in res and dim
+struct ConfigRecord {
+  float res;
+  float dim[3];
+  float T_MW[16]; // column major
+};
+
+struct NodeRecord {
+  int32_t coord[3];
+  int32_t size;
+  DataType data;
+  DataType maxData;
+};
+
+struct BlockRecord {
+  int32_t coord[3];
+  int32_t scale;    // current scale, followed by a VoxelRecord per voxel of it and of each coarser scale
+  int32_t minScale;
+  int32_t pad;
+};
+
+struct VoxelRecord {
+  DataType data;
+  DataType maxData;
+};
+
+// scale of a block: one voxel
+int blockMaxScale() {
+  int scale = 0;
+  while ((BlockType::getSize() >> scale) > 1) scale++;
+  return scale;
+}
+
+template <typename T>
+void append(std::string &out, const T &value) {
+  out.append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+// bounds checked read, advances the cursor
+template <typename T>
+bool take(const char *&cursor, const char *end, T &value) {
+  if (static_cast<size_t>(end - cursor) < sizeof(T)) return false;
+  std::memcpy(&value, cursor, sizeof(T));
+  cursor += sizeof(T);
+  return true;
+}
+
+// allocates the octants from the root down to the one at coord with the given size
+se::OctantBase *allocateOctant(OctreeT &octree, const Eigen::Vector3i &coord, const int size) {
+  se::OctantBase *octant = octree.getRoot();
+  int octant_size = octree.getSize();
+  while (octant_size > size) {
+    if (octant->isBlock()) return nullptr; // a block can't contain smaller octants
+    octant_size /= 2;
+    const int child_idx = ((coord.x() & octant_size) > 0) + 2 * ((coord.y() & octant_size) > 0) + 4 * ((coord.z() & octant_size) > 0);
+    se::OctantBase *child = nullptr;
+    octree.allocate(static_cast<NodeType *>(octant), child_idx, child);
+    if (!child) return nullptr;
+    octant = child;
+  }
+  return octant;
+}
+
+} // namespace
+
+SubmapStore::SubmapStore(const std::string &directory, const se::MapConfig &mapConfig,
+                         const se::OccupancyDataConfig &dataConfig, const size_t cacheSize)
+    : directory_(directory), mapConfig_(mapConfig), dataConfig_(dataConfig), cacheSize_(cacheSize)
+{
+}
+
+bool SubmapStore::save(const uint64_t id, const se::OccupancyMap<se::Res::Multi> &map)
+{
+  std::string buffer;
+  serialize(map, buffer);
+
+  std::ofstream file(filename(id), std::ios::binary | std::ios::trunc);
+  file.write(buffer.data(), buffer.size());
+  if (!file.good()) return false;
+  file.close();
+
+  std::lock_guard<std::mutex> lk(mutex_);
+  if (saved_.insert(id).second) stats_.bytesOnDisk += buffer.size();
+  stats_.evictions++;
+  return true;
+}
+
+SubmapPtr SubmapStore::load(const uint64_t id)
+{
+  std::unique_lock<std::mutex> lk(mutex_);
+  if (!saved_.count(id)) return nullptr;
+  for (auto it = cache_.begin(); it != cache_.end(); ++it) {
+    if (it->first == id) {
+      cache_.splice(cache_.begin(), cache_, it);
+      stats_.hits++;
+      return it->second;
+    }
+  }
+  stats_.misses++;
+  lk.unlock();
+
+  // read without holding the lock, others can still hit the cache
+  const int fd = ::open(filename(id).c_str(), O_RDONLY);
+  if (fd < 0) return nullptr;
+  struct stat st;
+  if (::fstat(fd, &st) != 0 || st.st_size == 0) {
+    ::close(fd);
+    return nullptr;
+  }
+  const size_t size = st.st_size;
+
+  // each map is rebuilt with the res and dim it was created with
+  SubmapPtr map;
+  auto restore = [&](const char *data) {
+    se::MapConfig mapConfig = mapConfig_;
+    if (!readConfig(data, size, mapConfig)) return false;
+    map = std::make_shared<se::OccupancyMap<se::Res::Multi>>(mapConfig, dataConfig_);
+    return deserialize(data, size, *map);
+  };
+  bool ok;
+  void *mapped = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (mapped != MAP_FAILED) {
+    ok = restore(static_cast<const char *>(mapped));
+    ::munmap(mapped, size);
+  } else {
+    // no mmap (e.g. some network filesystems): plain read
+    std::string buffer(size, '\0');
+    ok = ::pread(fd, &buffer[0], size, 0) == static_cast<ssize_t>(size) && restore(buffer.data());
+  }
+  ::close(fd);
+  if (!ok) return nullptr;
+
+  lk.lock();
+  for (const auto &entry : cache_) {
+    if (entry.first == id) return entry.second; // loaded concurrently
+  }
+  cache_.emplace_front(id, map);
+  if (cache_.size() > cacheSize_) cache_.pop_back();
+  return map;
+}
+
+bool SubmapStore::contains(const uint64_t id) const
+{
+  std::lock_guard<std::mutex> lk(mutex_);
+  return saved_.count(id);
+}
+
+SubmapStoreStats SubmapStore::stats() const
+{
+  std::lock_guard<std::mutex> lk(mutex_);
+  return stats_;
+}
+
+OctreeMemory SubmapStore::octreeMemory(const se::OccupancyMap<se::Res::Multi> &map)
+{
+  OctreeMemory memory;
+  auto octree_ptr = map.getOctree();
+  for (auto octant_it = se::LeavesIterator<OctreeT>(octree_ptr.get()); octant_it != se::LeavesIterator<OctreeT>(); ++octant_it) {
+    // parents are not visited, roughly one per 8 leaves
+    if ((*octant_it)->isBlock()) {
+      memory.blocks++;
+      memory.bytes += sizeof(BlockType);
+    } else {
+      memory.nodes++;
+      memory.bytes += sizeof(NodeType) + sizeof(NodeType) / 8;
+    }
+  }
+  return memory;
+}
+
+void SubmapStore::serialize(const se::OccupancyMap<se::Res::Multi> &map, std::string &out)
+{
+  std::string nodes, blocks;
+  Header header;
+  std::memset(&header, 0, sizeof(header));
+  header.magic = kMagic;
+  header.version = kVersion;
+  header.dataSize = sizeof(DataType);
+  header.blockSize = BlockType::getSize();
+
+  auto octree_ptr = map.getOctree();
+  header.octreeSize = octree_ptr->getSize();
+
+  // every octant, parents first: the inner nodes hold the max data of the coarse scales
+  const int max_scale = blockMaxScale();
+  std::vector<const se::OctantBase *> stack = {octree_ptr->getRoot()};
+  while (!stack.empty()) {
+    const se::OctantBase *octant_ptr = stack.back();
+    stack.pop_back();
+    if (!octant_ptr) continue;
+    const Eigen::Vector3i coord = octant_ptr->getCoord();
+
+    if (octant_ptr->isBlock()) {
+      // the voxels at the current scale and all the coarser ones
+      const BlockType *block_ptr = static_cast<const BlockType *>(octant_ptr);
+      BlockRecord record = {{coord.x(), coord.y(), coord.z()}, block_ptr->getCurrentScale(), block_ptr->getMinScale(), 0};
+      append(blocks, record);
+      for (int scale = record.scale; scale <= max_scale; scale++) {
+        const int node_size = 1 << scale;
+        for (int x = 0; x < BlockType::getSize(); x += node_size) {
+          for (int y = 0; y < BlockType::getSize(); y += node_size) {
+            for (int z = 0; z < BlockType::getSize(); z += node_size) {
+              const Eigen::Vector3i voxel_coord = coord + Eigen::Vector3i(x, y, z);
+              append(blocks, VoxelRecord{block_ptr->getData(voxel_coord, scale), block_ptr->getMaxData(voxel_coord, scale)});
+            }
+          }
+        }
+      }
+      header.numBlocks++;
+    } else {
+      const auto node_ptr = static_cast<const NodeType *>(octant_ptr);
+      NodeRecord record = {};
+      record.coord[0] = coord.x();
+      record.coord[1] = coord.y();
+      record.coord[2] = coord.z();
+      record.size = node_ptr->getSize();
+      record.data = node_ptr->getData();
+      record.maxData = node_ptr->getMaxData();
+      append(nodes, record);
+      header.numNodes++;
+      for (int i = 7; i >= 0; i--) stack.push_back(node_ptr->getChild(i));
+    }
+  }
+
+  ConfigRecord config;
+  config.res = map.getRes();
+  Eigen::Map<Eigen::Vector3f>(config.dim) = map.getDim();
+  Eigen::Map<Eigen::Matrix4f>(config.T_MW) = map.getTWM().inverse();
+
+  out.clear();
+  out.reserve(sizeof(header) + sizeof(config) + nodes.size() + blocks.size());
+  append(out, header);
+  append(out, config);
+  out += nodes;
+  out += blocks;
+}
+
+bool SubmapStore::deserialize(const char *data, const size_t size, se::OccupancyMap<se::Res::Multi> &map)
+{
+  const char *cursor = data;
+  const char *end = data + size;
+
+  Header header;
+  if (!take(cursor, end, header)) return false;
+  auto &octree = *map.getOctree();
+  if (header.magic != kMagic || header.version != kVersion || header.dataSize != sizeof(DataType)
+      || header.blockSize != static_cast<uint32_t>(BlockType::getSize()) || header.octreeSize != octree.getSize()) {
+    return false;
+  }
+  ConfigRecord config;
+  if (!take(cursor, end, config)) return false;
+
+  for (uint64_t i = 0; i < header.numNodes; i++) {
+    NodeRecord record;
+    if (!take(cursor, end, record)) return false;
+    const Eigen::Vector3i coord(record.coord[0], record.coord[1], record.coord[2]);
+    se::OctantBase *octant = allocateOctant(octree, coord, record.size);
+    if (!octant || octant->isBlock()) return false;
+    NodeType *node_ptr = static_cast<NodeType *>(octant);
+    node_ptr->setData(record.data);
+    node_ptr->setMaxData(record.maxData);
+  }
+
+  const int max_scale = blockMaxScale();
+  for (uint64_t i = 0; i < header.numBlocks; i++) {
+    BlockRecord record;
+    if (!take(cursor, end, record)) return false;
+    if (record.scale < 0 || record.scale > max_scale || record.minScale > record.scale) return false; // min scale is -1 before any integration
+    const Eigen::Vector3i coord(record.coord[0], record.coord[1], record.coord[2]);
+    se::OctantBase *octant = allocateOctant(octree, coord, BlockType::getSize());
+    if (!octant || !octant->isBlock()) return false;
+    BlockType *block_ptr = static_cast<BlockType *>(octant);
+    block_ptr->allocateDownTo(record.scale);
+    block_ptr->setCurrentScale(record.scale);
+    block_ptr->setMinScale(record.minScale);
+    for (int scale = record.scale; scale <= max_scale; scale++) {
+      const int node_size = 1 << scale;
+      for (int x = 0; x < BlockType::getSize(); x += node_size) {
+        for (int y = 0; y < BlockType::getSize(); y += node_size) {
+          for (int z = 0; z < BlockType::getSize(); z += node_size) {
+            VoxelRecord voxel;
+            if (!take(cursor, end, voxel)) return false;
+            const Eigen::Vector3i voxel_coord = coord + Eigen::Vector3i(x, y, z);
+            block_ptr->setData(voxel_coord, scale, voxel.data);
+            block_ptr->setMaxData(voxel_coord, scale, voxel.maxData);
+          }
+        }
+      }
+    }
+  }
+
+  return cursor == end;
+}
+
+bool SubmapStore::readConfig(const char *data, const size_t size, se::MapConfig &mapConfig)
+{
+  const char *cursor = data;
+  const char *end = data + size;
+
+  Header header;
+  if (!take(cursor, end, header) || header.magic != kMagic || header.version != kVersion) return false;
+
+  ConfigRecord config;
+  if (!take(cursor, end, config)) return false;
+  mapConfig.res = config.res;
+  mapConfig.dim = Eigen::Map<const Eigen::Vector3f>(config.dim);
+  mapConfig.T_MW = Eigen::Map<const Eigen::Matrix4f>(config.T_MW);
+  return true;
+}
+
+std::string SubmapStore::filename(const uint64_t id) const
+{
+  return directory_ + "/" + std::to_string(id) + ".submap";
+}
@@ -1,22 +1,125 @@
 #include <SupereightInterface.hpp>
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <limits>
+
+void SubmapConfig::readYaml(const std::string &filename)
+{
+  cv::FileStorage fs;
+  fs.open(filename, cv::FileStorage::READ | cv::FileStorage::FORMAT_YAML);
+  const cv::FileNode node = fs["submaps"];
+
+  float distThresholdTmp = distThreshold;
+  se::yaml::subnode_as_float(node, "dist_threshold", distThresholdTmp);
+  distThreshold = distThresholdTmp;
+  assert(distThreshold >= 0);
+
+  se::yaml::subnode_as_int(node, "hashing_threads", hashingThreads);
+  assert(hashingThreads > 0);
+
+  se::yaml::subnode_as_float(node, "rehash_translation_tol", rehashTranslationTol);
+  se::yaml::subnode_as_float(node, "rehash_rotation_tol", rehashRotationTol);
+  assert(rehashTranslationTol >= 0 && rehashRotationTol >= 0);
+
+  se::yaml::subnode_as_float(node, "hash_cell_size", hashCellSize);
+  assert(hashCellSize > 0);
+  se::yaml::subnode_as_bool(node, "hash_observed_blocks_only", hashObservedBlocksOnly);
+
+  se::yaml::subnode_as_bool(node, "use_esdf", useEsdf);
+  se::yaml::subnode_as_float(node, "esdf_max_distance", esdfMaxDistance);
+  assert(esdfMaxDistance > 0);
+  se::yaml::subnode_as_int(node, "active_esdf_interval", activeEsdfInterval);
+  assert(activeEsdfInterval > 0);
+
+  se::yaml::subnode_as_float(node, "resident_budget", residentBudget);
+  se::yaml::subnode_as_float(node, "eviction_distance", evictionDistance);
+  se::yaml::subnode_as_int(node, "eviction_cache_size", evictionCacheSize);
+  assert(residentBudget >= 0 && evictionDistance >= 0 && evictionCacheSize >= 0);
+
+  se::yaml::subnode_as_bool(node, "load_session", loadSession);
+  se::yaml::subnode_as_bool(node, "save_session", saveSession);
+  se::yaml::subnode_as_bool(node, "save_hash_table", saveHashTable);
+
+  se::yaml::subnode_as_bool(node, "adaptive_resolution", adaptiveResolution);
+  se::yaml::subnode_as_float(node, "adaptive_reference_depth", adaptiveReferenceDepth);
+  se::yaml::subnode_as_float(node, "adaptive_speed_horizon", adaptiveSpeedHorizon);
+  se::yaml::subnode_as_float(node, "min_res", minRes);
+  se::yaml::subnode_as_float(node, "max_res", maxRes);
+  assert(adaptiveReferenceDepth > 0 && adaptiveSpeedHorizon >= 0 && minRes > 0 && minRes <= maxRes);
+  se::yaml::subnode_as_float(node, "submap_memory_budget", submapMemoryBudget);
+  assert(submapMemoryBudget >= 0);
+  se::yaml::subnode_as_float(node, "memory_stats_period", memoryStatsPeriod);
+  assert(memoryStatsPeriod >= 0);
+
+  const cv::FileNode schedulerNode = fs["scheduler"];
+  se::yaml::subnode_as_int(schedulerNode, "depth_queue_size", scheduler.depthQueueSize);
+  se::yaml::subnode_as_int(schedulerNode, "supereight_queue_size", scheduler.supereightQueueSize);
+  se::yaml::subnode_as_int(schedulerNode, "state_queue_size", scheduler.stateQueueSize);
+  // sizes of buffers: checked in release builds too
+  const FrameSchedulerConfig schedulerDefaults;
+  if (scheduler.depthQueueSize <= 0 || scheduler.supereightQueueSize <= 0 || scheduler.stateQueueSize <= 0) {
+    LOG(ERROR) << "Queue sizes must be positive, using the defaults";
+    scheduler.depthQueueSize = schedulerDefaults.depthQueueSize;
+    scheduler.supereightQueueSize = schedulerDefaults.supereightQueueSize;
+    scheduler.stateQueueSize = schedulerDefaults.stateQueueSize;
+  }
+  se::yaml::subnode_as_bool(schedulerNode, "decimate", scheduler.decimate);
+  se::yaml::subnode_as_float(schedulerNode, "latency_budget", scheduler.latencyBudget);
+  se::yaml::subnode_as_int(schedulerNode, "keyframe_frames", scheduler.keyframeFrames);
+  se::yaml::subnode_as_float(schedulerNode, "min_translation", scheduler.minTranslation);
+  se::yaml::subnode_as_float(schedulerNode, "min_rotation", scheduler.minRotation);
+  se::yaml::subnode_as_int(schedulerNode, "max_consecutive_skips", scheduler.maxConsecutiveSkips);
+  if (!(scheduler.latencyBudget > 0)) {
+    LOG(ERROR) << "latency_budget must be positive, using " << schedulerDefaults.latencyBudget;
+    scheduler.latencyBudget = schedulerDefaults.latencyBudget;
+  }
+  if (scheduler.maxConsecutiveSkips < 0) {
+    LOG(ERROR) << "max_consecutive_skips must not be negative, using " << schedulerDefaults.maxConsecutiveSkips;
+    scheduler.maxConsecutiveSkips = schedulerDefaults.maxConsecutiveSkips;
+  }
+
+  const cv::FileNode depthNode = fs["depth_preprocessing"];
+  se::yaml::subnode_as_int(depthNode, "downsampling", depth.downsampling);
+  // it sizes the frames and the pooling blocks: checked in release builds too
+  if (depth.downsampling != 1 && depth.downsampling != 2 && depth.downsampling != DepthPreprocessorConfig::kMaxDownsampling) {
+    LOG(ERROR) << "Depth downsampling must be 1, 2 or 4, not " << depth.downsampling << ": downsampling off";
+    depth.downsampling = 1;
+  }
+  std::string pooling = "min";
+  se::yaml::subnode_as_string(depthNode, "pooling", pooling);
+  assert(pooling == "min" || pooling == "median");
+  depth.pooling = pooling == "median" ? DepthPreprocessorConfig::Pooling::Median : DepthPreprocessorConfig::Pooling::Min;
+  se::yaml::subnode_as_bool(depthNode, "clip_range", depth.clipRange);
+  // clipping range is the one of the depth sensor
+  se::yaml::subnode_as_float(fs["sensor"], "near_plane", depth.nearPlane);
+  se::yaml::subnode_as_float(fs["sensor"], "far_plane", depth.farPlane);
+}
+
+float SubmapConfig::submapScale(const float res, const float extent) const
+{
+  if (!adaptiveResolution) return 1.f;
+
+  // powers of 2 within [minRes, maxRes] (the eps keeps exact ratios from rounding the wrong way)
+  const int minLevel = std::min(0, static_cast<int>(std::ceil(std::log2(minRes / res) - 1e-4f)));
+  const int maxLevel = std::max(0, static_cast<int>(std::floor(std::log2(maxRes / res) + 1e-4f)));
+  if (extent <= 0) return std::ldexp(1.f, minLevel);
+
+  const int level = static_cast<int>(std::lround(std::log2(extent / adaptiveReferenceDepth)));
+  return std::ldexp(1.f, std::max(minLevel, std::min(maxLevel, level)));
+}
 
 bool SupereightInterface::addDepthImage(const okvis::Time &stamp,
                                         const cv::Mat &depthFrame) {
-  // Create an OKVIS Image measurement. (contains an image and a depthImage
-  // member)
-  CameraMeasurement depthMeasurement;
-  // depthMeasurement.image = image;
-  depthMeasurement.measurement.depthImage = depthFrame;
-  depthMeasurement.measurement.deliversKeypoints = false;
+  // Convert right away: the Mat may share the buffer of the ROS message,
+  // from here on only the pointer to the converted frame is copied.
+  DepthMeasurement depthMeasurement;
   depthMeasurement.timeStamp = stamp;
-
-  // cv::imshow("mydepth",depthMeasurement.measurement.depthImage);
-  // cv::waitKey(2);
+  depthMeasurement.depthFrame = depthMat2Image(depthFrame);
+  depthMeasurement.arrival = std::chrono::steady_clock::now();
 
   // Push data to the Queue.
-  const size_t depthQueueSize =
-      100; ///< Arbitrary number. ToDo -> fine-tune once integration time has
-            ///< been taken into account.
+  const size_t depthQueueSize = submapConfig_.scheduler.depthQueueSize;
   if (blocking_) {
     const bool result =
         depthMeasurements_.PushBlockingIfFull(depthMeasurement, depthQueueSize);
@@ -28,8 +131,10 @@ bool SupereightInterface::addDepthImage(const okvis::Time &stamp,
         depthMeasurement, depthQueueSize);
     cvNewSensorMeasurements_.notify_one();
 
-    if (result)
+    if (result) {
       LOG(WARNING) << "Oldest Depth measurement dropped";
+      stats_->addDrop(PipelineStats::Queue::Depth);
+    }
 
     return true;
   }
@@ -38,29 +143,44 @@ bool SupereightInterface::addDepthImage(const okvis::Time &stamp,
 
 bool SupereightInterface::dataReadyForProcessing() {
   // Get the timestamp of the oldest Depth frame
-  CameraMeasurement oldestDepthMeasurement;
+  // cheap: only the pointer to the frame is copied
+  DepthMeasurement oldestDepthMeasurement;
   if (!depthMeasurements_.getCopyOfFront(&oldestDepthMeasurement))
     return false;
 
-  OkvisUpdate newestState;
-  if (!stateUpdates_.getCopyOfBack(&newestState))
+  okvis::Time newestState;
+  if (!poseCache_.newest(newestState))
     return false;
 
-  return (oldestDepthMeasurement.timeStamp <= newestState.timestamp);
+  return (oldestDepthMeasurement.timeStamp <= newestState);
 }
 
-DepthFrame SupereightInterface::depthMat2Image(const cv::Mat &inputDepth) {
+std::shared_ptr<const DepthFrame> SupereightInterface::depthMat2Image(const cv::Mat &inputDepth) {
   
   // need to have float values like this 1.0 = 1 mt
   // if this is not the case, do this:
   //inputDepth.convertTo(depthScaled, CV_32FC1, 1.f / 1000.f);
+  assert(inputDepth.type() == CV_32FC1);
 
   // Initialise and copy
-  DepthFrame output(inputDepth.size().width, inputDepth.size().height, 0.f);
+  const int width = depthPreprocessor_.outputSize(inputDepth.cols);
+  const int height = depthPreprocessor_.outputSize(inputDepth.rows);
+  // pooled if it has the expected size. old content is overwritten below
+  std::shared_ptr<DepthFrame> output;
+  if (width == depthFrameWidth_ && height == depthFrameHeight_) output = depthFramePool_->acquire();
+  else output = std::make_shared<DepthFrame>(width, height);
 
   // cv::MAT and DepthFrame keep data stored in row major format.
-  memcpy(output.data(), inputDepth.data,
-         inputDepth.size().width * inputDepth.size().height * sizeof(float));
+  if (depthPreprocessor_.enabled()) {
+    // downsample / clip while copying
+    depthPreprocessor_.process(inputDepth.ptr<float>(0), inputDepth.cols, inputDepth.rows,
+                               inputDepth.step1(), output->data());
+  } else if (inputDepth.isContinuous()) {
+    memcpy(output->data(), inputDepth.data, width * height * sizeof(float));
+  } else {
+    for (int v = 0; v < height; v++)
+      memcpy(output->data() + v * width, inputDepth.ptr<float>(v), width * sizeof(float));
+  }
 
   return output;
 
@@ -80,55 +200,22 @@ cv::Mat SupereightInterface::depthImage2Mat(const DepthFrame &depthFrame) {
   return outputMat;
 }
 
-bool SupereightInterface::predict(const okvis::Time &finalTimestamp,
+bool SupereightInterface::predict(const PoseQuery &query,
                                   Transformation &T_WC,
                                   uint64_t &keyframeId,
-                                  KeyFrameDataVec &keyFrameDataVec,
                                   bool &loop_closure) {
 
-  // Get the okvis update closest to the finalTimestamp (the stamp of the depth frame)
-  // We use Okvis::trajectory to propagate state. Also need to use the updates queue bc we also need
-  // Updated kfs and all that other stuff that we need to build supereight frames
+  // return false if there's no pose at the stamp or no keyframe updates
+  if (!query.found || query.poseVersion == 0) return false;
 
-  OkvisUpdate initialStateData;
-  OkvisUpdate initialStateTemp;
-  while (stateUpdates_.getCopyOfFrontBlocking(&initialStateTemp)) {
-    // Check the timestamp
-    if (initialStateTemp.timestamp > finalTimestamp)
-      break;
-    initialStateData = initialStateTemp;
+  keyframeId = query.keyframeId;
 
-    // Pop from the Queue
-    stateUpdates_.PopNonBlocking(&initialStateTemp);
-  }
-
-  // return false if there's no keyframe updates
-  if (initialStateData.keyframeStates.empty()) return false;
-
-  if (initialStateData.isKeyframe || no_kf_yet) { // first update should always be keyframe, but lets be safe
-    no_kf_yet = false;
-    keyframeId = initialStateData.latestState.id.value();
-    latestKeyframeId = keyframeId;
-  }
-  else { 
-    keyframeId = latestKeyframeId;
-  }
-
-  // KF poses. 
-  keyFrameDataVec = KeyFrameDataVec(initialStateData.keyframeStates.size());
-  for (size_t i = 0; i < initialStateData.keyframeStates.size(); i++) {
-    const auto &state = initialStateData.keyframeStates[i];
-    keyFrameDataVec.at(i) = KeyframeData(state.id.value(), state.T_WS * T_SC_);
-  }
-
-  // Is current state a loop closure state?
-  loop_closure = initialStateData.loop_closure;
-
-  State propagatedState;
-  if(!propagatedStates.getState(finalTimestamp, propagatedState)) throw std::runtime_error("predict"); // check that this dont happn. then just return false
+  // any loop closure since the previous frame, also if its state came and went in between
+  loop_closure = query.loopClosures > loopClosuresSeen_;
+  loopClosuresSeen_ = query.loopClosures;
 
   // Predicted Pose
-  T_WC = propagatedState.T_WS * T_SC_;
+  T_WC = query.T_WS * T_SC_;
 
   return true;
 }
@@ -137,22 +224,33 @@ void SupereightInterface::processSupereightFrames() {
 
   // Wake Up on arrival of new measurements
   unsigned frame = 0;
+  // submap and frame count of the last active distance layer
+  uint64_t activeEsdfId = 0;
+  unsigned activeEsdfFrame = 0;
 
   while (true) {
 
     // Wait on Condition variable signaling
     std::unique_lock<std::mutex> lk(s8Mutex_);
-    cvNewSupereightData_.wait(lk, [&] { return supereightFrames_.Size(); });
+    cvNewSupereightData_.wait(lk, [&] { return supereightFrames_.Size() || shutdown_; });
+    if (shutdown_) return;
 
     // Get the supereight depth frame --> need to integrate it into a submap
     SupereightFrame supereightFrame;
     if (!supereightFrames_.PopNonBlocking(&supereightFrame))
       continue;
+    stats_->addDuration(PipelineStats::Stage::SupereightQueue,
+                        std::chrono::duration<double>(std::chrono::steady_clock::now() - supereightFrame.queued).count());
+
+    // submaps that made it to disk leave memory
+    if (releaseEvictedSubmaps()) mapSnapshotDirty_ = true;
 
-    //  Update pose lookup --> each time a new seframe arrives, it contains updated info on all kf poses.
-    //  we update here all poses
+    //  Update pose lookup --> only the kf poses that changed since the last frame are fetched from the store,
+    //  up to the version the frame was predicted with: newer ones could hold a correction its T_WC does not have
+    appliedPoseVersion_ = keyframePoses_.getChangedSince(appliedPoseVersion_, supereightFrame.poseVersion, changedPoses_);
 
-    for (auto &keyframeData : supereightFrame.keyFrameDataVec) {
+    std::unique_lock<std::mutex> lk_lookup(lookupMutex_);
+    for (auto &keyframeData : changedPoses_) {
 
     
       const uint64_t id = keyframeData.id;
@@ -166,18 +264,48 @@ void SupereightInterface::processSupereightFrames() {
         // Insert
         submapPoseLookup_.insert(std::make_pair(id, T_WM));
       }
+      movedSinceRehash_.insert(id);
     }
+    lk_lookup.unlock();
 
     // if a loop closure was detected, redo hashing
     if(supereightFrame.loop_closure) {
-      std::vector<uint64_t> ids;
-      for (auto &keyframeData : supereightFrame.keyFrameDataVec) {
-        uint64_t id = keyframeData.id;
-        if (!submapLookup_.count(keyframeData.id) || !submapPoseLookup_.count(keyframeData.id)) continue; 
+      // poses the submaps were last hashed with
+      std::unique_lock<std::mutex> lk_hash(hashTableMutex_);
+      const auto hashedPoses = submapHashedPoseLookup_;
+      lk_hash.unlock();
+
+      size_t skipped = 0;
+      // only the poses that changed since the last loop closure can need it
+      for (const uint64_t id : movedSinceRehash_) {
+        if (!submapLookup_.count(id) || !submapPoseLookup_.count(id)) continue; 
+        // only rehash submaps that actually moved
+        const auto hashed = hashedPoses.find(id);
+        if (hashed != hashedPoses.end() && !poseChanged(hashed->second, submapPoseLookup_[id])) {
+          skipped++;
+          continue;
+        }
         std::cout << "LC - Rehashing map " << id << "\n";
-        std::thread hashing_thread(&SupereightInterface::redoSpatialHashing, this, id, submapPoseLookup_[id], submapLookup_[id]);
-        hashing_thread.detach();
+        // a pending rehash of the same map is replaced (only the latest pose matters)
+        const Transformation T_WM = submapPoseLookup_[id];
+        const SubmapPtr map = *submapLookup_[id];
+        hashingPool_->push(SubmapJobPool::JobType::Rehash, id, [this, id, T_WM, map] {
+          // evicted maps are reloaded for the rehash
+          const SubmapPtr resident = map ? map : submapStore_->load(id);
+          if (resident) redoSpatialHashing(id, T_WM, resident);
+        });
+        if (map) {
+          lk_hash.lock();
+          touchSubmap(id);
+          lk_hash.unlock();
+        }
       }
+      if (skipped) std::cout << "LC - " << skipped << " maps did not move, not rehashed\n";
+      movedSinceRehash_.clear();
+
+      // the new poses go out with the next snapshot, without waiting for the rehashing
+      mapSnapshotDirty_ = true;
+      posesMoved_ = true;
     }
 
     // Chech whether we need to create a new submap. --> integrate in new or existing map?
@@ -190,28 +318,39 @@ void SupereightInterface::processSupereightFrames() {
 
     //compute distance from last keyframe:
     bool distant_enough = false;
+    lk_lookup.lock(); // may insert the poses of keyframes not seen yet
     const double distance = (submapPoseLookup_[supereightFrame.keyframeId].r() - submapPoseLookup_[prevKeyframeId].r()).norm();
-    if (distance > distThreshold_) distant_enough = true;
+    lk_lookup.unlock();
+    if (distance > submapConfig_.distThreshold) distant_enough = true;
 
-    // current kf has changed, and it is distant enough from last one
-    if ((supereightFrame.keyframeId != prevKeyframeId && distant_enough)|| submaps_.empty()) { 
+    // current kf has changed, and it is distant enough from last one or the active map is full
+    // (or nothing integrated yet: submaps_ may already hold the ones of a loaded session)
+    const bool have_active = submapLookup_.count(prevKeyframeId);
+    if ((supereightFrame.keyframeId != prevKeyframeId && (distant_enough || activeMapFull_)) || !have_active) { 
       
       // hash & save map we just finished integrating
       // 4 safety, check that submap exists in lookup
-      if (!submaps_.empty()) {
+      if (have_active) {
 
         std::cout << "Completed integrating submap " << prevKeyframeId << "\n";
 
-        // do the spatial hashing
-        std::thread hashing_thread(&SupereightInterface::doSpatialHashing, this, prevKeyframeId, submapPoseLookup_[prevKeyframeId], submapLookup_[prevKeyframeId]);
-        hashing_thread.detach();
-
-        const std::string meshFilename = meshesPath_ + "/" + std::to_string(prevKeyframeId) + ".ply";
-
-        (*(submapLookup_[prevKeyframeId]))->saveMesh(meshFilename);
-                
-        // call submap visualizer (it's threaded)
-        publishSubmaps();
+        // hashing and meshing run on the hashing pool: we go on integrating right away.
+        // the map is not touched here anymore. it is published once finalized, in this order
+        const uint64_t id = prevKeyframeId;
+        const Transformation T_WM = submapPoseLookup_[id];
+        const SubmapPtr map = *submapLookup_[id];
+        hashingPool_->push(SubmapJobPool::JobType::Finalize, id,
+                           [this, id, T_WM, map] { finalizeSubmap(id, T_WM, map); });
+        std::unique_lock<std::mutex> lk_finalized(finalizedMutex_);
+        finalizationQueue_.push_back(id);
+        lk_finalized.unlock();
+        std::unique_lock<std::mutex> lk_lru(hashTableMutex_);
+        touchSubmap(id);
+        lk_lru.unlock();
+
+        // keep the resident maps within budget (the one just finished counts once hashed).
+        // the scan itself runs on the hashing pool
+        evictSubmaps(supereightFrame.T_WC.r());
       }
 
       // create new map
@@ -219,26 +358,39 @@ void SupereightInterface::processSupereightFrames() {
       submap_counter ++;
       std::cout << "New submap no. " << submap_counter << " (kf Id: " << supereightFrame.keyframeId << ")" << "\n";
 
-      // Create a new submap and reset frame counter
-      submaps_.emplace_back(
-          new se::OccupancyMap<se::Res::Multi>(mapConfig_, dataConfig_));
+      // Take the pre-allocated submap and reset frame counter
+      SubmapPtr spare = takeSpareSubmap();
+      lk_lookup.lock();
+      submaps_.push_back(std::move(spare));
+      finestRes_ = finestRes_ > 0 ? std::min(finestRes_, submaps_.back()->getRes()) : submaps_.back()->getRes();
       frame = 0;
+      activeMapFull_ = false;
+      if (submapConfig_.adaptiveResolution)
+        std::cout << "  res " << submaps_.back()->getRes() << " m, dim " << submaps_.back()->getDim().transpose() << " m\n";
 
       // Add the (keyframe Id, iterator) pair in the submapLookup_
       // We are adding the map that is curently being integrated (submaps back)
       submapLookup_.insert(std::make_pair(supereightFrame.keyframeId,
                                           std::prev(submaps_.end())));
+      lk_lookup.unlock();
+      activeIntegrator_.reset(new se::MapIntegrator<se::OccupancyMap<se::Res::Multi>>(*submaps_.back()));
 
       // do a preliminary hashing (allocate 10x10x10 box in hash table)
       // we do this so that we can plan even while integrating current map
-      std::thread prelim_hashing_thread(&SupereightInterface::doPrelimSpatialHashing, this, supereightFrame.keyframeId, submapPoseLookup_[supereightFrame.keyframeId].r());
-      prelim_hashing_thread.detach();
+      const uint64_t newId = supereightFrame.keyframeId;
+      const Eigen::Vector3d pos_kf = submapPoseLookup_[newId].r();
+      hashingPool_->push(SubmapJobPool::JobType::Prelim, newId, [this, newId, pos_kf] { doPrelimSpatialHashing(newId, pos_kf); });
 
-      // now we integrate in this keyframe, until we find a new one that is distant enough
+      // now we integrate in this keyframe, until we find a new one that is distant enough.
+      // the lookups are published once its preliminary hashing is done
       prevKeyframeId = supereightFrame.keyframeId;
 
       }
 
+      // Publish the planner lookups once per submap change (new submap or finished hashing),
+      // then the finalized submaps with the same lookups. Built on the hashing pool
+      if (mapSnapshotDirty_.exchange(false)) requestMapSnapshot();
+
       // =========== END Current KF has changed ===========
 
       // Integrate in the map tied to current keyframe
@@ -247,26 +399,48 @@ void SupereightInterface::processSupereightFrames() {
       // can use the lookup bc every time a new submap is created, its also inserted there
       auto &activeMap = *(submapLookup_[prevKeyframeId]);
 
-      se::MapIntegrator integrator(
-          *activeMap); //< ToDo -> Check how fast this constructor is
+      // full: no more blocks are allocated in it, frames wait for the next submap
+      if (!activeMapFull_) {
+        Eigen::Matrix4f T_KC = (submapPoseLookup_[prevKeyframeId].T().inverse() * supereightFrame.T_WC.T()).cast<float>();
+
+        const auto integration_start = std::chrono::steady_clock::now();
+        activeIntegrator_->integrateDepth(sensor_, *supereightFrame.depthFrame,
+                                  T_KC, frame);
+        frame++;
+
+        // feed the frame scheduler
+        const auto integration_end = std::chrono::steady_clock::now();
+        const double integrationTime = std::chrono::duration<double>(integration_end - integration_start).count();
+        const double latency = std::chrono::duration<double>(integration_end - supereightFrame.arrival).count();
+        scheduler_.reportIntegration(integrationTime, latency);
+        stats_->addDuration(PipelineStats::Stage::Integration, integrationTime);
+        stats_->addDuration(PipelineStats::Stage::EndToEnd, latency);
+
+        // memory cap, checked every few frames (it walks the octree)
+        const size_t budget = static_cast<size_t>(submapConfig_.submapMemoryBudget * 1024.0 * 1024.0);
+        if (budget && frame % 10 == 0 && measureActiveSubmap(prevKeyframeId, *activeMap).bytes > budget) {
+          activeMapFull_ = true;
+          LOG(WARNING) << "Submap " << prevKeyframeId << " reached its memory budget, integration paused until the next submap";
+        }
+      }
 
-      Eigen::Matrix4f T_KC = (submapPoseLookup_[prevKeyframeId].T().inverse() * supereightFrame.T_WC.T()).cast<float>();
-      
-      integrator.integrateDepth(sensor_, supereightFrame.depthFrame,
-                                T_KC, frame);
-      frame++;
+      // the planner asked for the distance layer of the map we are integrating.
+      // we are the only ones touching the active map, so compute it here. it is a dense pass
+      // over the whole map that holds up integration: at most once every activeEsdfInterval
+      // frames integrated into it, requests in between wait for that
+      if (activeEsdfRequested_ && (prevKeyframeId != activeEsdfId || frame >= activeEsdfFrame + submapConfig_.activeEsdfInterval)) {
+        activeEsdfRequested_ = false;
+        activeEsdfId = prevKeyframeId;
+        activeEsdfFrame = frame;
+        auto esdf = SubmapEsdf::compute(*activeMap, computeMapBounds(*activeMap), submapConfig_.esdfMaxDistance);
+        std::unique_lock<std::mutex> lk_esdf(hashTableMutex_);
+        submapEsdfLookup_[prevKeyframeId] = esdf;
+        lk_esdf.unlock();
+        mapSnapshotDirty_ = true;
+      }
 
-      // const auto current_time = std::chrono::high_resolution_clock::now();
-      // // Some couts, remove when done debugging.
-      // std::cout << "Processing delay\t"
-      //           << (std::chrono::duration_cast<std::chrono::milliseconds>(
-      //                   current_time - start_time))
-      //                  .count()
-      //           << "\t Integrated frames: " << frame
-      //           << "\tS8 Fr: " << supereightFrames_.Size()
-      //           << "\t submaps: " << submaps_.size()
-      //           << "\t Okvis Upd: " << stateUpdates_.Size()
-      //           << "\tDepth Fr: " << depthMeasurements_.Size() << std::endl;
+      // same for the memory statistics
+      if (activeMemoryRequested_.exchange(false)) measureActiveSubmap(prevKeyframeId, *activeMap);
 
   }
 }
@@ -276,41 +450,82 @@ void SupereightInterface::pushSuperEightData() {
   while (true) {
     std::unique_lock<std::mutex> lk(cvMutex_);
     cvNewSensorMeasurements_.wait(
-        lk, [&] { return this->dataReadyForProcessing(); });
-
-    // Get the depth Image and convert to supereight format.
-    CameraMeasurement depthMeasurement;
-    if (!depthMeasurements_.PopNonBlocking(&depthMeasurement))
-      continue;
+        lk, [&] { return shutdown_ || this->dataReadyForProcessing(); });
+    if (shutdown_) return;
+
+    // All the depth frames (already in supereight format) that have a pose by now.
+    okvis::Time newestState;
+    if (!poseCache_.newest(newestState)) continue;
+    depthBatch_.clear();
+    DepthMeasurement front;
+    while (depthMeasurements_.getCopyOfFront(&front) && front.timeStamp <= newestState) {
+      depthMeasurements_.PopNonBlocking(&front);
+      depthBatch_.push_back(front);
+    }
+    if (depthBatch_.empty()) continue;
+
+    // Interpolate the poses of the whole batch from the okvis states, in one lookup.
+    const auto prediction_start = std::chrono::steady_clock::now();
+    poseQueries_.resize(depthBatch_.size());
+    for (size_t i = 0; i < depthBatch_.size(); i++) poseQueries_[i].timestamp = depthBatch_[i].timeStamp;
+    poseCache_.lookup(poseQueries_);
+    poseCache_.release(depthBatch_.back().timeStamp);
+    const auto prediction_end = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < depthBatch_.size(); i++) {
+      const DepthMeasurement &depthMeasurement = depthBatch_[i];
+
+      // queue depths, sampled once per depth frame
+      stats_->addQueueDepth(PipelineStats::Queue::Depth, depthMeasurements_.Size() + depthBatch_.size() - i - 1);
+      stats_->addQueueDepth(PipelineStats::Queue::State, poseCache_.size());
+      stats_->addQueueDepth(PipelineStats::Queue::Supereight, supereightFrames_.Size());
+
+      // each frame of the batch waited for the whole lookup
+      stats_->addDuration(PipelineStats::Stage::DepthQueue,
+                          std::chrono::duration<double>(prediction_start - depthMeasurement.arrival).count());
+      stats_->addDuration(PipelineStats::Stage::Prediction,
+                          std::chrono::duration<double>(prediction_end - prediction_start).count());
+      Transformation T_WC;
+      uint64_t lastKeyframeId;
+      bool loop_closure;
+      if (!predict(poseQueries_[i], T_WC, lastKeyframeId,
+                   loop_closure)) continue;
+
+      // integration falling behind: maybe skip the frame. loop closures must get through, and
+      // blocking runs never skip (what gets integrated must not depend on the wall clock)
+      const double waited = std::chrono::duration<double>(prediction_end - depthMeasurement.arrival).count();
+      if (!scheduler_.accept(T_WC, lastKeyframeId, waited, supereightFrames_.Size(), loop_closure || blocking_)) {
+        stats_->addSkip();
+        continue;
+      }
 
-    // Compute the respective pose using the okvis updates and the IMU
-    // measurements.
-    Transformation T_WC;
-    uint64_t lastKeyframeId;
-    KeyFrameDataVec keyFrameDataVec;
-    bool loop_closure;
-    if (!predict(depthMeasurement.timeStamp, T_WC, lastKeyframeId,
-                 keyFrameDataVec, loop_closure)) continue;
-
-    // Construct Supereight Frame and push to the corresponding Queue
-    const SupereightFrame supereightFrame(
-        T_WC,
-        depthMat2Image(depthMeasurement.measurement.depthImage), lastKeyframeId,
-        keyFrameDataVec, loop_closure);
-
-    // Push to the Supereight Queue.
-    const size_t supereightQueueSize = 500; ///< ToDo -> Benchmark supereight.
-    if (blocking_) {
-      supereightFrames_.PushBlockingIfFull(
-          supereightFrame, supereightQueueSize);
-      cvNewSupereightData_.notify_one();
-    } else {
-      // Push measurement and pop the oldest entry.
-      const bool result = supereightFrames_.PushNonBlockingDroppingIfFull(
-          supereightFrame, supereightQueueSize);
-      cvNewSupereightData_.notify_one();
-      if (result)
-        LOG(WARNING) << "Oldest Supereight frame dropped";
+      // the frame goes in: it counts for the scale of the next submaps
+      if (submapConfig_.adaptiveResolution) updateSceneStatistics(*depthMeasurement.depthFrame, poseQueries_[i].v_W);
+
+      // Construct Supereight Frame and push to the corresponding Queue
+      SupereightFrame supereightFrame(
+          T_WC,
+          depthMeasurement.depthFrame, lastKeyframeId,
+          loop_closure, depthMeasurement.arrival);
+      supereightFrame.poseVersion = poseQueries_[i].poseVersion;
+      supereightFrame.queued = std::chrono::steady_clock::now();
+
+      // Push to the Supereight Queue.
+      const size_t supereightQueueSize = submapConfig_.scheduler.supereightQueueSize;
+      if (blocking_) {
+        supereightFrames_.PushBlockingIfFull(
+            supereightFrame, supereightQueueSize);
+        cvNewSupereightData_.notify_one();
+      } else {
+        // Push measurement and pop the oldest entry.
+        const bool result = supereightFrames_.PushNonBlockingDroppingIfFull(
+            supereightFrame, supereightQueueSize);
+        cvNewSupereightData_.notify_one();
+        if (result) {
+          LOG(WARNING) << "Oldest Supereight frame dropped";
+          stats_->addDrop(PipelineStats::Queue::Supereight);
+        }
+      }
     }
   }
 }
@@ -321,6 +536,9 @@ bool SupereightInterface::start() {
 
   timeZero_ = okvis::Time::now();
 
+  // the first submap is allocated while okvis initialises
+  prepareSpareSubmap(1.f);
+
   // STart the thread that prepares the Converts the Data in Supereight
   // format
   dataPreparationThread_ =
@@ -335,15 +553,15 @@ bool SupereightInterface::start() {
 void SupereightInterface::display() {
 
   // Display the Depth frame.
-  CameraMeasurement depthMeasurement;
+  DepthMeasurement depthMeasurement;
   if (depthMeasurements_.getCopyOfFront(&depthMeasurement)) {
-    cv::imshow("Depth", depthMeasurement.measurement.depthImage);
+    cv::imshow("Depth", depthImage2Mat(*depthMeasurement.depthFrame));
   }
 
   //Display from the seframes queue
   SupereightFrame SupereightFrame_;
   if (supereightFrames_.getCopyOfFront(&SupereightFrame_)) {
-    cv::imshow("seframe", depthImage2Mat(SupereightFrame_.depthFrame));
+    cv::imshow("seframe", depthImage2Mat(*SupereightFrame_.depthFrame));
   }
 }
 
@@ -351,129 +569,309 @@ bool SupereightInterface::stateUpdateCallback(
     const State &latestState, const TrackingState &latestTrackingState,
     std::shared_ptr<const okvis::AlignedVector<State>> keyframeStates) {  
 
-  // Assemble OKVIS updates in a struct and push in the corresponding Queue.
-  OkvisUpdate latestStateData(latestState, 
-                              *keyframeStates,
-                              latestState.timestamp,
-                              latestTrackingState.isKeyframe,
-                              latestTrackingState.currentKeyframeId.value(),
-                              latestTrackingState.recognisedPlace);
-  const size_t stateUpdateQueue = 100; ///< 5 seconds of data at 20Hz.
-
-  std::set<StateId> affectedStateIds; // dummy, output needed by okvis trajectory
-  // okvis trajectory should still work if i pass only updated keyframes (and not the whole updated states vector)
-  propagatedStates.update(latestState, latestTrackingState, keyframeStates, affectedStateIds);
+  // Keyframe poses go to the store: consumers only fetch the ones that changed.
+  const uint64_t poseVersion = keyframePoses_.update(*keyframeStates);
 
-  if (blocking_) {
-    const bool result = stateUpdates_.PushBlockingIfFull(latestStateData, stateUpdateQueue);
-    cvNewSensorMeasurements_.notify_one();
-    return result;
-  } else {
-    if (stateUpdates_.PushNonBlockingDroppingIfFull(latestStateData,
-                                                    stateUpdateQueue)) {
-      // Oldest measurement dropped
-      LOG(WARNING) << "Oldest state  measurement dropped";
-      cvNewSensorMeasurements_.notify_one();
-      return true;
-    }
+  // Into the pose cache, with the keyframe poses it goes with: blocks in blocking mode until the
+  // states are no longer needed.
+  if (poseCache_.add(latestState, latestTrackingState.isKeyframe, latestTrackingState.recognisedPlace, poseVersion)) {
+    // Oldest state overwritten before its depth frames got their pose
+    LOG(WARNING) << "Oldest state measurement dropped";
+    stats_->addDrop(PipelineStats::Queue::State);
   }
+  cvNewSensorMeasurements_.notify_one();
 
-  return false;
+  return true;
 }
 
 void SupereightInterface::publishSubmaps()
+{
+  publishSubmaps(getMapSnapshot());
+}
+
+void SupereightInterface::publishSubmaps(const std::shared_ptr<const MapSnapshot> &snapshot,
+                                         const uint64_t id, const std::shared_ptr<const SubmapMesh> &mesh)
 {
 
  if (submapCallback_) 
   {
-    std::thread publish_submaps(submapCallback_, submapPoseLookup_, submapLookup_);
+    // the snapshot is shared with the thread, the lookups are not copied
+    std::thread publish_submaps([callback = submapCallback_, stats = stats_, id, snapshot] {
+      const auto start = std::chrono::steady_clock::now();
+      callback(id, snapshot->submapPoseLookup, snapshot->submapLookup);
+      stats->addDuration(PipelineStats::Stage::Publishing,
+                         std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    });
     publish_submaps.detach();
   }  
 
   if (submapMeshesCallback_) 
   {
-    std::thread publish_meshes(submapMeshesCallback_, submapPoseLookup_);
+    std::thread publish_meshes([callback = submapMeshesCallback_, stats = stats_, id, mesh, snapshot] {
+      const auto start = std::chrono::steady_clock::now();
+      callback(id, mesh, snapshot->submapPoseLookup);
+      stats->addDuration(PipelineStats::Stage::Publishing,
+                         std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    });
     publish_meshes.detach();
   }  
 }
 
-void SupereightInterface::fixReadLookups()
+void SupereightInterface::publishFinalizedSubmaps()
 {
-  submapLookup_read = submapLookup_;
-  submapPoseLookup_read = submapPoseLookup_;
-  hashTable_read = hashTable_;
+  const std::shared_ptr<const MapSnapshot> snapshot = getMapSnapshot();
+
+  // in the order the submaps were completed: a finalized one waits for the ones before it
+  std::lock_guard<std::mutex> lk(finalizedMutex_);
+  while (!finalizationQueue_.empty()) {
+    const auto finalized = finalizedSubmaps_.find(finalizationQueue_.front());
+    if (finalized == finalizedSubmaps_.end()) break;
+    publishSubmaps(snapshot, finalized->first, finalized->second);
+    finalizedSubmaps_.erase(finalized);
+    finalizationQueue_.pop_front();
+  }
 }
 
-// dont change pass by value
-void SupereightInterface::redoSpatialHashing(const uint64_t id, const Transformation Tf, const SubmapList::iterator map) 
-{   
+void SupereightInterface::prepareSpareSubmap(const float scale)
+{
+  // one allocation at a time, in the background
+  hashingPool_->push(SubmapJobPool::JobType::Allocate, kSpareSubmapId, [this, scale] {
+    auto map = std::make_shared<se::OccupancyMap<se::Res::Multi>>(scaledMapConfig(scale), dataConfig_);
+    std::lock_guard<std::mutex> lk(spareMutex_);
+    spareSubmap_ = std::move(map);
+    spareScale_ = scale;
+  });
+}
 
-  std::unique_lock<std::mutex> lk(hashTableMutex_);
+SubmapPtr SupereightInterface::takeSpareSubmap()
+{
+  const float scale = newSubmapScale();
 
-  Eigen::Matrix4f T_KM = (*(map))->getTWM();
-  Eigen::Matrix4d T_WK = Tf.T();
-  Eigen::Matrix4f T_WM = T_WK.cast<float>() * T_KM;
+  std::unique_lock<std::mutex> lk(spareMutex_);
+  SubmapPtr map = std::move(spareSubmap_);
+  if (spareScale_ != scale) map.reset(); // the scene changed since
+  lk.unlock();
 
-  // sanity checks
-  if (!submapDimensionLookup_.count(id) || !hashTableInverse_.count(id))
-  throw std::runtime_error("redospatialhashing");
+  // not allocated yet (first submap, or submaps finished faster than allocated): allocate here
+  if (!map) map = std::make_shared<se::OccupancyMap<se::Res::Multi>>(scaledMapConfig(scale), dataConfig_);
+  prepareSpareSubmap(scale);
+  return map;
+}
 
-  // get map bounds
-  Eigen::Matrix<float,6,1> bounds = submapDimensionLookup_[id]; 
+float SupereightInterface::newSubmapScale() const
+{
+  // no depth seen yet: the map config as is
+  const float depth = recentDepth_;
+  if (depth <= 0) return 1.f;
+  return submapConfig_.submapScale(mapConfig_.res, depth + recentSpeed_ * submapConfig_.adaptiveSpeedHorizon);
+}
 
-  Eigen::Vector3f min_box_metres = {bounds(0),bounds(1),bounds(2)};
-  Eigen::Vector3f max_box_metres = {bounds(3),bounds(4),bounds(5)};
+se::MapConfig SupereightInterface::scaledMapConfig(const float scale) const
+{
+  // the octree keeps its size in voxels, the map stays centred the same way
+  se::MapConfig config = mapConfig_;
+  config.res *= scale;
+  config.dim *= scale;
+  config.T_MW.topRightCorner<3,1>() *= scale;
+  return config;
+}
 
-  // remove boxes for "id" submap
-  for (auto &pos : hashTableInverse_[id])
-  {
-    hashTable_[pos].erase(id); // remove id from box
-    hashTableInverse_[id].erase(pos); // remove box from id
-  }  
+void SupereightInterface::updateSceneStatistics(const DepthFrame &depthFrame, const Eigen::Vector3d &v_W)
+{
+  // median of the valid pixels of a sparse grid
+  const int step = 8;
+  depthSamples_.clear();
+  for (int v = step / 2; v < depthFrame.height(); v += step) {
+    for (int u = step / 2; u < depthFrame.width(); u += step) {
+      const float depth = depthFrame[v * depthFrame.width() + u];
+      if (depth > 0 && std::isfinite(depth)) depthSamples_.push_back(depth);
+    }
+  }
+  if (depthSamples_.empty()) return;
+  auto median = depthSamples_.begin() + depthSamples_.size() / 2;
+  std::nth_element(depthSamples_.begin(), median, depthSamples_.end());
+
+  // smoothed over roughly the last second of integrated frames
+  const float alpha = 0.05f;
+  const float depth = recentDepth_;
+  recentDepth_ = depth > 0 ? (1 - alpha) * depth + alpha * *median : *median;
+  recentSpeed_ = (1 - alpha) * recentSpeed_ + alpha * static_cast<float>(v_W.norm());
+}
 
-  const float side = 1.0; // hardcoded hash map box side of 1m
-  const float step = 0.5 * side * sqrt(2); // this ensures full cover of submap space
+void SupereightInterface::publishMapSnapshot()
+{
+  auto snapshot = std::make_shared<MapSnapshot>();
+  snapshot->version = getMapSnapshot()->version + 1;
+  snapshot->hashCellSize = submapConfig_.hashCellSize;
+  snapshot->submapStore = submapStore_;
+
+  // the processing thread writes the lookups, lock only for the copy
+  std::unique_lock<std::mutex> lk_lookup(lookupMutex_);
+  snapshot->finestRes = finestRes_;
+  snapshot->submapLookup = residentSubmaps();
+  snapshot->submapPoseLookup = submapPoseLookup_;
+  lk_lookup.unlock();
+  for (const auto &pose : snapshot->submapPoseLookup)
+    snapshot->submapInversePoseLookup.emplace(pose.first, pose.second.T().inverse());
+
+  // hashing threads write the table, same
+  std::unique_lock<std::mutex> lk(hashTableMutex_);
+  snapshot->hashTable = hashTable_;
+  snapshot->submapEsdfLookup = submapEsdfLookup_;
+  snapshot->submapHashedPoseLookup = submapHashedPoseLookup_;
+  lk.unlock();
 
+  // a loop closure publishes the new poses before the submaps are rehashed (if they are at
+  // all): the box flags of the ones that moved must not be trusted until then
+  snapshot->findMovedSubmaps(submapConfig_.rehashTranslationTol, submapConfig_.rehashRotationTol);
 
-  for (float x = min_box_metres(0); x <= max_box_metres(0); x+=step)
-  {
-    for (float y = min_box_metres(1); y <= max_box_metres(1); y+=step)
-    {
-      for (float z = min_box_metres(2); z <= max_box_metres(2); z+=step) 
-      {
-        
-        // get offset value (this pos is in map frame)
-        Eigen::Vector4f pos_map(x,y,z,1);
+  // readers holding the old snapshot keep it alive until they are done
+  std::atomic_store(&mapSnapshot_, std::shared_ptr<const MapSnapshot>(std::move(snapshot)));
+}
 
-        // transform into world frame
-        Eigen::Vector4f pos_world;
-        pos_world = T_WM * pos_map;
+void SupereightInterface::requestMapSnapshot()
+{
+  // one at a time under their own id: snapshots and submaps come out in order
+  hashingPool_->push(SubmapJobPool::JobType::Snapshot, kSnapshotJobId, [this] {
+    publishMapSnapshot();
+    publishFinalizedSubmaps();
+    // and the submap frames after a loop closure (pose update only)
+    if (posesMoved_.exchange(false)) publishSubmaps(getMapSnapshot());
+  });
+}
 
-        // floor transformed value
-        Eigen::Vector3i pos_floor;
-        for (int i = 0 ; i < 3 ; i++)
-        {
-          // if side is e.g. 2, a value of 4.5,4.5,4.5 is mapped to box 2,2,2
-          pos_floor(i) = (int)(floor(pos_world(i)/side));
-        }
+OctreeMemory SupereightInterface::measureActiveSubmap(const uint64_t id, const se::OccupancyMap<se::Res::Multi> &map)
+{
+  SubmapMemory memory;
+  memory.id = id;
+  memory.res = map.getRes();
+  memory.active = true;
+  memory.octree = SubmapStore::octreeMemory(map);
+
+  std::lock_guard<std::mutex> lk(hashTableMutex_);
+  activeMemory_ = memory;
+  return memory.octree;
+}
 
-        // add to index 
-        hashTable_[pos_floor].insert(id);
+namespace {
 
-        // add pos to inverse index
-        hashTableInverse_[id].insert(pos_floor);
-      }
+// payload of a hash map: one node per entry plus the bucket array
+template <typename Map>
+size_t lookupBytes(const Map &lookup)
+{
+  return lookup.size() * (sizeof(typename Map::value_type) + sizeof(void *)) + lookup.bucket_count() * sizeof(void *);
+}
+
+}
+
+MemoryStats SupereightInterface::getMemoryStats()
+{
+  MemoryStats stats;
+  stats.stamp = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+  // measured by the processing thread after its next frame, for the following call
+  activeMemoryRequested_ = true;
+
+  std::unique_lock<std::mutex> lk(hashTableMutex_);
+  for (const auto &submap : submapMemoryStats_) stats.submaps.push_back(submap.second);
+  // once finalized, the active submap is in the lookup
+  if (activeMemory_.active && !submapMemoryStats_.count(activeMemory_.id)) stats.submaps.push_back(activeMemory_);
+
+  stats.hashCells = hashTable_.size();
+  stats.hashCapacity = hashTable_.capacity();
+  stats.hashLoadFactor = hashTable_.loadFactor();
+  stats.hashBytes = hashTable_.memoryUsage();
+  stats.hashInverseBytes = lookupBytes(hashTableInverse_);
+  for (const auto &cells : hashTableInverse_) stats.hashInverseBytes += cells.second.capacity() * sizeof(SpatialHash::Key);
+  for (const auto &esdf : submapEsdfLookup_) stats.esdfBytes += esdf.second->memoryUsage();
+  lk.unlock();
+
+  std::sort(stats.submaps.begin(), stats.submaps.end(),
+            [](const SubmapMemory &a, const SubmapMemory &b) { return a.id < b.id; });
+  for (const SubmapMemory &submap : stats.submaps) {
+    if (!submap.resident) {
+      stats.evicted++;
+      continue;
     }
-  }    
+    stats.resident.blocks += submap.octree.blocks;
+    stats.resident.nodes += submap.octree.nodes;
+    stats.resident.bytes += submap.octree.bytes;
+  }
+  if (submapStore_) stats.bytesOnDisk = submapStore_->stats().bytesOnDisk;
+
+  // each publication copies the hash table and the lookups. submaps and distance layers are shared
+  const std::shared_ptr<const MapSnapshot> snapshot = getMapSnapshot();
+  stats.snapshotVersion = snapshot->version;
+  stats.snapshotBytes = snapshot->hashTable.memoryUsage() + lookupBytes(snapshot->submapLookup)
+                      + lookupBytes(snapshot->submapPoseLookup) + lookupBytes(snapshot->submapInversePoseLookup)
+                      + lookupBytes(snapshot->submapEsdfLookup) + lookupBytes(snapshot->submapHashedPoseLookup)
+                      + lookupBytes(snapshot->movedSubmaps);
+
+  stats.depthQueueFrames = depthMeasurements_.Size();
+  stats.supereightQueueFrames = supereightFrames_.Size();
+  stats.depthFrameBytes = static_cast<size_t>(depthFrameWidth_) * depthFrameHeight_ * sizeof(float);
+  stats.depthPoolFrames = depthFramePool_->size();
+  stats.depthPoolMisses = depthFramePool_->misses();
+  stats.poseCacheBytes = poseCache_.memoryUsage();
+  return stats;
+}
+
+bool SupereightInterface::saveHashTable(const std::string &filename)
+{
+  std::ofstream file(filename);
+  if (!file.good()) return false;
+
+  std::unique_lock<std::mutex> lk(hashTableMutex_);
+  hashTable_.forEachCell([&](const SpatialHash::Key key, const SpatialHash::Cell &cell) {
+    const Eigen::Vector3i pos = SpatialHash::unpack(key);
+    hashTable_.forEachId(cell, [&](const int id) {
+      file << pos(0) << "," << pos(1) << "," << pos(2) << "," << id << "\n";
+    });
+  });
+  lk.unlock();
+
+  return file.good();
+}
+
+// dont change pass by value
+void SupereightInterface::redoSpatialHashing(const uint64_t id, const Transformation Tf, const SubmapPtr map) 
+{   
+
+  Eigen::Matrix4f T_KM = map->getTWM();
+  Eigen::Matrix4d T_WK = Tf.T();
+  Eigen::Matrix4f T_WM = T_WK.cast<float>() * T_KM;
+
+  // get map bounds
+  std::unique_lock<std::mutex> lk(hashTableMutex_);
 
+  // sanity checks
+  if (!submapDimensionLookup_.count(id) || !hashTableInverse_.count(id))
+  throw std::runtime_error("redospatialhashing");
+
+  const Eigen::Matrix<float,6,1> bounds = submapDimensionLookup_[id]; 
+
+  // the preliminary box of the map being integrated: don't touch its octree
+  const bool finalised = submapHashedPoseLookup_.count(id);
   lk.unlock();
 
+  // new boxes, computed without holding the lock
+  std::vector<SpatialHash::Key> cells = computeSubmapCells(*map, bounds, T_WM, finalised && submapConfig_.hashObservedBlocksOnly);
+  const std::vector<uint8_t> flags = finalised ? computeCellFlags(*map, cells, T_WM, submapConfig_.hashCellSize) : std::vector<uint8_t>();
+
+  lk.lock();
+  applySubmapCells(id, std::move(cells), flags);
+  if (finalised) submapHashedPoseLookup_[id] = Tf; // the active map is always rehashed
+  lk.unlock();
+
+  // publish the new lookups now: the processing thread may not see another frame
+  requestMapSnapshot();
+
 }
 // pass by value needed
 void SupereightInterface::doPrelimSpatialHashing(const uint64_t id, const Eigen::Vector3d pos_kf)
 {
 
-  const int side = 1; // step (in metre)s of the spatial grid
+  const float side = submapConfig_.hashCellSize; // step (in metre)s of the spatial grid
   const int box_side = 10; // dim of the box we'll allocate
   
   // box dims, in metres
@@ -493,52 +891,512 @@ void SupereightInterface::doPrelimSpatialHashing(const uint64_t id, const Eigen:
     max_box(i) = floor((pos_kf(i) + box_side)/side);
   }
 
-  std::unique_lock<std::mutex> lk(hashTableMutex_);
-
-  // add dimensions in lookup
-  // should be relative to map frame but who cares... this is just a big box
-  // this needs to be in metres instead
-  submapDimensionLookup_.insert(std::make_pair(id,dims.cast<float>()));
-
   // index the box, without caring about orientation.
   // its just a dumb hack to allow planning for current submap
+  std::vector<SpatialHash::Key> cells;
   for (int x = min_box(0); x <= max_box(0); x+=1)
     {
       for (int y = min_box(1); y <= max_box(1); y+=1)
       {
         for (int z = min_box(2); z <= max_box(2); z+=1) 
         {
-          Eigen::Vector3i pos(x,y,z);
-
-          // add to index 
-          hashTable_[pos].insert(id);
-
-          // add pos to inverse index
-          hashTableInverse_[id].insert(pos);
+          cells.push_back(SpatialHash::pack(Eigen::Vector3i(x,y,z)));
         }
       }
     }        
+  std::sort(cells.begin(), cells.end());
+
+  std::unique_lock<std::mutex> lk(hashTableMutex_);
+
+  // add dimensions in lookup
+  // should be relative to map frame but who cares... this is just a big box
+  // this needs to be in metres instead
+  submapDimensionLookup_.insert(std::make_pair(id,dims.cast<float>()));
+
+  applySubmapCells(id, std::move(cells));
 
   lk.unlock();
 
+  // publish the new lookups now: the processing thread may not see another frame
+  requestMapSnapshot();
+
 }
 
 // do not change pass by value
-void SupereightInterface::doSpatialHashing(const uint64_t id, const Transformation Tf, const SubmapList::iterator map) 
+void SupereightInterface::doSpatialHashing(const uint64_t id, const Transformation Tf, const SubmapPtr map) 
 { 
 
-  Eigen::Vector3i min_box(1000,1000,1000);
-  Eigen::Vector3i max_box(-1000,-1000,-1000);
-
   // ======== get bounding box dimensions (in map frame) ========
 
-  auto octree_ptr = (*map)->getOctree();
+  const Eigen::Matrix<float,6,1> dims = computeMapBounds(*map);
 
-  auto resolution = (*map)->getRes();
-  Eigen::Matrix4f T_KM = (*map)->getTWM();
+  // now I have the bounding box in metres, wrt the map frame.
+  // this frame is separated from the real world frame by: Twk*Tkm
+  // so to do hashing we must transform this box to the world frame by using this transformation
+  // just like I did before with the stupid hashing. but with a double transformation
+  Eigen::Matrix4f T_KM = map->getTWM();
   Eigen::Matrix4d T_WK = Tf.T();
   Eigen::Matrix4f T_WM = T_WK.cast<float>() * T_KM;
 
+  std::vector<SpatialHash::Key> cells = computeSubmapCells(*map, dims, T_WM, submapConfig_.hashObservedBlocksOnly);
+  const std::vector<uint8_t> flags = computeCellFlags(*map, cells, T_WM, submapConfig_.hashCellSize);
+
+  // distance layer of the finished map, computed before taking the lock
+  std::shared_ptr<const SubmapEsdf> esdf;
+  if (submapConfig_.useEsdf) esdf = SubmapEsdf::compute(*map, dims, submapConfig_.esdfMaxDistance);
+
+  // the map won't grow anymore: its size is final
+  SubmapMemory memory;
+  memory.id = id;
+  memory.res = map->getRes();
+  memory.octree = SubmapStore::octreeMemory(*map);
+
+  std::unique_lock<std::mutex> lk(hashTableMutex_);
+
+  // replace the preliminary indexing we did when creating map (we indexed a 10x10x10 box).
+  // only the boxes that differ are touched
+  applySubmapCells(id, std::move(cells), flags);
+  submapHashedPoseLookup_[id] = Tf;
+
+  // insert map bounds in the lookup
+  submapDimensionLookup_[id] = dims;
+
+  // replaces the one of the active map, if any
+  if (esdf) submapEsdfLookup_[id] = esdf;
+
+  // makes it a candidate for eviction
+  submapMemoryStats_[id] = memory;
+  if (submapStore_) {
+    residentBytes_ += memory.octree.bytes - submapMemoryLookup_[id];
+    submapMemoryLookup_[id] = memory.octree.bytes;
+  }
+
+  lk.unlock();
+
+  // published by finalizeSubmap, once the submap is meshed too
+
+}
+
+void SupereightInterface::finalizeSubmap(const uint64_t id, const Transformation Tf, const SubmapPtr map)
+{
+  // bounds, hash boxes and distance layer
+  const auto hashing_start = std::chrono::steady_clock::now();
+  doSpatialHashing(id, Tf, map);
+  const auto hashing_end = std::chrono::steady_clock::now();
+  stats_->addDuration(PipelineStats::Stage::Hashing, std::chrono::duration<double>(hashing_end - hashing_start).count());
+
+  // meshed once, in memory: visualization never touches the disk
+  std::shared_ptr<const SubmapMesh> mesh;
+  if (submapMeshesCallback_) {
+    mesh = extractMesh(*map);
+    stats_->addDuration(PipelineStats::Stage::Meshing,
+                        std::chrono::duration<double>(std::chrono::steady_clock::now() - hashing_end).count());
+  }
+
+  std::unique_lock<std::mutex> lk(finalizedMutex_);
+  finalizedSubmaps_[id] = mesh;
+  lk.unlock();
+
+  // done: publish the new lookups, and then the submaps. not left to the processing
+  // thread, which may not see another frame (e.g. after the last one)
+  requestMapSnapshot();
+}
+
+std::shared_ptr<const SubmapMesh> SupereightInterface::extractMesh(const se::OccupancyMap<se::Res::Multi> &map)
+{
+  se::TriangleMesh triangles;
+  se::algorithms::dual_marching_cube(*map.getOctree(), triangles);
+
+  // vertexes are in voxel coords of the octree
+  const Eigen::Matrix4f T_KM = map.getTWM();
+  const Eigen::Matrix3f R_KM = T_KM.topLeftCorner<3,3>() * map.getRes();
+  const Eigen::Vector3f t_KM = T_KM.topRightCorner<3,1>();
+
+  auto mesh = std::make_shared<SubmapMesh>();
+  mesh->reserve(3 * triangles.size());
+  for (const auto &triangle : triangles) {
+    for (int v = 0; v < 3; v++) mesh->push_back(R_KM * triangle.vertexes[v] + t_KM);
+  }
+  return mesh;
+}
+
+void SupereightInterface::finishSubmapJobs()
+{
+  // finishing jobs push snapshot jobs, which count as outstanding too
+  while (hashingPool_->outstanding())
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  hashingPool_->shutdown();
+}
+
+bool SupereightInterface::saveSession(const std::string &directory)
+{
+  // the finished submaps, with the pose their boxes were hashed with
+  std::vector<SessionSubmap> submaps;
+  std::unique_lock<std::mutex> lk(hashTableMutex_);
+  for (const auto &hashed : submapHashedPoseLookup_) {
+    SessionSubmap submap;
+    submap.id = hashed.first;
+    submap.T_WK = hashed.second.T();
+    submap.bounds = submapDimensionLookup_[hashed.first];
+    submap.cells = hashTableInverse_[hashed.first];
+    submaps.push_back(std::move(submap));
+  }
+  lk.unlock();
+
+  // resident maps (finished: not touched by the processing thread anymore), the others from disk.
+  // not from the snapshot, which can predate the last finalized ones
+  std::unique_lock<std::mutex> lk_lookup(lookupMutex_);
+  for (auto &submap : submaps) {
+    const auto resident = submapLookup_.find(submap.id);
+    if (resident != submapLookup_.end()) submap.map = *resident->second;
+  }
+  lk_lookup.unlock();
+
+  std::vector<SessionSubmap> complete;
+  for (auto &submap : submaps) {
+    if (!submap.map && submapStore_) submap.map = submapStore_->load(submap.id);
+    if (submap.map) complete.push_back(std::move(submap));
+    else LOG(WARNING) << "Submap " << submap.id << " has no map in memory or on disk, left out of the session";
+  }
+
+  std::cout << "Saving " << complete.size() << " submaps to " << directory << "\n";
+  return SubmapSession::save(directory, complete);
+}
+
+bool SupereightInterface::loadSession(const std::string &directory)
+{
+  SessionIndex index;
+  if (!SubmapSession::readIndex(directory, index)) return false;
+  const std::vector<uint64_t> &ids = index.ids;
+
+  // octrees (and distance layers) are rebuilt in parallel, one submap at a time per thread
+  std::vector<SessionSubmap, Eigen::aligned_allocator<SessionSubmap>> loaded(ids.size());
+  std::vector<std::shared_ptr<const SubmapEsdf>> esdfs(ids.size());
+  std::vector<std::vector<uint8_t>> flags(ids.size());
+  std::vector<char> ok(ids.size(), 0);
+  std::atomic<size_t> next(0);
+  auto load = [&]() {
+    for (size_t i = next++; i < ids.size(); i = next++) {
+      ok[i] = SubmapSession::load(directory, index, ids[i], mapConfig_, dataConfig_, loaded[i]);
+      if (!ok[i]) continue;
+      if (submapConfig_.useEsdf)
+        esdfs[i] = SubmapEsdf::compute(*loaded[i].map, loaded[i].bounds, submapConfig_.esdfMaxDistance);
+      // box flags are not saved: they follow from the octree
+      const Eigen::Matrix4f T_WM = loaded[i].T_WK.cast<float>() * loaded[i].map->getTWM();
+      flags[i] = computeCellFlags(*loaded[i].map, loaded[i].cells, T_WM, submapConfig_.hashCellSize);
+    }
+  };
+  std::vector<std::thread> loaders;
+  const size_t numThreads = std::max(1u, std::thread::hardware_concurrency());
+  for (size_t t = 0; t < numThreads && t < ids.size(); t++) loaders.emplace_back(load);
+  for (auto &loader : loaders) loader.join();
+
+  // okvis ids start over at each run: loaded submaps are renumbered above the range it uses
+  const uint64_t sessionIdBase = 1 << 30;
+  size_t count = 0;
+  for (size_t i = 0; i < ids.size(); i++) {
+    if (!ok[i]) {
+      LOG(WARNING) << "Could not load submap " << ids[i] << " from " << directory;
+      continue;
+    }
+    const uint64_t id = sessionIdBase + count++;
+    const Transformation T_WK(loaded[i].T_WK);
+
+    std::unique_lock<std::mutex> lk_lookup(lookupMutex_);
+    submaps_.push_back(loaded[i].map);
+    finestRes_ = finestRes_ > 0 ? std::min(finestRes_, loaded[i].map->getRes()) : loaded[i].map->getRes();
+    submapLookup_[id] = std::prev(submaps_.end());
+    submapPoseLookup_[id] = T_WK;
+    lk_lookup.unlock();
+
+    std::lock_guard<std::mutex> lk(hashTableMutex_);
+    submapDimensionLookup_[id] = loaded[i].bounds;
+    applySubmapCells(id, std::move(loaded[i].cells), flags[i]);
+    submapHashedPoseLookup_[id] = T_WK;
+    if (esdfs[i]) submapEsdfLookup_[id] = esdfs[i];
+    SubmapMemory &memory = submapMemoryStats_[id];
+    memory.id = id;
+    memory.res = loaded[i].map->getRes();
+    memory.octree = SubmapStore::octreeMemory(*loaded[i].map);
+    if (submapStore_) {
+      submapMemoryLookup_[id] = memory.octree.bytes;
+      residentBytes_ += memory.octree.bytes;
+    }
+    touchSubmap(id);
+  }
+
+  std::cout << "Loaded " << count << " submaps from " << directory << "\n";
+  publishMapSnapshot();
+  return true;
+}
+
+std::unordered_map<uint64_t, SubmapPtr> SupereightInterface::residentSubmaps() const
+{
+  std::unordered_map<uint64_t, SubmapPtr> resident;
+  for (const auto &submap : submapLookup_) {
+    if (*submap.second) resident.emplace(submap.first, *submap.second);
+  }
+  return resident;
+}
+
+void SupereightInterface::evictSubmaps(const Eigen::Vector3d &r_W)
+{
+  if (!submapStore_) return;
+
+  // maps with a pending eviction are as good as gone
+  const size_t budget = static_cast<size_t>(submapConfig_.residentBudget * 1024.0 * 1024.0);
+  std::unique_lock<std::mutex> lk(hashTableMutex_);
+  const bool over = residentBytes_ - evictingBytes_ > budget;
+  lk.unlock();
+  if (!over) return;
+
+  // a pending scan is replaced: the latest position is the one that counts
+  hashingPool_->push(SubmapJobPool::JobType::EvictionScan, kEvictionScanId,
+                     [this, r_W] { scanEvictionCandidates(r_W); });
+}
+
+void SupereightInterface::scanEvictionCandidates(const Eigen::Vector3d &r_W)
+{
+  // poses and maps as of the latest snapshot: the processing thread goes on meanwhile
+  const std::shared_ptr<const MapSnapshot> snapshot = getMapSnapshot();
+  const size_t budget = static_cast<size_t>(submapConfig_.residentBudget * 1024.0 * 1024.0);
+
+  // least recently used first
+  std::vector<std::pair<uint64_t, SubmapPtr>> chosen;
+  std::unique_lock<std::mutex> lk(hashTableMutex_);
+  for (const uint64_t id : submapLru_) {
+    if (residentBytes_ - evictingBytes_ <= budget) break;
+    if (evicting_.count(id)) continue;
+    const auto size = submapMemoryLookup_.find(id); // not finished, or already released
+    if (size == submapMemoryLookup_.end()) continue;
+    const auto map = snapshot->submapLookup.find(id);
+    const auto pose = snapshot->submapPoseLookup.find(id);
+    if (map == snapshot->submapLookup.end() || pose == snapshot->submapPoseLookup.end()) continue;
+    if ((pose->second.r() - r_W).norm() <= submapConfig_.evictionDistance) continue;
+    evicting_.insert(id);
+    evictingBytes_ += size->second;
+    chosen.emplace_back(id, map->second);
+  }
+  const size_t resident = residentBytes_ - evictingBytes_;
+  lk.unlock();
+
+  for (const auto &candidate : chosen) {
+    const uint64_t id = candidate.first;
+    const SubmapPtr map = candidate.second;
+    // after its finalization and pending rehashes (same id jobs run in order)
+    hashingPool_->push(SubmapJobPool::JobType::Evict, id, [this, id, map] {
+      const bool saved = submapStore_->save(id, *map);
+      std::lock_guard<std::mutex> lk_evict(hashTableMutex_);
+      if (!saved) {
+        LOG(WARNING) << "Could not write submap " << id << " to disk, keeping it in memory";
+        evicting_.erase(id);
+        evictingBytes_ -= submapMemoryLookup_.at(id);
+        return;
+      }
+      evictedSubmaps_.push_back(id);
+    });
+  }
+
+  if (resident > budget)
+    LOG(WARNING) << "Resident submaps above budget: " << resident / (1024 * 1024) << " MB, nothing distant left to evict";
+}
+
+void SupereightInterface::touchSubmap(const uint64_t id)
+{
+  const auto pos = submapLruPos_.find(id);
+  if (pos != submapLruPos_.end()) {
+    submapLru_.splice(submapLru_.end(), submapLru_, pos->second);
+  } else {
+    submapLruPos_.emplace(id, submapLru_.insert(submapLru_.end(), id));
+  }
+}
+
+bool SupereightInterface::releaseEvictedSubmaps()
+{
+  std::unique_lock<std::mutex> lk(hashTableMutex_);
+  if (evictedSubmaps_.empty()) return false;
+  std::vector<uint64_t> evicted;
+  evicted.swap(evictedSubmaps_);
+  for (const uint64_t id : evicted) {
+    const size_t bytes = submapMemoryLookup_.at(id);
+    residentBytes_ -= bytes;
+    evictingBytes_ -= bytes;
+    submapMemoryLookup_.erase(id);
+    submapMemoryStats_[id].resident = false;
+    evicting_.erase(id);
+    const auto pos = submapLruPos_.find(id);
+    if (pos != submapLruPos_.end()) {
+      submapLru_.erase(pos->second);
+      submapLruPos_.erase(pos);
+    }
+  }
+  lk.unlock();
+
+  // the memory goes once the last job / snapshot using the map lets it go
+  std::unique_lock<std::mutex> lk_lookup(lookupMutex_);
+  for (const uint64_t id : evicted) submapLookup_[id]->reset();
+  lk_lookup.unlock();
+  for (const uint64_t id : evicted) std::cout << "Evicted submap " << id << " to disk\n";
+  return true;
+}
+
+std::vector<SpatialHash::Key> SupereightInterface::computeSubmapCells(const se::OccupancyMap<se::Res::Multi> &map,
+                                                                     const Eigen::Matrix<float,6,1> &bounds,
+                                                                     const Eigen::Matrix4f &T_WM,
+                                                                     const bool observedOnly) const
+{
+
+  const float side = submapConfig_.hashCellSize; // hash map box side
+
+  std::vector<SpatialHash::Key> cells;
+
+  if (!observedOnly) {
+    // every box the (oriented) bounding box of the map touches. already sorted and unique
+    SpatialHash::rasterizeBox(T_WM, bounds.head<3>(), bounds.tail<3>(), side, cells);
+    return cells;
+  }
+
+  // only the boxes touched by the observed octants (each of them is a small oriented cube)
+  auto octree_ptr = map.getOctree();
+  const float resolution = map.getRes();
+  for (auto octant_it = se::LeavesIterator<OctreeT>(octree_ptr.get()); octant_it != se::LeavesIterator<OctreeT>(); ++octant_it) {
+    const auto octant_ptr = *octant_it;
+
+    // blocks are allocated where rays went through: take them all. nodes only if observed
+    if (!octant_ptr->isBlock() && static_cast<typename OctreeT::NodeType*>(octant_ptr)->getData().weight == 0) continue;
+
+    const Eigen::Vector3f corner_min = octant_ptr->getCoord().cast<float>() * resolution;
+    const float size = se::octantops::octant_to_size<OctreeT>(octant_ptr) * resolution;
+    SpatialHash::rasterizeBox(T_WM, corner_min, corner_min + Eigen::Vector3f::Constant(size), side, cells);
+  }
+
+  // sorted, one entry per box
+  std::sort(cells.begin(), cells.end());
+  cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+
+  return cells;
+
+}
+
+std::vector<uint8_t> SupereightInterface::computeCellFlags(const se::OccupancyMap<se::Res::Multi> &map,
+                                                          const std::vector<SpatialHash::Key> &cells,
+                                                          const Eigen::Matrix4f &T_WM, const float cellSize)
+{
+
+  const float side = cellSize; // hash map box side
+  const float resolution = map.getRes();
+  const Eigen::Matrix4f T_KM = map.getTWM();
+  const Eigen::Matrix4f T_MW = T_WM.inverse();
+
+  // octree nodes of at most half a box (and at most a block)
+  int scale = 0;
+  while (scale < 3 && resolution * (2 << scale) <= side / 2) scale++;
+  const float node_size = resolution * (1 << scale);
+
+  std::vector<uint8_t> flags(cells.size(), SpatialHash::kUnknown);
+  for (size_t c = 0; c < cells.size(); c++)
+  {
+    // bounds of the box in map frame, in nodes
+    const Eigen::Vector3f box_min = SpatialHash::unpack(cells[c]).cast<float>() * side;
+    Eigen::Vector3f lo = Eigen::Vector3f::Constant(std::numeric_limits<float>::max());
+    Eigen::Vector3f hi = -lo;
+    for (int k = 0; k < 8; k++)
+    {
+      const Eigen::Vector3f corner = box_min + side * Eigen::Vector3f(k & 1, (k >> 1) & 1, (k >> 2) & 1);
+      const Eigen::Vector3f corner_m = T_MW.topLeftCorner<3,3>() * corner + T_MW.topRightCorner<3,1>();
+      lo = lo.cwiseMin(corner_m);
+      hi = hi.cwiseMax(corner_m);
+    }
+    const Eigen::Vector3i lo_node = (lo / node_size).array().floor().cast<int>();
+    const Eigen::Vector3i hi_node = (hi / node_size).array().floor().cast<int>();
+
+    // max occupancy x weight of each node: < 0 all observed free, 0 something unobserved, > 0 something occupied
+    uint8_t box_flags = 0;
+    for (int x = lo_node(0); x <= hi_node(0); x++)
+    {
+      for (int y = lo_node(1); y <= hi_node(1); y++)
+      {
+        for (int z = lo_node(2); z <= hi_node(2); z++)
+        {
+          const Eigen::Vector3f centre_m = (Eigen::Vector3f(x, y, z).array() + 0.5f) * node_size;
+          const Eigen::Vector3f centre = T_KM.topLeftCorner<3,3>() * centre_m + T_KM.topRightCorner<3,1>();
+          if (!map.contains(centre))
+          {
+            box_flags |= SpatialHash::kUnobserved;
+            continue;
+          }
+          const auto data = map.getMaxData(centre, scale);
+          const float field = data.occupancy * data.weight;
+          if (field > 0) box_flags |= SpatialHash::kOccupied;
+          else if (field == 0) box_flags |= SpatialHash::kUnobserved;
+        }
+      }
+    }
+    flags[c] = box_flags ? box_flags : uint8_t(SpatialHash::kFree);
+  }
+
+  return flags;
+
+}
+
+void SupereightInterface::applySubmapCells(const uint64_t id, std::vector<SpatialHash::Key> &&cells, const std::vector<uint8_t> &flags)
+{
+
+  // both sorted: walk them together, remove the boxes we left, add the ones we entered.
+  // the flags of the others are replaced: they depend on the pose too
+  std::vector<SpatialHash::Key> &old_cells = hashTableInverse_[id];
+  auto cellFlags = [&](const size_t j) { return flags.empty() ? uint8_t(SpatialHash::kUnknown) : flags[j]; };
+  size_t i = 0, j = 0;
+  while (i < old_cells.size() || j < cells.size())
+  {
+    if (j == cells.size() || (i < old_cells.size() && old_cells[i] < cells[j])) hashTable_.erase(old_cells[i++], id);
+    else if (i == old_cells.size() || cells[j] < old_cells[i]) { hashTable_.insert(cells[j], id, cellFlags(j)); j++; }
+    else { hashTable_.setFlags(cells[j], id, cellFlags(j)); i++; j++; } // same box
+  }
+
+  old_cells = std::move(cells);
+
+}
+
+bool SupereightInterface::poseChanged(const Transformation &T_old, const Transformation &T_new) const
+{
+
+  return MapSnapshot::poseChanged(T_old, T_new, submapConfig_.rehashTranslationTol, submapConfig_.rehashRotationTol);
+
+}
+
+bool MapSnapshot::poseChanged(const Transformation &T_old, const Transformation &T_new,
+                              const float translationTol, const float rotationTol)
+{
+  const Transformation T_delta = T_old.inverse() * T_new;
+  const double angle = 2.0 * std::acos(std::min(1.0, std::abs(T_delta.q().w())));
+
+  return T_delta.r().norm() > translationTol || angle > rotationTol;
+}
+
+void MapSnapshot::findMovedSubmaps(const float translationTol, const float rotationTol)
+{
+  movedSubmaps.clear();
+  for (const auto &hashed : submapHashedPoseLookup) {
+    const auto pose = submapPoseLookup.find(hashed.first);
+    if (pose != submapPoseLookup.end() && poseChanged(hashed.second, pose->second, translationTol, rotationTol))
+      movedSubmaps.insert(hashed.first);
+  }
+}
+
+
+
+
+Eigen::Matrix<float,6,1> SupereightInterface::computeMapBounds(const se::OccupancyMap<se::Res::Multi> &map)
+{
+
+  Eigen::Vector3i min_box(1000,1000,1000);
+  Eigen::Vector3i max_box(-1000,-1000,-1000);
+
+  auto octree_ptr = map.getOctree();
+
+  auto resolution = map.getRes();
+
   for (auto octant_it = se::LeavesIterator<OctreeT>(octree_ptr.get()); octant_it != se::LeavesIterator<OctreeT>(); ++octant_it) {
         const auto octant_ptr = *octant_it;
 
@@ -560,50 +1418,17 @@ void SupereightInterface::doSpatialHashing(const uint64_t id, const Transformati
         
         // Differentiate between block and node processing
         if (octant_ptr->isBlock()) {
-            // If the leaf is a block we'll need to iterate over all voxels at the current scale
-            const Eigen::Vector3i block_coord = octant_ptr->getCoord();
+            // The block data (not the voxel one) tells whether the block is observed. Every voxel at the
+            // current scale then extends the bounds, and together they tile the whole block: so the
+            // block extent is all we need, no need to visit its voxels.
             const BlockType* block_ptr = static_cast<const BlockType*>(octant_ptr);
-            // Find current scale of the block leaves and their size
-            const int node_scale = block_ptr->getCurrentScale();
-            const int node_size  = 1 << node_scale;
-
-            // iterate through voxels inside block
-            for (unsigned int x = 0; x < BlockType::getSize(); x += node_size) {
-                for (unsigned int y = 0; y < BlockType::getSize(); y += node_size) {
-                    for (unsigned int z = 0; z < BlockType::getSize(); z += node_size) {
-
-                      
-                      // if the voxel is unobserved, skip
-                      const auto data = block_ptr->getData();
-                      if (data.weight == 0) continue;
-
-                      const Eigen::Vector3i node_coord = block_coord + Eigen::Vector3i(x, y, z);
-                      // std::cout << "voxel_coord \n" << node_coord << "\n";
-
-                      
-                      Eigen::Vector3i voxel_corner_min = node_coord;
-                      Eigen::Vector3i voxel_corner_max = voxel_corner_min + Eigen::Vector3i(node_size, node_size, node_size);
-                      for (int i = 0; i < 3; i++) {
-                        // if not inside bounds, update either max or min
-                        if (voxel_corner_min(i) < min_box(i))
-                        {
-                          // std::cout << "update min \n";
-                          min_box(i) = voxel_corner_min(i);
-                        }
-                        if (voxel_corner_max(i) > max_box(i))
-                        {
-                          // std::cout << "update max \n";
-                          max_box(i) = voxel_corner_max(i);
-                        }
-                      }
-
-                      // ... or, just check for voxel coord. not for all corners ?
-                      // faster, but with the adaptive res thing, could mean that the voxels are huge and
-                      // we are actually making huge errors, not 20 cm errors
-
-                    } // z
-                } // y
-            } // x
+            if (block_ptr->getData().weight == 0) continue;
+
+            for (int i = 0; i < 3; i++) {
+              // if not inside bounds, update either max or min
+              if (corner_min(i) < min_box(i)) min_box(i) = corner_min(i);
+              if (corner_max(i) > max_box(i)) max_box(i) = corner_max(i);
+            }
          }
         else { // if is node
 
@@ -642,79 +1467,8 @@ void SupereightInterface::doSpatialHashing(const uint64_t id, const Transformati
     max_box_metres(i) = max_box(i) * resolution;
   }
 
-  // now I have the bounding box in metres, wrt the map frame.
-  // this frame is separated from the real world frame by: Twk*Tkm
-  // so to do hashing we must transform this box to the world frame by using this transformation
-  // just like I did before with the stupid hashing. but with a double transformation
-
-  std::unique_lock<std::mutex> lk(hashTableMutex_);
-
-  // we first need to get rid of the preliminary indexing we did when 
-  // creating map (we indexed a 10x10x10 box)
-  if (hashTableInverse_.count(id)) 
-  { // this should always be the case
-    for (auto &pos : hashTableInverse_[id])
-    {
-      hashTable_[pos].erase(id); // remove id from box
-      hashTableInverse_[id].erase(pos); // remove box from id
-      submapDimensionLookup_.erase(id); // remve dimensions
-    } 
-  }
-
-  // insert map bounds in the lookup
   Eigen::Matrix<float,6,1> dims;
   dims << min_box_metres, max_box_metres;
-  submapDimensionLookup_.insert(std::make_pair(id,dims));
-
-  // Check first if there already is an entry in hash table. if there is, we should delete and rewrite.
-  // But to keep things simple, we just ignore that case. That happens when an older map is re-integrated
-  // We only redo the hashing when a loop closure is detected.
-
-  const float side = 1.0; // hardcoded hash map box side of 1m
-  const float step = 0.5 * side * sqrt(2); // this ensures full cover of submap space
-  
-  // need to take all points -> use <=
-  for (float x = min_box_metres(0); x <= max_box_metres(0); x+=step)
-        {
-          for (float y = min_box_metres(1); y <= max_box_metres(1); y+=step)
-          {
-            for (float z = min_box_metres(2); z <= max_box_metres(2); z+=step)
-            {
-              
-              // get offset value (this pos is in map frame)
-              Eigen::Vector4f pos_map(x,y,z,1);
-
-              // transform into world frame
-              Eigen::Vector4f pos_world;
-              pos_world = T_WM * pos_map;
-
-              // floor transformed value
-              Eigen::Vector3i pos_floor;
-              for (int i = 0 ; i < 3 ; i++)
-              {
-                // if side is e.g. 2, a value of 4.5,4.5,4.5 is mapped to box 2,2,2
-                pos_floor(i) = (int)(floor(pos_world(i)/side));
-              }
-
-              // std::cout << "   box \n " << pos_floor <<  "\n";
-
-              // add to index 
-              hashTable_[pos_floor].insert(id);
-
-              // add pos to inverse index
-              hashTableInverse_[id].insert(pos_floor);
-              
-              // for (int i = 0; i < 3; i++) {
-              //   if (pos_floor(i) < minbounds(i)) minbounds(i) = pos_floor(i);
-              //   if (pos_floor(i) > maxbounds(i)) maxbounds(i) = pos_floor(i);
-              // }
-            }
-          }
-        }
-
-  lk.unlock();
+  return dims;
 
 }
-
-
-
@@ -53,6 +53,18 @@ private:
   char* cam1_topic;
   char* depth_topic;
 
+  // where we store output stuff (vocabulary, meshes, recorded data)
+  std::string utils_dir;
+
+  // save the submaps at shutdown (in utils_dir/session)
+  bool save_session = false;
+
+  // write the spatial hash cells at shutdown (utils_dir/hash_cells.csv)
+  bool save_hash_table = false;
+
+  // sample the memory statistics into utils_dir/memory_stats.csv this often (s), 0: never
+  double memory_stats_period = 0;
+
   // ============= OKVIS + SE =============
 
   // okvis interface
@@ -73,6 +85,13 @@ private:
 
   ros::Subscriber navgoal_sub;
 
+  // publishes the pipeline and memory statistics on /diagnostics
+  ros::Timer diagnostics_timer;
+
+  // appends the memory statistics to the csv (first sample: fresh file)
+  ros::Timer memory_stats_timer;
+  bool memory_stats_first = true;
+
   // to visualize topics in rviz
   Publisher publisher;
 
@@ -97,8 +116,6 @@ private:
   // ============= THREADS =============
 
   std::thread thread_okvis;
-
-  std::thread thread_planner;
   
 public:
 
@@ -150,9 +167,9 @@ sync(MySyncPolicy(1000), image0_sub, image1_sub)
   boost::filesystem::path package(package_dir);
   package.remove_filename().remove_filename(); // Now path is your workspace
 
+  utils_dir = package.string() + "/utils";
   std::string trajectoryDir = package.string() + "/utils";
   std::string meshesDir = package.string() + "/utils" + "/meshes";
-  publisher.setMeshesPath(meshesDir); // Tell publisher where submap meshes are
   std::string dBowVocDir = package.string() + "/utils";
 
 
@@ -217,15 +234,18 @@ sync(MySyncPolicy(1000), image0_sub, image1_sub)
 
   publisher.setT_SC(T_SC);
 
-  // Get submaps distance from config
-  cv::FileStorage fs;
-  fs.open(config_s8, cv::FileStorage::READ | cv::FileStorage::FORMAT_YAML);
-  const cv::FileNode node = fs["submaps"];
-  float distThreshold;
-  se::yaml::subnode_as_float(node, "dist_threshold", distThreshold);
-  assert(distThreshold >= 0);
+  // Get submaps distance threshold and distance layer settings from config
+  SubmapConfig submapConfig;
+  submapConfig.readYaml(config_s8);
   
-  se_interface = std::make_shared<SupereightInterface>(cameraConfig, mapConfig, dataConfig, T_SC, meshesDir, static_cast<double>(distThreshold));
+  se_interface = std::make_shared<SupereightInterface>(cameraConfig, mapConfig, dataConfig, T_SC, meshesDir, submapConfig);
+
+  // resume from the submaps of the previous run
+  save_session = submapConfig.saveSession;
+  save_hash_table = submapConfig.saveHashTable;
+  memory_stats_period = submapConfig.memoryStatsPeriod;
+  if (submapConfig.loadSession && !se_interface->loadSession(utils_dir + "/session"))
+    LOG(WARNING) << "No session to load in " << utils_dir << "/session";
   
   // run in real time (not blocking) or not (blocking)?
   // while tracking should be real time, it's not relevant with depth integration
@@ -256,9 +276,9 @@ sync(MySyncPolicy(1000), image0_sub, image1_sub)
 
   //// Sisualize the submaps
   // Mesh version:
-  se_interface->setSubmapMeshesCallback(std::bind(&Publisher::publishSubmapMeshesAsCallback, &publisher, std::placeholders::_1));
+  se_interface->setSubmapMeshesCallback(std::bind(&Publisher::publishSubmapMeshesAsCallback, &publisher, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
   // Block version:
-  // se_interface->setSubmapCallback(std::bind(&Publisher::publishSubmapsAsCallback, &publisher, std::placeholders::_1,std::placeholders::_2));
+  // se_interface->setSubmapCallback(std::bind(&Publisher::publishSubmapsAsCallback, &publisher, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
 
   // =============== REGISTER ROS CALLBACKS =============== 
 
@@ -270,11 +290,47 @@ sync(MySyncPolicy(1000), image0_sub, image1_sub)
 
   depth_sub = it.subscribe(std::string(depth_topic), 1000, &RosInterfacer::depthCallback, this);
 
+  diagnostics_timer = nh.createTimer(ros::Duration(1.0), [this](const ros::TimerEvent &) {
+    publisher.publishPipelineStats(*se_interface->getPipelineStats());
+    publisher.publishMemoryStats(se_interface->getMemoryStats());
+  });
+
+  if (memory_stats_period > 0) {
+    memory_stats_timer = nh.createTimer(ros::Duration(memory_stats_period), [this](const ros::TimerEvent &) {
+      if (!se_interface->getMemoryStats().writeCsvRow(utils_dir + "/memory_stats.csv", memory_stats_first))
+        LOG(WARNING) << "Could not write memory statistics to " << utils_dir;
+      memory_stats_first = false;
+    });
+  }
+
 }
 
 RosInterfacer::~RosInterfacer()
 {
 
+  // keep the spatial hash of this run around (input for the spatial hash benchmark)
+  if (se_interface && save_hash_table && !se_interface->saveHashTable(utils_dir + "/hash_cells.csv"))
+    LOG(WARNING) << "Could not save hash table to " << utils_dir;
+
+  if (se_interface && save_session) {
+    // the submaps still being finalized go in the save too
+    se_interface->finishSubmapJobs();
+    boost::filesystem::create_directories(utils_dir + "/session");
+    if (!se_interface->saveSession(utils_dir + "/session"))
+      LOG(WARNING) << "Could not save session to " << utils_dir << "/session";
+  }
+
+  // where the time went in this run
+  if (se_interface && !se_interface->getPipelineStats()->writeCsv(utils_dir + "/pipeline_stats.csv"))
+    LOG(WARNING) << "Could not save pipeline statistics to " << utils_dir;
+
+  if (se_interface) {
+    const SubmapStoreStats stats = se_interface->getEvictionStats();
+    if (stats.evictions)
+      LOG(INFO) << "Submap eviction: " << stats.evictions << " evicted (" << stats.bytesOnDisk / (1024 * 1024)
+                << " MB on disk), reloads: " << stats.hits << " cache hits, " << stats.misses << " misses";
+  }
+
 }
 
 
@@ -290,6 +346,9 @@ int RosInterfacer::start()
 
   thread_okvis.detach();
 
+  // Start the planning thread (serves the navgoals)
+  planner->startPlanningThread();
+
   return 0;
 
 }
@@ -312,12 +371,8 @@ void RosInterfacer::navGoalCallback(const geometry_msgs::Point &msg)
 {
   Eigen::Vector3d r(msg.x,msg.y,msg.z);
   
-  planner->setGoal(r);
-
-  // overloaded function -> does not work -> use lambda
-  //thread_planner = std::thread(Planner::plan,planner.get(),r);
-  thread_planner = std::thread([&](Eigen::Vector3d goal){planner->plan(goal);},r);
-  thread_planner.detach();
+  // the planning thread takes it over, preempting the running query
+  planner->requestPlan(r);
 
 }
 
@@ -395,7 +450,9 @@ void RosInterfacer::depthCallback(const sensor_msgs::ImageConstPtr& img){
   // // cv::imshow("mydepth",raw_depth);
   // // cv::waitKey(2);
 
-  cv_bridge::CvImagePtr cv_ptr = cv_bridge::toCvCopy(img, "32FC1");
+  // no copy if the image is already 32FC1: the Mat points into the message buffer,
+  // which cv_ptr keeps alive until addDepthImage has converted it
+  cv_bridge::CvImageConstPtr cv_ptr = cv_bridge::toCvShare(img, "32FC1");
   okvis::Time t(img->header.stamp.sec, img->header.stamp.nsec);
   t -= okvis::Duration(parameters.camera.image_delay);
 
@@ -0,0 +1,77 @@
+/**
+ * @file FrameSchedulerTest.cpp
+ * @brief Which depth frames get integrated once integration falls behind the latency budget.
+ */
+
+#include <gtest/gtest.h>
+
+#include <FrameScheduler.hpp>
+
+namespace {
+
+okvis::kinematics::Transformation pose(const double x, const double yaw = 0.0) {
+  return okvis::kinematics::Transformation(Eigen::Vector3d(x, 0, 0),
+                                           Eigen::Quaterniond(Eigen::AngleAxisd(yaw, Eigen::Vector3d::UnitZ())));
+}
+
+// a scheduler past the keyframe frames of keyframe 1, integrating at 1 s per frame
+void fallBehind(FrameScheduler &scheduler, const FrameSchedulerConfig &config) {
+  for (int i = 0; i < config.keyframeFrames; i++) scheduler.accept(pose(0), 1, 0.0, 0);
+  scheduler.reportIntegration(1.0, 1.0);
+}
+
+} // namespace
+
+TEST(FrameScheduler, WithinBudget)
+{
+  FrameSchedulerConfig config;
+  FrameScheduler scheduler(config);
+  scheduler.reportIntegration(0.01, 0.02);
+  for (int i = 0; i < 20; i++) EXPECT_TRUE(scheduler.accept(pose(0), 1, 0.0, 5));
+  EXPECT_EQ(scheduler.skipped(), 0u);
+}
+
+TEST(FrameScheduler, OverBudget)
+{
+  FrameSchedulerConfig config;
+  FrameScheduler scheduler(config);
+  fallBehind(scheduler, config);
+
+  EXPECT_FALSE(scheduler.accept(pose(0), 1, 0.0, 0)); // no parallax
+  EXPECT_TRUE(scheduler.accept(pose(2 * config.minTranslation), 1, 0.0, 0));
+  EXPECT_FALSE(scheduler.accept(pose(2 * config.minTranslation), 1, 0.0, 0)); // wrt the last kept one
+  EXPECT_TRUE(scheduler.accept(pose(2 * config.minTranslation, 2 * config.minRotation), 1, 0.0, 0));
+  EXPECT_TRUE(scheduler.accept(pose(0), 2, 0.0, 0)); // keyframe switch
+  EXPECT_EQ(scheduler.skipped(), 2u);
+}
+
+TEST(FrameScheduler, ConsecutiveSkips)
+{
+  FrameSchedulerConfig config;
+  FrameScheduler scheduler(config);
+  fallBehind(scheduler, config);
+
+  for (int i = 0; i < config.maxConsecutiveSkips; i++) EXPECT_FALSE(scheduler.accept(pose(0), 1, 0.0, 0));
+  EXPECT_TRUE(scheduler.accept(pose(0), 1, 0.0, 0));
+  EXPECT_FALSE(scheduler.accept(pose(0), 1, 0.0, 0));
+}
+
+TEST(FrameScheduler, Forced)
+{
+  FrameSchedulerConfig config;
+  FrameScheduler scheduler(config);
+  fallBehind(scheduler, config);
+
+  EXPECT_TRUE(scheduler.accept(pose(0.05), 1, 0.0, 0, true));
+  EXPECT_FALSE(scheduler.accept(pose(0.1), 1, 0.0, 0)); // the forced frame is the last kept one
+}
+
+TEST(FrameScheduler, NoDecimation)
+{
+  FrameSchedulerConfig config;
+  config.decimate = false;
+  FrameScheduler scheduler(config);
+  fallBehind(scheduler, config);
+  for (int i = 0; i < 2 * config.maxConsecutiveSkips; i++) EXPECT_TRUE(scheduler.accept(pose(0), 1, 10.0, 100));
+  EXPECT_EQ(scheduler.skipped(), 0u);
+}
@@ -0,0 +1,175 @@
+/**
+ * @file PlannerTest.cpp
+ * @brief The edge checker is at least as strict as the state checker: a motion past a small
+ * obstacle is rejected whenever one of its samples is in collision. Box flags computed at an old
+ * pose do not turn a moved obstacle into free space.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <gtest/gtest.h>
+
+#include <Planner.hpp>
+#include <SubmapSession.hpp>
+#include <SupereightInterface.hpp>
+
+namespace {
+
+typedef se::OccupancyMap<se::Res::Multi> MapT;
+
+se::MapConfig mapConfig() {
+  se::MapConfig config;
+  config.dim = Eigen::Vector3f::Constant(12.8f);
+  config.res = 0.1f;
+  config.T_MW = Eigen::Matrix4f::Identity();
+  config.T_MW.topRightCorner<3,1>() = config.dim / 2; // world origin in the middle
+  return config;
+}
+
+se::PinholeCameraConfig cameraConfig() {
+  se::PinholeCameraConfig config;
+  config.width = 64;
+  config.height = 48;
+  config.fx = config.fy = 40.f;
+  config.cx = 32.f;
+  config.cy = 24.f;
+  config.near_plane = 0.2f;
+  config.far_plane = 6.f;
+  config.T_BS = Eigen::Matrix4f::Identity();
+  return config;
+}
+
+// a camera at the origin looking along z at a wall 5 m away, and one pixel 2.5 m away:
+// a single voxel obstacle in observed free space
+SubmapPtr obstacleMap() {
+  auto map = std::make_shared<MapT>(mapConfig(), se::OccupancyDataConfig());
+  const se::PinholeCameraConfig config = cameraConfig();
+  const se::PinholeCamera sensor(config);
+
+  se::Image<float> depth(config.width, config.height, 5.f);
+  depth[24 * config.width + 32] = 2.5f;
+  se::MapIntegrator integrator(*map);
+  for (unsigned frame = 0; frame < 5; frame++) integrator.integrateDepth(sensor, depth, Eigen::Matrix4f::Identity(), frame);
+  return map;
+}
+
+class PlannerTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    char directory[] = "/tmp/planner_testXXXXXX";
+    ASSERT_TRUE(mkdtemp(directory));
+    directory_ = directory;
+
+    // the map, as a session with the submap at the world origin
+    SessionSubmap submap;
+    submap.id = 1;
+    submap.map = obstacleMap();
+    submap.bounds << -6.4f, -6.4f, -6.4f, 6.4f, 6.4f, 6.4f;
+    for (int x = -6; x < 6; x++) {
+      for (int y = -6; y < 6; y++) {
+        for (int z = -6; z < 6; z++) submap.cells.push_back(SpatialHash::pack(Eigen::Vector3i(x, y, z)));
+      }
+    }
+    std::sort(submap.cells.begin(), submap.cells.end());
+    ASSERT_TRUE(SubmapSession::save(directory_, {submap}));
+
+    config_ = directory_ + "/config.yaml";
+    std::ofstream file(config_);
+    file << "%YAML:1.2\n"
+         << "map:\n  res: 0.1\n"
+         << "planner:\n  min_x: -6.0\n  max_x: 6.0\n  min_y: -6.0\n  max_y: 6.0\n  min_z: -6.0\n  max_z: 6.0\n"
+         << "  mav_radius: 0.3\n";
+  }
+  void TearDown() override { boost::filesystem::remove_all(directory_); }
+
+  std::string directory_;
+  std::string config_;
+};
+
+} // namespace
+
+TEST_F(PlannerTest, MotionsStricterThanStates)
+{
+  SupereightInterface seInterface(cameraConfig(), mapConfig(), se::OccupancyDataConfig(), Eigen::Matrix4d::Identity(),
+                                  directory_, SubmapConfig());
+  ASSERT_TRUE(seInterface.loadSession(directory_));
+
+  Planner planner(&seInterface, config_);
+  planner.setStart(Eigen::Vector3d(100, 100, 100)); // the checks skip what is close to the start
+  ASSERT_TRUE(planner.updateMapSnapshot());
+  const ob::SpaceInformationPtr si = planner.getSpaceInformation();
+
+  // motions along x past the obstacle, at offsets that are no multiple of the voxel size
+  size_t colliding = 0, accepted = 0;
+  for (double y = -0.6; y <= 0.6; y += 0.037) {
+    for (double z = 2.0; z <= 2.5; z += 0.053) {
+      ob::ScopedState<ob::RealVectorStateSpace> s1(si), s2(si);
+      s1[0] = -0.8; s1[1] = y; s1[2] = z;
+      s2[0] = 0.8;  s2[1] = y; s2[2] = z;
+
+      // the samples the edge checker takes: one voxel apart, the end state included
+      const int steps = static_cast<int>(std::ceil(1.6 / 0.1));
+      bool collision = false;
+      for (int i = 1; i <= steps && !collision; i++) {
+        ob::ScopedState<ob::RealVectorStateSpace> sample(si);
+        si->getStateSpace()->interpolate(s1.get(), s2.get(), double(i) / steps, sample.get());
+        collision = !planner.detectCollision(sample.get());
+      }
+
+      const bool valid = si->checkMotion(s1.get(), s2.get());
+      if (collision) {
+        colliding++;
+        EXPECT_FALSE(valid) << "y " << y << " z " << z;
+      }
+      if (valid) accepted++;
+    }
+  }
+
+  // both cases happen
+  EXPECT_GT(colliding, 0u);
+  EXPECT_GT(accepted, 0u);
+}
+
+// a loop closure moves a submap before (or without) its rehash: the boxes its flags call free
+// at the old pose may hold its obstacles at the new one
+TEST_F(PlannerTest, MovedSubmapFlagsNotTrusted)
+{
+  SupereightInterface seInterface(cameraConfig(), mapConfig(), se::OccupancyDataConfig(), Eigen::Matrix4d::Identity(),
+                                  directory_, SubmapConfig());
+  ASSERT_TRUE(seInterface.loadSession(directory_));
+  const std::shared_ptr<const MapSnapshot> hashed = seInterface.getMapSnapshot();
+  ASSERT_EQ(hashed->submapPoseLookup.size(), 1u);
+  const uint64_t id = hashed->submapPoseLookup.begin()->first;
+
+  // the box the obstacle is moved into: observed free at the hashed pose
+  const Eigen::Vector3i box(1, 0, 3);
+  ASSERT_TRUE(hashed->hashTable.find(box));
+  ASSERT_TRUE(hashed->cellFree(*hashed->hashTable.find(box)));
+  EXPECT_TRUE(hashed->movedSubmaps.empty());
+
+  Planner planner(&seInterface, config_);
+  planner.setStart(Eigen::Vector3d(100, 100, 100)); // the checks skip what is close to the start
+  ob::ScopedState<ob::RealVectorStateSpace> state(planner.getSpaceInformation());
+  state[0] = 1.5; state[1] = 0.5; state[2] = 3.5;
+  ASSERT_TRUE(planner.updateMapSnapshot(hashed));
+  EXPECT_TRUE(planner.detectCollision(state.get()));
+
+  // same boxes and flags, new pose: the obstacle (at 0, 0, 2.5 in the submap) is now in the box
+  auto moved = std::make_shared<MapSnapshot>(*hashed);
+  Eigen::Matrix4d T_WK = Eigen::Matrix4d::Identity();
+  T_WK.topRightCorner<3,1>() = Eigen::Vector3d(1.5, 0.5, 1.0);
+  moved->submapPoseLookup[id] = Transformation(T_WK);
+  moved->submapInversePoseLookup[id] = T_WK.inverse();
+  moved->findMovedSubmaps(0.02f, 0.005f);
+  EXPECT_EQ(moved->movedSubmaps.count(id), 1u);
+  EXPECT_FALSE(moved->cellFree(*moved->hashTable.find(box)));
+
+  ASSERT_TRUE(planner.updateMapSnapshot(moved));
+  EXPECT_FALSE(planner.detectCollision(state.get()));
+}
@@ -0,0 +1,107 @@
+/**
+ * @file PoseCacheTest.cpp
+ * @brief Pose lookups of the depth frames: interpolation between okvis states, and what happens
+ * around a loop closure.
+ */
+
+#include <gtest/gtest.h>
+
+#include <PoseCache.hpp>
+
+namespace {
+
+// a state at t = sec moving along x at 1 m/s, plus a jump (e.g. a loop closure correction)
+okvis::State state(const uint32_t sec, const double jump = 0.0) {
+  okvis::State state;
+  state.timestamp = okvis::Time(sec, 0);
+  state.T_WS = okvis::kinematics::Transformation(Eigen::Vector3d(sec + jump, 0, 0), Eigen::Quaterniond::Identity());
+  state.v_W = Eigen::Vector3d(1, 0, 0);
+  state.id = okvis::StateId(10 + sec);
+  return state;
+}
+
+PoseQuery query(const uint32_t sec, const uint32_t nsec) {
+  PoseQuery query;
+  query.timestamp = okvis::Time(sec, nsec);
+  return query;
+}
+
+} // namespace
+
+TEST(PoseCache, Interpolation)
+{
+  PoseCache cache(8);
+  for (uint32_t i = 0; i < 4; i++) cache.add(state(i), i == 0, false, i + 1);
+
+  PoseQueryVec queries = {query(1, 500000000), query(2, 0), query(3, 500000000)};
+  EXPECT_EQ(cache.lookup(queries), 2u);
+
+  // constant velocity: the cubic is exact
+  ASSERT_TRUE(queries[0].found);
+  EXPECT_NEAR(queries[0].T_WS.r().x(), 1.5, 1e-9);
+  EXPECT_NEAR(queries[0].v_W.x(), 1.0, 1e-9);
+  EXPECT_EQ(queries[0].keyframeId, 10u);
+  EXPECT_EQ(queries[0].poseVersion, 2u); // the state before the stamp
+
+  ASSERT_TRUE(queries[1].found); // on a state
+  EXPECT_NEAR(queries[1].T_WS.r().x(), 2.0, 1e-9);
+  EXPECT_EQ(queries[1].poseVersion, 3u);
+
+  EXPECT_FALSE(queries[2].found); // newer than the newest state
+}
+
+TEST(PoseCache, Capacity)
+{
+  PoseCache cache(4);
+  for (uint32_t i = 0; i < 6; i++) cache.add(state(i), false, false, 0);
+  EXPECT_EQ(cache.size(), 4u);
+  okvis::Time newest;
+  ASSERT_TRUE(cache.newest(newest));
+  EXPECT_EQ(newest.sec, 5u);
+
+  PoseQueryVec queries = {query(1, 0), query(2, 500000000)};
+  EXPECT_EQ(cache.lookup(queries), 1u); // the oldest states are gone
+  EXPECT_FALSE(queries[0].found);
+  EXPECT_TRUE(queries[1].found);
+
+  cache.add(state(3), false, false, 0); // older than the newest: ignored
+  EXPECT_EQ(cache.size(), 4u);
+}
+
+// the states before a loop closure are in the uncorrected world frame: they go, and no
+// lookup mixes the two frames
+TEST(PoseCache, LoopClosure)
+{
+  PoseCache cache(8);
+  for (uint32_t i = 0; i < 3; i++) cache.add(state(i), i == 0, false, i + 1);
+  cache.add(state(3, 10.0), false, true, 4);
+  EXPECT_EQ(cache.size(), 1u);
+  cache.add(state(4, 10.0), false, false, 5);
+
+  PoseQueryVec queries = {query(2, 500000000), query(3, 0), query(3, 500000000)};
+  EXPECT_EQ(cache.lookup(queries), 2u);
+
+  EXPECT_FALSE(queries[0].found); // between the last uncorrected state and the loop closure
+
+  ASSERT_TRUE(queries[1].found);
+  EXPECT_NEAR(queries[1].T_WS.r().x(), 13.0, 1e-9);
+  EXPECT_EQ(queries[1].loopClosures, 1u);
+  EXPECT_EQ(queries[1].poseVersion, 4u);
+
+  ASSERT_TRUE(queries[2].found);
+  EXPECT_NEAR(queries[2].T_WS.r().x(), 13.5, 1e-9);
+  EXPECT_EQ(queries[2].loopClosures, 1u);
+  EXPECT_EQ(queries[2].keyframeId, 10u); // no keyframe since the first state
+}
+
+TEST(PoseCache, Release)
+{
+  PoseCache cache(2);
+  cache.add(state(0), true, false, 0);
+  cache.add(state(1), false, false, 0);
+
+  // non blocking: overwriting a state still needed is reported
+  EXPECT_TRUE(cache.add(state(2), false, false, 0));
+  cache.release(okvis::Time(2, 0));
+  EXPECT_FALSE(cache.add(state(3), false, false, 0));
+}
@@ -0,0 +1,161 @@
+/**
+ * @file SpatialHashTest.cpp
+ * @brief Insert / erase / lookup of the flat spatial hash, and the cell summary the planner trusts
+ * to skip the octrees of free boxes.
+ */
+
+#include <algorithm>
+#include <set>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <SpatialHash.hpp>
+
+namespace {
+
+std::vector<int> ids(const SpatialHash &hash, const SpatialHash::Cell &cell) {
+  std::vector<int> out;
+  hash.forEachId(cell, [&](const int id) { out.push_back(id); });
+  std::sort(out.begin(), out.end());
+  return out;
+}
+
+} // namespace
+
+TEST(SpatialHash, PackUnpack)
+{
+  const std::vector<Eigen::Vector3i> coords = {
+      {0, 0, 0}, {1, -1, 2}, {-1048576, 1048575, -3}, {1048575, -1048576, 0}, {-7, -7, -7}};
+  std::set<SpatialHash::Key> keys;
+  for (const auto &coord : coords) {
+    EXPECT_EQ(SpatialHash::unpack(SpatialHash::pack(coord)), coord);
+    keys.insert(SpatialHash::pack(coord));
+  }
+  EXPECT_EQ(keys.size(), coords.size());
+}
+
+TEST(SpatialHash, InsertErase)
+{
+  SpatialHash hash(4);
+  const Eigen::Vector3i box(1, 2, 3);
+  EXPECT_EQ(hash.find(box), nullptr);
+
+  EXPECT_TRUE(hash.insert(box, 7));
+  EXPECT_FALSE(hash.insert(box, 7)); // only the flags are set
+  EXPECT_TRUE(hash.insert(box, 9));
+  ASSERT_NE(hash.find(box), nullptr);
+  EXPECT_EQ(hash.size(), 1u);
+  EXPECT_EQ(ids(hash, *hash.find(box)), std::vector<int>({7, 9}));
+
+  EXPECT_FALSE(hash.erase(box, 8));
+  EXPECT_TRUE(hash.erase(box, 7));
+  EXPECT_EQ(ids(hash, *hash.find(box)), std::vector<int>({9}));
+  EXPECT_TRUE(hash.erase(box, 9));
+  EXPECT_EQ(hash.find(box), nullptr); // empty boxes go
+  EXPECT_TRUE(hash.empty());
+}
+
+TEST(SpatialHash, SpilledIds)
+{
+  SpatialHash hash;
+  const Eigen::Vector3i box(-4, 0, 5);
+  const int n = 3 * SpatialHash::kInlineIds;
+  for (int id = 0; id < n; id++) EXPECT_TRUE(hash.insert(box, id, SpatialHash::kFree));
+  ASSERT_NE(hash.find(box), nullptr);
+  EXPECT_EQ(hash.find(box)->count, static_cast<uint32_t>(n));
+
+  // the flags of a spilled id count in the summary
+  EXPECT_TRUE(hash.setFlags(SpatialHash::pack(box), n - 1, SpatialHash::kOccupied));
+  EXPECT_FALSE(hash.find(box)->free());
+
+  // erasing inline ids keeps the spilled ones reachable
+  std::vector<int> expected;
+  for (int id = 0; id < n; id++) {
+    if (id % 2) expected.push_back(id);
+    else EXPECT_TRUE(hash.erase(box, id));
+  }
+  EXPECT_EQ(ids(hash, *hash.find(box)), expected);
+  EXPECT_EQ(hash.find(box)->summary, SpatialHash::kOccupied);
+
+  EXPECT_TRUE(hash.erase(box, n - 1));
+  EXPECT_TRUE(hash.find(box)->free());
+}
+
+TEST(SpatialHash, Growth)
+{
+  SpatialHash hash(2);
+  std::vector<Eigen::Vector3i> boxes;
+  for (int x = -10; x < 10; x++) {
+    for (int y = -10; y < 10; y++) boxes.emplace_back(x, y, x * y);
+  }
+  for (size_t i = 0; i < boxes.size(); i++) hash.insert(boxes[i], i % 5);
+  EXPECT_EQ(hash.size(), boxes.size());
+  EXPECT_LT(hash.loadFactor(), 1.0);
+  for (size_t i = 0; i < boxes.size(); i++) {
+    ASSERT_NE(hash.find(boxes[i]), nullptr);
+    EXPECT_EQ(ids(hash, *hash.find(boxes[i])), std::vector<int>({static_cast<int>(i % 5)}));
+  }
+
+  // backward shift deletion: the rest stays reachable
+  for (size_t i = 0; i < boxes.size(); i += 2) EXPECT_TRUE(hash.erase(boxes[i], i % 5));
+  for (size_t i = 0; i < boxes.size(); i++) EXPECT_EQ(hash.count(boxes[i]), i % 2 == 1);
+  size_t cells = 0;
+  hash.forEachCell([&](const SpatialHash::Key, const SpatialHash::Cell &) { cells++; });
+  EXPECT_EQ(cells, hash.size());
+}
+
+// free only if no submap may be occupied there and one submap saw all of the box
+TEST(SpatialHash, Summary)
+{
+  SpatialHash hash;
+  const SpatialHash::Key key = SpatialHash::pack(Eigen::Vector3i(0, 0, 0));
+
+  hash.insert(key, 1); // not evaluated
+  EXPECT_FALSE(hash.find(key)->free());
+  EXPECT_EQ(hash.find(key)->summary, SpatialHash::kUnknown);
+
+  hash.setFlags(key, 1, SpatialHash::kUnobserved);
+  EXPECT_EQ(hash.find(key)->summary, SpatialHash::kUnobserved);
+
+  hash.insert(key, 2, SpatialHash::kFree); // a submap that saw it all free
+  EXPECT_TRUE(hash.find(key)->free());
+  EXPECT_EQ(hash.find(key)->summary, SpatialHash::kFree);
+
+  hash.insert(key, 3, SpatialHash::kOccupied | SpatialHash::kUnobserved);
+  EXPECT_FALSE(hash.find(key)->free());
+  EXPECT_TRUE(hash.find(key)->summary & SpatialHash::kOccupied);
+
+  hash.insert(key, 3, SpatialHash::kFree); // re-flagged, e.g. after a loop closure
+  EXPECT_TRUE(hash.find(key)->free());
+
+  hash.insert(key, 4); // kUnknown may be occupied
+  EXPECT_FALSE(hash.find(key)->free());
+  hash.erase(key, 4);
+  EXPECT_TRUE(hash.find(key)->free());
+
+  hash.erase(key, 2);
+  hash.erase(key, 3);
+  EXPECT_EQ(hash.find(key)->summary, SpatialHash::kUnobserved);
+}
+
+TEST(SpatialHash, RasterizeBox)
+{
+  // axis aligned: exactly the boxes it covers
+  std::vector<SpatialHash::Key> keys;
+  SpatialHash::rasterizeBox(Eigen::Matrix4f::Identity(), Eigen::Vector3f(0.1f, 0.1f, 0.1f),
+                            Eigen::Vector3f(1.9f, 0.9f, 0.9f), 1.f, keys);
+  EXPECT_EQ(keys, std::vector<SpatialHash::Key>({SpatialHash::pack(Eigen::Vector3i(0, 0, 0)),
+                                                 SpatialHash::pack(Eigen::Vector3i(1, 0, 0))}));
+
+  // rotated: sorted, each box once, including the one holding the centre
+  Eigen::Matrix4f T_WB = Eigen::Matrix4f::Identity();
+  T_WB.topLeftCorner<3,3>() = Eigen::AngleAxisf(0.7f, Eigen::Vector3f::UnitZ()).toRotationMatrix();
+  T_WB.topRightCorner<3,1>() = Eigen::Vector3f(-3.2f, 5.5f, 0.3f);
+  keys.clear();
+  SpatialHash::rasterizeBox(T_WB, Eigen::Vector3f(-2, -1, -1), Eigen::Vector3f(2, 1, 1), 1.f, keys);
+  EXPECT_TRUE(std::is_sorted(keys.begin(), keys.end()));
+  EXPECT_EQ(std::adjacent_find(keys.begin(), keys.end()), keys.end());
+  const Eigen::Vector3i centre = T_WB.topRightCorner<3,1>().array().floor().cast<int>();
+  EXPECT_TRUE(std::binary_search(keys.begin(), keys.end(), SpatialHash::pack(centre)));
+}
@@ -0,0 +1,97 @@
+/**
+ * @file SubmapSessionTest.cpp
+ * @brief Saving a session over an older one: the index always points at a complete session,
+ * and the files it does not point at go.
+ */
+
+#include <cstdlib>
+#include <fstream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <gtest/gtest.h>
+
+#include <SubmapSession.hpp>
+
+namespace {
+
+std::vector<SessionSubmap> submaps(const std::vector<uint64_t> &ids) {
+  std::vector<SessionSubmap> out;
+  for (const uint64_t id : ids) {
+    SessionSubmap submap;
+    submap.id = id;
+    submap.T_WK(0, 3) = id;
+    submap.cells = {SpatialHash::pack(Eigen::Vector3i(id, 0, 0))};
+    submap.map = std::make_shared<se::OccupancyMap<se::Res::Multi>>(se::MapConfig(), se::OccupancyDataConfig());
+    out.push_back(submap);
+  }
+  return out;
+}
+
+std::set<std::string> sessionFiles(const std::string &directory) {
+  std::set<std::string> files;
+  for (boost::filesystem::directory_iterator it(directory), end; it != end; ++it) {
+    if (it->path().extension() == ".session") files.insert(it->path().filename().string());
+  }
+  return files;
+}
+
+class SubmapSessionTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    char directory[] = "/tmp/submap_session_testXXXXXX";
+    ASSERT_TRUE(mkdtemp(directory));
+    directory_ = directory;
+  }
+  void TearDown() override { boost::filesystem::remove_all(directory_); }
+
+  std::string directory_;
+};
+
+} // namespace
+
+TEST_F(SubmapSessionTest, SaveLoad)
+{
+  SessionIndex index;
+  EXPECT_FALSE(SubmapSession::readIndex(directory_, index));
+
+  ASSERT_TRUE(SubmapSession::save(directory_, submaps({1, 2})));
+  ASSERT_TRUE(SubmapSession::readIndex(directory_, index));
+  EXPECT_EQ(index.ids, std::vector<uint64_t>({1, 2}));
+
+  SessionSubmap submap;
+  ASSERT_TRUE(SubmapSession::load(directory_, index, 2, se::MapConfig(), se::OccupancyDataConfig(), submap));
+  EXPECT_EQ(submap.id, 2u);
+  EXPECT_EQ(submap.T_WK(0, 3), 2.0);
+  EXPECT_EQ(submap.cells, submaps({2})[0].cells);
+  EXPECT_TRUE(submap.map);
+  EXPECT_FALSE(SubmapSession::load(directory_, index, 3, se::MapConfig(), se::OccupancyDataConfig(), submap));
+}
+
+// okvis ids repeat across runs: a new save must not touch the files of the indexed one
+TEST_F(SubmapSessionTest, Resave)
+{
+  ASSERT_TRUE(SubmapSession::save(directory_, submaps({1, 2})));
+  SessionIndex first;
+  ASSERT_TRUE(SubmapSession::readIndex(directory_, first));
+
+  // a save that died before its index: leftovers of the next generation
+  const std::string leftover = directory_ + "/" + std::to_string(first.generation + 1) + "_9.session";
+  std::ofstream(leftover) << "partial";
+  SessionIndex index;
+  ASSERT_TRUE(SubmapSession::readIndex(directory_, index));
+  EXPECT_EQ(index.generation, first.generation);
+  SessionSubmap submap;
+  EXPECT_TRUE(SubmapSession::load(directory_, index, 2, se::MapConfig(), se::OccupancyDataConfig(), submap));
+
+  ASSERT_TRUE(SubmapSession::save(directory_, submaps({2, 3})));
+  ASSERT_TRUE(SubmapSession::readIndex(directory_, index));
+  EXPECT_GT(index.generation, first.generation);
+  EXPECT_EQ(index.ids, std::vector<uint64_t>({2, 3}));
+  EXPECT_EQ(sessionFiles(directory_).size(), 2u); // the old ones and the leftover are gone
+  EXPECT_FALSE(SubmapSession::load(directory_, first, 1, se::MapConfig(), se::OccupancyDataConfig(), submap));
+  EXPECT_TRUE(SubmapSession::load(directory_, index, 3, se::MapConfig(), se::OccupancyDataConfig(), submap));
+  EXPECT_EQ(submap.T_WK(0, 3), 3.0);
+}
@@ -0,0 +1,188 @@
+/**
+ * @file SubmapStoreTest.cpp
+ * @brief Evicted submaps come back from disk as they were: same octants, same data and max data
+ * at every scale, hence the same spatial hash flags.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <SubmapStore.hpp>
+#include <SupereightInterface.hpp>
+
+namespace {
+
+typedef se::OccupancyMap<se::Res::Multi> MapT;
+typedef typename MapT::OctreeType OctreeT;
+typedef typename OctreeT::BlockType BlockType;
+
+se::MapConfig mapConfig() {
+  se::MapConfig config;
+  config.dim = Eigen::Vector3f::Constant(12.8f);
+  config.res = 0.1f;
+  config.T_MW = Eigen::Matrix4f::Identity();
+  config.T_MW.topRightCorner<3,1>() = config.dim / 2; // world origin in the middle
+  return config;
+}
+
+// a few frames of a camera at the origin looking along z at a wall 3 m away
+SubmapPtr wallMap() {
+  auto map = std::make_shared<MapT>(mapConfig(), se::OccupancyDataConfig());
+
+  se::PinholeCameraConfig cameraConfig;
+  cameraConfig.width = 64;
+  cameraConfig.height = 48;
+  cameraConfig.fx = cameraConfig.fy = 40.f;
+  cameraConfig.cx = 32.f;
+  cameraConfig.cy = 24.f;
+  cameraConfig.near_plane = 0.2f;
+  cameraConfig.far_plane = 6.f;
+  cameraConfig.T_BS = Eigen::Matrix4f::Identity();
+  const se::PinholeCamera sensor(cameraConfig);
+
+  se::Image<float> depth(cameraConfig.width, cameraConfig.height, 3.f);
+  se::MapIntegrator integrator(*map);
+  for (unsigned frame = 0; frame < 5; frame++) integrator.integrateDepth(sensor, depth, Eigen::Matrix4f::Identity(), frame);
+  return map;
+}
+
+int sizeToScale(int size) {
+  int scale = 0;
+  while ((1 << scale) < size) scale++;
+  return scale;
+}
+
+SubmapPtr roundTrip(const MapT &map) {
+  std::string buffer;
+  SubmapStore::serialize(map, buffer);
+  se::MapConfig config;
+  if (!SubmapStore::readConfig(buffer.data(), buffer.size(), config)) return nullptr;
+  auto restored = std::make_shared<MapT>(config, se::OccupancyDataConfig());
+  if (!SubmapStore::deserialize(buffer.data(), buffer.size(), *restored)) return nullptr;
+  return restored;
+}
+
+} // namespace
+
+TEST(SubmapStore, RoundTripAllScales)
+{
+  const SubmapPtr map = wallMap();
+  const SubmapPtr restored = roundTrip(*map);
+  ASSERT_TRUE(restored);
+  EXPECT_FLOAT_EQ(restored->getRes(), map->getRes());
+  EXPECT_TRUE(restored->getTWM().isApprox(map->getTWM()));
+
+  const OctreeMemory before = SubmapStore::octreeMemory(*map);
+  const OctreeMemory after = SubmapStore::octreeMemory(*restored);
+  EXPECT_EQ(after.blocks, before.blocks);
+  EXPECT_EQ(after.nodes, before.nodes);
+
+  // every voxel of every block at every scale it has, then the coarser nodes above it
+  const int octree_scale = sizeToScale(map->getOctree()->getSize());
+  const int block_scale = sizeToScale(BlockType::getSize());
+  size_t occupied = 0;
+  for (auto octant_it = se::LeavesIterator<OctreeT>(map->getOctree().get()); octant_it != se::LeavesIterator<OctreeT>(); ++octant_it) {
+    if (!(*octant_it)->isBlock()) continue;
+    const BlockType *block_ptr = static_cast<const BlockType *>(*octant_it);
+    const Eigen::Vector3i coord = block_ptr->getCoord();
+    for (int scale = block_ptr->getCurrentScale(); scale <= octree_scale; scale++) {
+      const int step = 1 << std::min(scale, block_scale);
+      for (int x = 0; x < BlockType::getSize(); x += step) {
+        for (int y = 0; y < BlockType::getSize(); y += step) {
+          for (int z = 0; z < BlockType::getSize(); z += step) {
+            Eigen::Vector3f point;
+            map->voxelToPoint(coord + Eigen::Vector3i(x, y, z), point);
+            const auto expected = map->getMaxData(point, scale);
+            const auto actual = restored->getMaxData(point, scale);
+            ASSERT_EQ(actual.occupancy, expected.occupancy) << "scale " << scale;
+            ASSERT_EQ(actual.weight, expected.weight) << "scale " << scale;
+            if (expected.occupancy * expected.weight > 0) occupied++;
+            if (scale == block_ptr->getCurrentScale()) {
+              ASSERT_EQ(restored->getData(point).occupancy, map->getData(point).occupancy);
+              ASSERT_EQ(restored->getData(point).weight, map->getData(point).weight);
+            }
+          }
+        }
+      }
+    }
+  }
+  EXPECT_GT(occupied, 0u); // the wall is in
+}
+
+// the planner skips the octrees of free boxes: a reloaded map must not turn the wall free
+TEST(SubmapStore, CellFlagsAfterReload)
+{
+  const SubmapPtr map = wallMap();
+  const SubmapPtr restored = roundTrip(*map);
+  ASSERT_TRUE(restored);
+
+  // 1 m boxes: in front of the wall, on it (z = 3 m) and behind it
+  std::vector<SpatialHash::Key> cells;
+  for (int x = -2; x < 2; x++) {
+    for (int y = -1; y < 1; y++) {
+      for (int z = 0; z < 5; z++) cells.push_back(SpatialHash::pack(Eigen::Vector3i(x, y, z)));
+    }
+  }
+  std::sort(cells.begin(), cells.end());
+  const Eigen::Matrix4f T_WM = map->getTWM(); // submap at the world origin
+  const std::vector<uint8_t> expected = SupereightInterface::computeCellFlags(*map, cells, T_WM, 1.f);
+  const std::vector<uint8_t> actual = SupereightInterface::computeCellFlags(*restored, cells, T_WM, 1.f);
+  EXPECT_EQ(actual, expected);
+
+  const size_t wall = std::lower_bound(cells.begin(), cells.end(), SpatialHash::pack(Eigen::Vector3i(0, 0, 3))) - cells.begin();
+  const size_t front = std::lower_bound(cells.begin(), cells.end(), SpatialHash::pack(Eigen::Vector3i(0, 0, 1))) - cells.begin();
+  EXPECT_TRUE(expected[wall] & SpatialHash::kOccupied);
+  EXPECT_TRUE(actual[wall] & SpatialHash::kOccupied);
+  EXPECT_FALSE(actual[front] & SpatialHash::kOccupied);
+
+  // with another submap seeing the box free, the cell must still not be free
+  SpatialHash hash;
+  hash.insert(cells[wall], 1, actual[wall]);
+  hash.insert(cells[wall], 2, SpatialHash::kFree);
+  EXPECT_FALSE(hash.find(cells[wall])->free());
+}
+
+TEST(SubmapStore, RejectsBadBuffers)
+{
+  const SubmapPtr map = wallMap();
+  std::string buffer;
+  SubmapStore::serialize(*map, buffer);
+
+  MapT truncated(mapConfig(), se::OccupancyDataConfig());
+  EXPECT_FALSE(SubmapStore::deserialize(buffer.data(), buffer.size() - 1, truncated));
+
+  std::string other = buffer;
+  other[4] = 1; // version 1: leaves only, no coarse scales
+  se::MapConfig config;
+  EXPECT_FALSE(SubmapStore::readConfig(other.data(), other.size(), config));
+  MapT old(mapConfig(), se::OccupancyDataConfig());
+  EXPECT_FALSE(SubmapStore::deserialize(other.data(), other.size(), old));
+}
+
+TEST(SubmapStore, SaveLoad)
+{
+  char directory[] = "/tmp/submap_store_testXXXXXX";
+  ASSERT_TRUE(mkdtemp(directory));
+  SubmapStore store(directory, mapConfig(), se::OccupancyDataConfig(), 1);
+
+  const SubmapPtr map = wallMap();
+  EXPECT_FALSE(store.load(3));
+  ASSERT_TRUE(store.save(3, *map));
+  EXPECT_TRUE(store.contains(3));
+
+  const SubmapPtr loaded = store.load(3);
+  ASSERT_TRUE(loaded);
+  EXPECT_EQ(store.load(3), loaded); // from the cache
+  EXPECT_EQ(store.stats().evictions, 1u);
+  EXPECT_EQ(store.stats().misses, 1u);
+  EXPECT_EQ(store.stats().hits, 1u);
+  EXPECT_EQ(SubmapStore::octreeMemory(*loaded).blocks, SubmapStore::octreeMemory(*map).blocks);
+
+  std::remove((std::string(directory) + "/3.submap").c_str());
+  std::remove(directory);
+}